@@ -0,0 +1,513 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "phgrid.h"
+
+// the grid's memory comes from the allocator of its tree
+#define grid_allocator(grid) (&(grid)->tree->allocator)
+
+/*
+ * every input to the tree is an int32_t[2] of cell coordinates
+ */
+static void cell_to_point (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	int32_t* coordinates = input;
+
+	ph2_point_set (tree, out, &coordinates[0], &coordinates[1]);
+}
+
+/*
+ * cells start out zeroed with no range
+ * 	the first point in a cell gives it one
+ */
+static void cell_initialize (void* element, void* input)
+{
+	phgrid_cell_t* cell = element;
+	int32_t* coordinates = input;
+
+	cell->x = coordinates[0];
+	cell->y = coordinates[1];
+}
+
+/*
+ * values outside of the int32 range of cells are clamped to the outermost cells
+ */
+static int32_t cell_coordinate (float cell_size, float value)
+{
+	float cell = floorf (value / cell_size);
+
+	if (isnan (cell))
+	{
+		return 0;
+	}
+
+	if (cell <= (float) INT32_MIN)
+	{
+		return INT32_MIN;
+	}
+
+	// INT32_MAX is not a float, this is the float right above it
+	if (cell >= -(float) INT32_MIN)
+	{
+		return INT32_MAX;
+	}
+
+	return (int32_t) cell;
+}
+
+void phgrid_cell_coordinates (phgrid_t* grid, float x, float y, int32_t* cell_x, int32_t* cell_y)
+{
+	*cell_x = cell_coordinate (grid->cell_size, x);
+	*cell_y = cell_coordinate (grid->cell_size, y);
+}
+
+/*
+ * the range a cell gets when the points array is rebuilt
+ * 	room for half again as many points, and always at least one more
+ * 		small grids with one point in most cells should not be mostly slack
+ */
+static uint32_t cell_capacity (uint32_t count)
+{
+	return count + (count / 2) + 1;
+}
+
+/*
+ * make sure the points array has room for needed slots
+ * 	cell ranges are 32 bit, so the array never grows past UINT32_MAX slots
+ */
+static int points_reserve (phgrid_t* grid, size_t needed)
+{
+	if (needed <= grid->capacity)
+	{
+		return 0;
+	}
+
+	if (needed > UINT32_MAX)
+	{
+		return 1;
+	}
+
+	size_t new_capacity = grid->capacity ? grid->capacity * 2 : 1024;
+
+	while (new_capacity < needed)
+	{
+		new_capacity *= 2;
+	}
+
+	if (new_capacity > UINT32_MAX)
+	{
+		new_capacity = UINT32_MAX;
+	}
+
+	phgrid_point_t* points = phtree_allocator_realloc (grid_allocator (grid), grid->points, new_capacity * sizeof (*points));
+
+	if (!points)
+	{
+		return 1;
+	}
+
+	grid->points = points;
+	grid->capacity = new_capacity;
+
+	return 0;
+}
+
+/*
+ * double the range of a full cell
+ * 	the range at the end of the array grows where it is
+ * 	any other range moves to the end of the array and leaves its old slots unused
+ */
+static int cell_grow (phgrid_t* grid, phgrid_cell_t* cell)
+{
+	if (cell->capacity > UINT32_MAX / 2)
+	{
+		return 1;
+	}
+
+	uint32_t new_capacity = cell->capacity ? cell->capacity * 2 : PHGRID_CELL_CAPACITY_MIN;
+
+	if (cell->capacity && (size_t) cell->start + cell->capacity == grid->used)
+	{
+		if (points_reserve (grid, grid->used + (new_capacity - cell->capacity)))
+		{
+			return 1;
+		}
+
+		grid->used += new_capacity - cell->capacity;
+		cell->capacity = new_capacity;
+
+		return 0;
+	}
+
+	if (points_reserve (grid, grid->used + new_capacity))
+	{
+		return 1;
+	}
+
+	memcpy (&grid->points[grid->used], &grid->points[cell->start], cell->count * sizeof (*grid->points));
+	grid->unused += cell->capacity;
+	cell->start = (uint32_t) grid->used;
+	cell->capacity = new_capacity;
+	grid->used += new_capacity;
+
+	return 0;
+}
+
+/*
+ * give the range of an empty cell back
+ */
+static void cell_release (phgrid_t* grid, phgrid_cell_t* cell)
+{
+	if ((size_t) cell->start + cell->capacity == grid->used)
+	{
+		grid->used -= cell->capacity;
+	}
+	else
+	{
+		grid->unused += cell->capacity;
+	}
+
+	cell->capacity = 0;
+}
+
+/*
+ * the index in the cell of the first point with id
+ * 	returns cell->count if there is none
+ */
+static uint32_t cell_point_find (phgrid_t* grid, phgrid_cell_t* cell, uint32_t id)
+{
+	phgrid_point_t* points = &grid->points[cell->start];
+	uint32_t iter = 0;
+
+	while (iter < cell->count && points[iter].id != id)
+	{
+		iter++;
+	}
+
+	return iter;
+}
+
+/*
+ * compacting
+ * 	one walk to size the new array, one walk to fill it
+ * 		both walks are in tree order, so the new array is too
+ */
+typedef struct
+{
+	phgrid_t* grid;
+	phgrid_point_t* points;
+	size_t used;
+} compact_t;
+
+static void compact_measure (void* element, void* data)
+{
+	phgrid_cell_t* cell = element;
+	compact_t* compact = data;
+
+	compact->used += cell_capacity (cell->count);
+}
+
+static void compact_cell (void* element, void* data)
+{
+	phgrid_cell_t* cell = element;
+	compact_t* compact = data;
+
+	memcpy (&compact->points[compact->used], &compact->grid->points[cell->start], cell->count * sizeof (*compact->points));
+	cell->start = (uint32_t) compact->used;
+	cell->capacity = cell_capacity (cell->count);
+	compact->used += cell->capacity;
+}
+
+int phgrid_compact (phgrid_t* grid)
+{
+	compact_t compact = {grid, NULL, 0};
+
+	ph2_for_each (grid->tree, compact_measure, &compact);
+
+	if (compact.used > UINT32_MAX)
+	{
+		return 1;
+	}
+
+	compact.points = phtree_allocator_calloc (grid_allocator (grid), compact.used ? compact.used : 1, sizeof (*compact.points));
+
+	if (!compact.points)
+	{
+		return 1;
+	}
+
+	compact.used = 0;
+	ph2_for_each (grid->tree, compact_cell, &compact);
+
+	phtree_allocator_free (grid_allocator (grid), grid->points);
+	grid->points = compact.points;
+	grid->capacity = compact.used ? compact.used : 1;
+	grid->used = compact.used;
+	grid->unused = 0;
+
+	return 0;
+}
+
+static void compact_if_needed (phgrid_t* grid)
+{
+	if (grid->unused >= PHGRID_COMPACT_MIN && grid->unused > grid->count)
+	{
+		// on failure the grid just keeps its unused slots
+		phgrid_compact (grid);
+	}
+}
+
+phgrid_t* phgrid_create (float cell_size, ph2_options_t* options)
+{
+	if (!(cell_size > 0.0f))
+	{
+		return NULL;
+	}
+
+	ph2_options_t tree_options;
+
+	if (options)
+	{
+		tree_options = *options;
+	}
+	else
+	{
+		ph2_options_default (&tree_options);
+	}
+
+	// cells are changed in place, which readers on other threads would see
+	tree_options.concurrent = false;
+	tree_options.element_size = sizeof (phgrid_cell_t);
+	tree_options.element_initialize = cell_initialize;
+
+	phgrid_t* grid = phtree_allocator_calloc (tree_options.allocator, 1, sizeof (*grid));
+
+	if (!grid)
+	{
+		return NULL;
+	}
+
+	grid->tree = ph2_create (NULL, NULL, phtree_int32_to_key, cell_to_point, NULL, &tree_options);
+
+	if (!grid->tree)
+	{
+		phtree_allocator_free (tree_options.allocator, grid);
+		return NULL;
+	}
+
+	grid->cell_size = cell_size;
+
+	return grid;
+}
+
+void phgrid_free (phgrid_t* grid)
+{
+	if (!grid)
+	{
+		return;
+	}
+
+	// the allocator is inside of the tree being freed
+	phtree_allocator_t allocator = grid->tree->allocator;
+
+	phtree_allocator_free (&allocator, grid->points);
+	ph2_free (grid->tree);
+	phtree_allocator_free (&allocator, grid);
+}
+
+int phgrid_insert (phgrid_t* grid, float x, float y, uint32_t id)
+{
+	// a nan point would be taken whole by queries of the cells around cell 0
+	if (isnan (x) || isnan (y))
+	{
+		return 1;
+	}
+
+	int32_t coordinates[2];
+
+	phgrid_cell_coordinates (grid, x, y, &coordinates[0], &coordinates[1]);
+
+	phgrid_cell_t* cell = ph2_insert (grid->tree, coordinates);
+
+	if (!cell)
+	{
+		return 1;
+	}
+
+	if (cell->count == cell->capacity && cell_grow (grid, cell))
+	{
+		// dont leave a cell with no points behind
+		if (cell->count == 0)
+		{
+			ph2_remove (grid->tree, coordinates);
+		}
+
+		return 1;
+	}
+
+	grid->points[cell->start + cell->count] = (phgrid_point_t) {x, y, id};
+	cell->count++;
+	grid->count++;
+
+	compact_if_needed (grid);
+
+	return 0;
+}
+
+int phgrid_remove (phgrid_t* grid, float x, float y, uint32_t id)
+{
+	int32_t coordinates[2];
+
+	phgrid_cell_coordinates (grid, x, y, &coordinates[0], &coordinates[1]);
+
+	phgrid_cell_t* cell = ph2_find (grid->tree, coordinates);
+
+	if (!cell)
+	{
+		return 1;
+	}
+
+	uint32_t index = cell_point_find (grid, cell, id);
+
+	if (index == cell->count)
+	{
+		return 1;
+	}
+
+	// the order of points inside of a cell does not matter
+	cell->count--;
+	grid->points[cell->start + index] = grid->points[cell->start + cell->count];
+	grid->count--;
+
+	if (cell->count == 0)
+	{
+		cell_release (grid, cell);
+		ph2_remove (grid->tree, coordinates);
+	}
+
+	compact_if_needed (grid);
+
+	return 0;
+}
+
+int phgrid_move (phgrid_t* grid, float old_x, float old_y, float new_x, float new_y, uint32_t id)
+{
+	if (isnan (new_x) || isnan (new_y))
+	{
+		return 1;
+	}
+
+	int32_t old_coordinates[2];
+	int32_t new_coordinates[2];
+
+	phgrid_cell_coordinates (grid, old_x, old_y, &old_coordinates[0], &old_coordinates[1]);
+	phgrid_cell_coordinates (grid, new_x, new_y, &new_coordinates[0], &new_coordinates[1]);
+
+	phgrid_cell_t* cell = ph2_find (grid->tree, old_coordinates);
+
+	if (!cell)
+	{
+		return 1;
+	}
+
+	uint32_t index = cell_point_find (grid, cell, id);
+
+	if (index == cell->count)
+	{
+		return 1;
+	}
+
+	if (old_coordinates[0] == new_coordinates[0] && old_coordinates[1] == new_coordinates[1])
+	{
+		grid->points[cell->start + index].x = new_x;
+		grid->points[cell->start + index].y = new_y;
+		return 0;
+	}
+
+	// insert first so a failed insert leaves the point where it was
+	// 	the insert can move the points array, so cell is looked up again by phgrid_remove
+	if (phgrid_insert (grid, new_x, new_y, id))
+	{
+		return 1;
+	}
+
+	return phgrid_remove (grid, old_x, old_y, id);
+}
+
+/*
+ * window queries
+ */
+typedef struct
+{
+	phgrid_t* grid;
+	float min_x;
+	float min_y;
+	float max_x;
+	float max_y;
+	// the cells min and max fall in to
+	int32_t min_cell[2];
+	int32_t max_cell[2];
+	phgrid_point_function_t function;
+	void* data;
+} grid_query_t;
+
+static void query_cell (void* element, void* data)
+{
+	phgrid_cell_t* cell = element;
+	grid_query_t* query = data;
+	phgrid_point_t* points = &query->grid->points[cell->start];
+
+	// floorf (value / cell_size) never gets smaller as value gets bigger
+	// 	so every point in a cell strictly between the edge cells is strictly inside of the window
+	bool inside = cell->x > query->min_cell[0] && cell->x < query->max_cell[0]
+		&& cell->y > query->min_cell[1] && cell->y < query->max_cell[1];
+
+	if (inside)
+	{
+		for (uint32_t iter = 0; iter < cell->count; iter++)
+		{
+			query->function (&points[iter], query->data);
+		}
+
+		return;
+	}
+
+	for (uint32_t iter = 0; iter < cell->count; iter++)
+	{
+		phgrid_point_t* point = &points[iter];
+
+		if (point->x >= query->min_x && point->x <= query->max_x && point->y >= query->min_y && point->y <= query->max_y)
+		{
+			query->function (point, query->data);
+		}
+	}
+}
+
+void phgrid_query_points (phgrid_t* grid, float min_x, float min_y, float max_x, float max_y, phgrid_point_function_t function, void* data)
+{
+	// nan windows have nothing in them
+	if (!function || !(min_x <= max_x) || !(min_y <= max_y))
+	{
+		return;
+	}
+
+	grid_query_t grid_query =
+	{
+		.grid = grid,
+		.min_x = min_x,
+		.min_y = min_y,
+		.max_x = max_x,
+		.max_y = max_y,
+		.function = function,
+		.data = data,
+	};
+
+	phgrid_cell_coordinates (grid, min_x, min_y, &grid_query.min_cell[0], &grid_query.min_cell[1]);
+	phgrid_cell_coordinates (grid, max_x, max_y, &grid_query.max_cell[0], &grid_query.max_cell[1]);
+
+	ph2_query_t query;
+
+	ph2_query_set (grid->tree, &query, grid_query.min_cell, grid_query.max_cell, query_cell);
+	ph2_query (grid->tree, &query, &grid_query);
+}
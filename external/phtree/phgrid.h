@@ -0,0 +1,125 @@
+#ifndef _phgrid_h_
+#define _phgrid_h_
+/*
+ * a spatial hash grid of points on top of a ph2 tree
+ *
+ * the plane is cut in to square cells of cell_size
+ * 	every cell which has points in it is one element of the tree
+ * 		keyed by the floored cell coordinates
+ * 	the points themselves are not in the tree
+ * 		they live in one array shared by every cell
+ * 		each cell owns a range of that array
+ *
+ * when a cell runs out of room its range moves to the end of the array
+ * 	which leaves the old range unused
+ * 	once there are more unused slots than points the array is compacted
+ * 		cell ranges are rebuilt in the order of the tree
+ * 		so cells which are close together have their points close together
+ *
+ * a grid is not safe to use from more than one thread at a time
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "phtree32_2d.h"
+
+// the range a cell gets for its first point
+#define PHGRID_CELL_CAPACITY_MIN 4
+// compacting is not worth it for less unused slots than this
+#define PHGRID_COMPACT_MIN 4096
+
+typedef struct phgrid_point_t
+{
+	float x;
+	float y;
+	// whatever you use to find the thing at this point
+	uint32_t id;
+} phgrid_point_t;
+
+/*
+ * the elements of the tree
+ * 	points[start] to points[start + count - 1] are the points in the cell
+ * 	points[start + count] to points[start + capacity - 1] are free for new points
+ */
+typedef struct phgrid_cell_t
+{
+	int32_t x;
+	int32_t y;
+	uint32_t start;
+	uint32_t count;
+	uint32_t capacity;
+} phgrid_cell_t;
+
+typedef struct phgrid_t
+{
+	ph2_t* tree;
+	float cell_size;
+
+	phgrid_point_t* points;
+	// points[0] to points[used - 1] have been handed out to cells
+	size_t used;
+	size_t capacity;
+	// points in the grid
+	size_t count;
+	// slots before used which no cell owns any more
+	size_t unused;
+} phgrid_t;
+
+/*
+ * run on points found by phgrid_query_points
+ * 	the grid must not be changed while a query is running
+ */
+typedef void (*phgrid_point_function_t) (phgrid_point_t* point, void* data);
+
+/*
+ * cell_size must be > 0
+ * options are passed on to the tree, NULL uses the defaults
+ * 	concurrent, element_size, and element_initialize are set by the grid
+ * 	the points array also comes from options->allocator
+ *
+ * returns NULL on failure
+ */
+phgrid_t* phgrid_create (float cell_size, ph2_options_t* options);
+void phgrid_free (phgrid_t* grid);
+
+/*
+ * ids do not have to be unique
+ * 	but phgrid_remove and phgrid_move take out whichever point with the id they find first in the cell
+ *
+ * returns 0 on success
+ */
+int phgrid_insert (phgrid_t* grid, float x, float y, uint32_t id);
+/*
+ * x and y are where the point was inserted
+ *
+ * returns 0 if the point was found and removed
+ */
+int phgrid_remove (phgrid_t* grid, float x, float y, uint32_t id);
+/*
+ * move a point from (old_x, old_y) to (new_x, new_y)
+ * 	points which stay in the same cell are updated in place
+ *
+ * returns 0 on success
+ */
+int phgrid_move (phgrid_t* grid, float old_x, float old_y, float new_x, float new_y, uint32_t id);
+/*
+ * run function on every point with min_x <= x <= max_x and min_y <= y <= max_y
+ * 	cells on the edge of the window have every point checked
+ * 	cells inside of the window are taken whole
+ */
+void phgrid_query_points (phgrid_t* grid, float min_x, float min_y, float max_x, float max_y, phgrid_point_function_t function, void* data);
+/*
+ * rebuild the points array without unused slots
+ * 	the grid does this by itself, this just forces it
+ *
+ * returns 0 on success, the grid is unchanged on failure
+ */
+int phgrid_compact (phgrid_t* grid);
+/*
+ * the cell (x, y) falls in to
+ */
+void phgrid_cell_coordinates (phgrid_t* grid, float x, float y, int32_t* cell_x, int32_t* cell_y);
+
+#endif  // end _phgrid_h_
@@ -1,10 +1,47 @@
+#include <math.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <string.h>
 
+// ph2_map uses mmap where it is available
+// 	and reads the whole file in to memory everywhere else
+#if !defined (PHTREE_MAP_MMAP) && (defined (__unix__) || defined (__APPLE__))
+#define PHTREE_MAP_MMAP 1
+#endif
+
+#if PHTREE_MAP_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// a concurrent writer waiting on readers gives its core away with sched_yield where it is available
+// 	and only spins everywhere else
+#if !defined (PHTREE_SCHED_YIELD) && (defined (__unix__) || defined (__APPLE__))
+#define PHTREE_SCHED_YIELD 1
+#endif
+
+#if PHTREE_SCHED_YIELD
+#include <sched.h>
+#endif
+
+// window queries filter leaves with SSE2 where the compiler targets it
+// 	define PHTREE_SIMD as 0 to always use the scalar filter
+#if !defined (PHTREE_SIMD) && (defined (__SSE2__) || defined (_M_X64))
+#define PHTREE_SIMD 1
+#endif
+
+#if PHTREE_SIMD
+#include <emmintrin.h>
+#endif
+
 #include "phtree32_common.h"
 #include "phtree32_2d.h"
+#include "phtree_thread_pool.h"
 
 /*
  * the maximum bit width we support
@@ -14,41 +51,63 @@
  */
 #define PHTREE_BIT_WIDTH_MAX 64
 
-// you can safely change this to any number <= 32 and >= 2
-// keys will still be 32 bits in size but the tree will only have a depth of PHTREE_DEPTH
-#define PHTREE_DEPTH 32
-
-#define phtree_node_is_leaf(dual) ((dual)->node.postfix_length == 0)
-#define phtree_node_is_root(dual) ((dual)->node.postfix_length == (PHTREE_DEPTH - 1))
+#define phtree_node_is_leaf(node) ((node)->postfix_length == 0)
+#define phtree_node_is_root(node) ((node)->postfix_length == (PHTREE_DEPTH - 1))
+#if PHTREE_ENTRY_COUNTS
+#define node_entry_count(node) (phtree_node_is_leaf (node) ? (uint32_t) (node)->child_count : (node)->entry_count)
+#endif
+
+// stats is a ph2_stats_t*
+// 	without PHTREE_STATS these compile to nothing, including their arguments
+#if PHTREE_STATS
+#define stats_add(stats,counter,amount) ((stats)->counter += (amount))
+#define stats_depth(stats,depth) ((stats)->max_depth = ((depth) > (stats)->max_depth) ? (depth) : (stats)->max_depth)
+#else
+#define stats_add(stats,counter,amount) ((void) 0)
+#define stats_depth(stats,depth) ((void) 0)
+#endif
+
+#if PHTREE_STATS
+static void stats_merge (ph2_stats_t* into, ph2_stats_t* from)
+{
+	into->nodes_visited += from->nodes_visited;
+	into->entries_tested += from->entries_tested;
+	into->hits += from->hits;
+	into->splits += from->splits;
+	into->reallocs += from->reallocs;
+	into->memmove_bytes += from->memmove_bytes;
+	stats_depth (into, from->max_depth);
+}
+#endif
 
-#define DIMENSIONS 2
-#define PHTREE_CHILD_FLAG UINT8_C(1)
+#define DIMENSIONS PH2_DIMENSIONS
+#define PHTREE_CHILD_FLAG UINT64_C(1)
 #define NODE_CHILD_MAX (PHTREE_CHILD_FLAG << (DIMENSIONS))
+
 /*
- * because uint8_t is the smallest type we can store child flags in
- * CHILD_SHIFT needs to account for the unused bits
- * for 2 dimensions we have 4 unused bits, so we add 4
+ * sets of children are bit masks
+ * 	bit n is set when the child at hypercube address n is in the set
+ * active_children is one of these sets
+ *
+ * all of the set math is done in 64 bits
+ * 	so it works for up to 6 dimensions (64 children)
  */
-#define CHILD_SHIFT (NODE_CHILD_MAX - 1 + 4)
+#define child_flag(address) (PHTREE_CHILD_FLAG << (address))
+// every child address a node can have
+#define CHILD_MASK_ALL ((NODE_CHILD_MAX >= 64) ? UINT64_MAX : (child_flag (NODE_CHILD_MAX) - 1))
 
-// shifting active_children by (CHILD_SHIFT - address)
-// 	puts the active child at the right most position
-// 	and zeroes everything to the left of the 0th child
+// children are stored in address order
+// 	so the index of a child in the child array is the number of active children below its address
 // 		8 bit example:
-// 			DIMENSIONS = 3
-// 			CHILD_SHIFT = 7
-// 			address = 2
-// 			active_children = 01101000
+// 			address = 5
+// 			active_children = 01101001
 // 			                    ^ addressed child
-// 			01101000 >> (CHILD_SHIFT - address) = 00000011
-// popcounting the shifted active_children
-// 	counts how many children there are before and including the child at address
-// 		example:
-// 			popcount (00000011) = 2
-// subtracting 1 from popcount gives the index in the child array
-// 	of the child we are looking for
-#define child_index(dual,address) (popcount ((dual)->node.active_children >> (CHILD_SHIFT - (address))) - 1)
-#define child_active(dual,address) ((dual)->node.active_children & (PHTREE_CHILD_FLAG << (CHILD_SHIFT - (address))))
+// 			child_flag (5) - 1 = 00011111
+// 			01101001 & 00011111 = 00001001
+// 			popcount (00001001) = 2
+// 		the child at address 5 is children[2]
+#define child_index(node,address) (popcount ((node)->active_children & (child_flag (address) - 1)))
+#define child_active(node,address) ((node)->active_children & child_flag (address))
 
 typedef unsigned int hypercube_address_t;
 
@@ -92,7 +151,7 @@ static bool point_equal (ph2_point_t* point_a, ph2_point_t* point_b)
 {
 	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
-		if (point_a->values[dimension] & ~(point_b->values[dimension]))
+		if (point_a->values[dimension] != point_b->values[dimension])
 		{
 			return false;
 		}
@@ -101,16 +160,60 @@ static bool point_equal (ph2_point_t* point_a, ph2_point_t* point_b)
 	return true;
 }
 
-static bool prefix_equal (ph2_point_t* point_a, ph2_point_t* point_b, int postfix_length)
+/*
+ * compare points by their position along the z-order curve
+ * 	the z-order of a point is its key bits interleaved
+ * 		highest bit first, and dimension 0 before dimension 1 for bits at the same height
+ * 	this is the same order in which calculate_hypercube_address lays out nodes
+ *
+ * returns < 0 if point_a comes first, > 0 if point_b comes first, 0 if the points are equal
+ */
+static int point_z_order_compare (ph2_point_t* point_a, ph2_point_t* point_b)
 {
-	ph2_point_t local_a = *point_a;
-	ph2_point_t local_b = *point_b;
+	int dimension_out = 0;
+	phtree_key_t highest_difference = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		phtree_key_t difference = point_a->values[dimension] ^ point_b->values[dimension];
+
+		// true when the highest set bit of difference is above the highest set bit of highest_difference
+		// 	earlier dimensions win ties because they come first in the interleaved order
+		if (highest_difference < difference && highest_difference < (highest_difference ^ difference))
+		{
+			dimension_out = dimension;
+			highest_difference = difference;
+		}
+	}
+
+	if (!highest_difference)
+	{
+		return 0;
+	}
 
+	return (point_a->values[dimension_out] < point_b->values[dimension_out]) ? -1 : 1;
+}
+
+/*
+ * the bits of point before postfix_length
+ * 	shifting a key by its full width is undefined
+ * 		so the root (postfix_length = PHTREE_DEPTH - 1) gets special handling
+ */
+static void point_prefix (ph2_point_t* point, ph2_point_t* out, int postfix_length)
+{
 	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
-		local_a.values[dimension] >>= postfix_length + 1;
-		local_b.values[dimension] >>= postfix_length + 1;
+		out->values[dimension] = (postfix_length + 1 < PHTREE_BIT_WIDTH) ? point->values[dimension] >> (postfix_length + 1) : 0;
 	}
+}
+
+static bool prefix_equal (ph2_point_t* point_a, ph2_point_t* point_b, int postfix_length)
+{
+	ph2_point_t local_a;
+	ph2_point_t local_b;
+
+	point_prefix (point_a, &local_a, postfix_length);
+	point_prefix (point_b, &local_b, postfix_length);
 
 	return (point_equal (&local_a, &local_b));
 }
@@ -121,14 +224,11 @@ static bool prefix_equal (ph2_point_t* point_a, ph2_point_t* point_b, int postfi
  */
 static bool prefix_greater_equal (ph2_point_t* point_a, ph2_point_t* point_b, int postfix_length)
 {
-	ph2_point_t local_a = *point_a;
-	ph2_point_t local_b = *point_b;
+	ph2_point_t local_a;
+	ph2_point_t local_b;
 
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
-	{
-		local_a.values[dimension] >>= postfix_length + 1;
-		local_b.values[dimension] >>= postfix_length + 1;
-	}
+	point_prefix (point_a, &local_a, postfix_length);
+	point_prefix (point_b, &local_b, postfix_length);
 
 	return (point_greater_equal (&local_a, &local_b));
 }
@@ -139,36 +239,55 @@ static bool prefix_greater_equal (ph2_point_t* point_a, ph2_point_t* point_b, in
  */
 static bool prefix_less_equal (ph2_point_t* point_a, ph2_point_t* point_b, int postfix_length)
 {
-	ph2_point_t local_a = *point_a;
-	ph2_point_t local_b = *point_b;
+	ph2_point_t local_a;
+	ph2_point_t local_b;
 
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
-	{
-		local_a.values[dimension] >>= postfix_length + 1;
-		local_b.values[dimension] >>= postfix_length + 1;
-	}
+	point_prefix (point_a, &local_a, postfix_length);
+	point_prefix (point_b, &local_b, postfix_length);
 
 	return (point_less_equal (&local_a, &local_b));
 }
 
 
-static bool node_in_window (ph2_dual_node_t* dual, ph2_query_t* window)
+static bool node_in_window (ph2_node_t* node, ph2_query_t* window)
 {
-	return (prefix_greater_equal (&dual->node.point, &window->min, dual->node.postfix_length) && prefix_less_equal (&dual->node.point, &window->max, dual->node.postfix_length));
+	return (prefix_greater_equal (&node->point, &window->min, node->postfix_length) && prefix_less_equal (&node->point, &window->max, node->postfix_length));
 }
 
-static bool entry_in_window (ph2_dual_node_t* dual, ph2_query_t* window)
+static bool entry_in_window (ph2_entry_t* entry, ph2_query_t* window)
+{
+	return (point_greater_equal (&entry->point, &window->min) && point_less_equal (&entry->point, &window->max));
+}
+
+/*
+ * checks if every point the node can hold is inside of the window
+ * 	the node covers every point from prefix|000... to prefix|111...
+ */
+static bool node_inside_window (ph2_node_t* node, ph2_query_t* window)
 {
-	return (point_greater_equal (&dual->entry.point, &window->min) && point_less_equal (&dual->entry.point, &window->max));
+	phtree_key_t key_mask = (node->postfix_length + 1 < PHTREE_BIT_WIDTH) ? PHTREE_KEY_MAX << (node->postfix_length + 1) : 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		phtree_key_t min = node->point.values[dimension] & key_mask;
+		phtree_key_t max = min | ~key_mask;
+
+		if (min < window->min.values[dimension] || max > window->max.values[dimension])
+		{
+			return false;
+		}
+	}
+
+	return true;
 }
 
 /*
  * calculate the hypercube address of the point at the given node
  */
-static hypercube_address_t calculate_hypercube_address (ph2_point_t* point, ph2_dual_node_t* dual)
+static hypercube_address_t calculate_hypercube_address (ph2_point_t* point, ph2_node_t* node)
 {
 	// which bit in the point->values we are interested in
-	phtree_key_t bit_mask = PHTREE_KEY_ONE << dual->node.postfix_length;
+	phtree_key_t bit_mask = PHTREE_KEY_ONE << node->postfix_length;
 	hypercube_address_t address = 0;
 
 	// for each dimension
@@ -183,777 +302,6033 @@ static hypercube_address_t calculate_hypercube_address (ph2_point_t* point, ph2_
 		// then move that value to the bottom of the bits
 		// add that value to the address
 		// 	which we have already shifted to make room
-		address |= (bit_mask & point->values[dimension]) >> dual->node.postfix_length;
+		address |= (bit_mask & point->values[dimension]) >> node->postfix_length;
 	}
 
 	return address;
 }
 
-static void* add_child (ph2_dual_node_t* dual, hypercube_address_t address)
+/*
+ * memory owned by a tree comes from its allocator
+ */
+#define tree_calloc(tree,count,size) phtree_allocator_calloc (&(tree)->allocator, (count), (size))
+#define tree_realloc(tree,memory,size) phtree_allocator_realloc (&(tree)->allocator, (memory), (size))
+#define tree_free(tree,memory) phtree_allocator_free (&(tree)->allocator, (memory))
+#define tree_aligned_calloc(tree,count,size,alignment) phtree_allocator_aligned_calloc (&(tree)->allocator, (count), (size), (alignment))
+#define tree_aligned_free(tree,memory) phtree_allocator_aligned_free (&(tree)->allocator, (memory))
+
+/*
+ * children arrays are allocated in multiples of 4 slots
+ * 	inner nodes have arrays of nodes, leaves have arrays of entries
+ * 	when the tree has pools, arrays of up to 16 slots come from the pools
+ * 		size class 0 = 4 slots, size class 1 = 8 slots, etc.
+ * 	anything else goes through tree_aligned_calloc/tree_aligned_free
+ */
+#define CHILDREN_POOL_SLOTS 4
+#define children_pool(tree,leaf) ((leaf) ? &(tree)->entry_pool : &(tree)->node_pool)
+#define children_pooled(tree,capacity) ((tree)->node_pool.block_size && (capacity) <= CHILDREN_POOL_SLOTS * (tree)->node_pool.class_count)
+#define children_size_class(capacity) (((capacity) - 1) / CHILDREN_POOL_SLOTS)
+#define children_slot_size(leaf) ((leaf) ? sizeof (ph2_entry_t) : sizeof (ph2_node_t))
+
+static void* children_allocate (ph2_t* tree, bool leaf, int capacity)
 {
-	if (dual->node.child_count >= dual->node.child_capacity)
+	if (children_pooled (tree, capacity))
 	{
-		// add 4 slots
-		// 	no performance testing/tuning was done on this, just adding 4
-		// 		might be better to add some other number
-		dual->node.children = phtree_realloc (dual->node.children, (dual->node.child_capacity * sizeof (ph2_node_t)) + (sizeof (ph2_node_t) * 4));
-		dual->node.child_capacity += 4;
+		return phtree_pool_allocate (children_pool (tree, leaf), children_size_class (capacity));
 	}
 
-	// need to set active_children before getting child index
-	// 	so we get the correct index
-	dual->node.active_children |= (PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
-
-	int index = child_index (dual, address);
-	// move the children which need to be to the right of the child we are adding
-	memmove (dual->node.children + index + 1, dual->node.children + index, sizeof (ph2_node_t) * (dual->node.child_count - index));
-	// zero the child we are adding
-	memset (dual->node.children + index, 0, sizeof (ph2_node_t));
-
-	dual->node.child_count++;
-
-	return dual->node.children + index;
+	return tree_aligned_calloc (tree, capacity, children_slot_size (leaf), PHTREE_NODE_ALIGNMENT);
 }
 
-/*
- * insert a ph2_entry_t in a node
- */
-static void node_add_entry (ph2_dual_node_t* dual, ph2_point_t* point)
+static void children_free (ph2_t* tree, bool leaf, void* children, int capacity)
 {
-	hypercube_address_t address = calculate_hypercube_address (point, dual);
-
-	// if there is already an entry at address
-	// 	just return
-	// 	the entry we would add to will eventually be returned by ph2_insert
-	if (child_active (dual, address))
+	// a node whose array could not be allocated has none
+	if (!children)
 	{
 		return;
 	}
 
-	// if there is _not_ an entry at address
-	// 	create a new entry
-	ph2_entry_t* new_entry = add_child (dual, address);
+	if (children_pooled (tree, capacity))
+	{
+		phtree_pool_free (children_pool (tree, leaf), children, children_size_class (capacity));
+		return;
+	}
 
-	new_entry->point = *point;
-	new_entry->element = NULL;
+	tree_aligned_free (tree, children);
 }
 
-static void node_initialize (ph2_dual_node_t* dual, uint16_t infix_length, uint16_t postfix_length, ph2_point_t* point)
+static void* children_resize (ph2_t* tree, bool leaf, void* children, int count, int capacity, int new_capacity)
 {
-	dual->node.children = phtree_calloc (4, sizeof (ph2_node_t));
-	dual->node.child_capacity = 4;
-	dual->node.child_count = 0;
-	dual->node.active_children = 0;
-	dual->node.infix_length = infix_length;
-	dual->node.postfix_length = postfix_length;
-	dual->node.point = *point;
+	// a node with no array yet has a capacity of 0, which is not a size class
+	if (children && children_pooled (tree, capacity) && children_pooled (tree, new_capacity)
+		&& children_size_class (capacity) == children_size_class (new_capacity))
+	{
+		return children;
+	}
 
-	phtree_key_t key_mask = PHTREE_KEY_MAX << (postfix_length + 1);
+	void* new_children = children_allocate (tree, leaf, new_capacity);
 
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	if (!new_children)
 	{
-		// set the new node's postfix bits to 0
-		dual->node.point.values[dimension] &= key_mask;
-		// set the bits at node to 1
-		// 	this makes the dual->node.point the center of the node
-		// 	which is useful later in window queries
-		dual->node.point.values[dimension] |= PHTREE_KEY_ONE << postfix_length;
+		return NULL;
+	}
+
+	stats_add (&tree->stats, reallocs, 1);
+
+	if (children)
+	{
+		memcpy (new_children, children, count * children_slot_size (leaf));
+		children_free (tree, leaf, children, capacity);
 	}
+
+	return new_children;
 }
 
 /*
- * try to add a new child node to node
- * 	if the node already has a child at the address
- * 		return that existing node and set success to false
+ * keep capacity between count and NODE_CHILD_MAX
+ * 	pooled arrays are always a multiple of CHILDREN_POOL_SLOTS
+ * 		so we might as well use all of the slots
+ * capacity is at least 1 so there is always an array to allocate
  */
-static ph2_dual_node_t* node_try_add (bool* added_new_node, ph2_dual_node_t* dual, hypercube_address_t address, ph2_point_t* point)
+static int children_capacity_fit (ph2_t* tree, int count, int capacity)
 {
-	ph2_dual_node_t* node_out = NULL;
+	if (capacity < count)
+	{
+		capacity = count;
+	}
 
-	// if the child is empty
-	// 	create a new child
-	if (!child_active (dual, address))
+	if (capacity < 1)
 	{
-		// if we are creating an entirely new child node
-		// 	because this is a patricia trie
-		// 		the child is going to be all the way at the bottom of the tree
-		// 			postfix = 0  // there will only be entries below this node, no other nodes
-		node_out = add_child (dual, address);
-		node_initialize (node_out, dual->node.postfix_length - 1, 0, point);
-		node_add_entry (node_out, point);
+		capacity = 1;
+	}
 
-		*added_new_node = true;
+	if (capacity > (int) NODE_CHILD_MAX)
+	{
+		capacity = NODE_CHILD_MAX;
 	}
-	// if the child is not empty
-	// 	return the child
-	else
+
+	if (children_pooled (tree, capacity))
 	{
-		node_out = dual->node.children + child_index (dual, address);
-		*added_new_node = false;
+		capacity = (children_size_class (capacity) + 1) * CHILDREN_POOL_SLOTS;
 	}
 
-	return node_out;
+	return capacity;
 }
 
 /*
- * return the bit at which the two points diverge
+ * a new element for input
+ * 	from the element pool when the tree has one
+ * 		zeroed, then handed to element_initialize
+ * 	otherwise from element_create
  */
-static int number_of_diverging_bits (ph2_point_t* point_a, ph2_point_t* point_b)
+static void* element_new (ph2_t* tree, void* input)
 {
-	unsigned int difference = 0;
-
-	for (size_t dimension = 0; dimension < DIMENSIONS; dimension++)
+	if (!tree->element_pool.block_size)
 	{
-		difference |= (point_a->values[dimension] ^ point_b->values[dimension]);
+		return tree->element_create (input);
 	}
 
-	// count_leading_zeroes always uses the 64 bit implementation
-	// 	and will return a number based on a 64 bit input
-	// 	so we use PHTREE_BIT_WIDTH_MAX instead of PHTREE_BIT_WIDTH
-	return PHTREE_BIT_WIDTH_MAX - count_leading_zeroes (difference);
-}
+	void* element = phtree_pool_allocate (&tree->element_pool, 0);
 
-/*
- * insert a new node between existing nodes
- */
-static ph2_dual_node_t* node_insert_split (ph2_dual_node_t* parent, ph2_dual_node_t* child, ph2_point_t* point, int max_conflicting_bits)
-{
-	/*
-	 * because child is already in the corrent array position we would want to put a new split node
-	 * 	we copy everything out of child and re-initialize child into the new node 
-	 * add two new children to the new child node
-	 * copy the old child node into one of the new children
-	 * then initialize the other child to a new node for the point we are inserting
-	 */
+	if (!element)
+	{
+		return NULL;
+	}
 
-	// store the values of the current child
-	ph2_dual_node_t old_child = *child;
-	// clear and reset child
-	node_initialize (child, parent->node.postfix_length - max_conflicting_bits, max_conflicting_bits - 1, point);
-	// add a new child to child
-	// 	which is going to be where the old_child goes
-	ph2_dual_node_t* new_child = add_child (child, calculate_hypercube_address (&old_child.node.point, child));
-	// copy the values from old_child into the new_child
-	*new_child = old_child;
+	// freed blocks still have the free list link in them
+	memset (element, 0, tree->element_pool.block_size);
 
-	new_child->node.infix_length = (child->node.postfix_length - new_child->node.postfix_length) - 1;
+	if (tree->element_initialize)
+	{
+		tree->element_initialize (element, input);
+	}
 
-	// add the new child that we created the split for
-	new_child = add_child (child, calculate_hypercube_address (point, child));
-	node_initialize (new_child, child->node.postfix_length - 1, 0, point);
-	node_add_entry (new_child, point);
+	return element;
+}
 
-	return new_child;
+static void element_delete (ph2_t* tree, void* element)
+{
+	if (tree->element_destroy)
+	{
+		tree->element_destroy (element);
+	}
+
+	if (tree->element_pool.block_size)
+	{
+		phtree_pool_free (&tree->element_pool, element, 0);
+	}
 }
 
 /*
- * figure out what to do when trying to add a new node where a node already exists
+ * concurrent mode
+ *
+ * in concurrent mode any number of threads can read the tree while a single thread writes to it
+ * 	readers never see a node while it is being changed
+ * 		the writer starts every change from a copy of the root
+ * 		and copies every children array on the path it changes before changing it (copy on write)
+ * 		then publishes the new root with a single atomic store
+ * 	memory that readers could still be looking at is retired instead of freed
+ *
+ * readers register with the current epoch while they are reading
+ * 	the writer only moves on to the next epoch once no readers are left in the previous epoch
+ * 	memory retired during an epoch is freed when the writer moves on 2 epochs past it
+ * 		by then every reader which could have seen that memory is done
  */
-static ph2_dual_node_t* node_handle_collision (ph2_dual_node_t* dual, ph2_dual_node_t* sub_node, ph2_point_t* point)
+typedef enum
 {
-	// if infix_length == 0
-	// 	we can not insert a node between dual and sub_node
-	// 	point will be a child of sub_node
-	if (sub_node->node.infix_length > 0)
+	RETIRED_NODES,
+	RETIRED_ENTRIES,
+	RETIRED_ROOT,
+	RETIRED_ELEMENT,
+} retired_kind_t;
+
+typedef struct
+{
+	void* memory;
+	// capacity of a retired children array
+	int capacity;
+	retired_kind_t kind;
+} retired_t;
+
+typedef struct
+{
+	retired_t* items;
+	size_t count;
+	size_t capacity;
+} retired_list_t;
+
+struct ph2_concurrent_t
+{
+	// the root readers start from
+	ph2_node_t* _Atomic root;
+	atomic_uint epoch;
+	// how many readers are registered with even and odd epochs
+	atomic_size_t readers[2];
+	// memory retired during the previous epoch
+	retired_list_t previous;
+	// memory retired during the current epoch
+	retired_list_t current;
+};
+
+static void retired_add (ph2_t* tree, void* memory, int capacity, retired_kind_t kind)
+{
+	retired_list_t* list = &tree->concurrent->current;
+
+	if (list->count >= list->capacity)
 	{
-		int max_conflicting_bits = number_of_diverging_bits (point, &sub_node->node.point);
+		size_t new_capacity = list->capacity ? list->capacity * 2 : 64;
+		retired_t* items = tree_realloc (tree, list->items, new_capacity * sizeof (*items));
 
-		/*
-		 * max_conflicting_bits == sub_node->node.postfix_length
-		 * 	means we are trying to insert a child of sub_node
-		 *
-		 * max_conflicting_bits == sub_node->node.postfix_length + 1
-		 * 	means we would be inserting the same sub_node that already exists
-		 *
-		 * max_conflicting_bits > sub_node->node.postfix_length + 1
-		 * 	we need to insert a node between dual and sub_node
-		 */
-		if (max_conflicting_bits > sub_node->node.postfix_length + 1)
+		// we can not retire anything without memory to track it
+		// 	leaking is better than freeing something a reader is using
+		if (!items)
 		{
-			return node_insert_split (dual, sub_node, point, max_conflicting_bits);
+			return;
 		}
+
+		list->items = items;
+		list->capacity = new_capacity;
 	}
 
-	if (phtree_node_is_leaf (sub_node))
+	list->items[list->count] = (retired_t) {memory, capacity, kind};
+	list->count++;
+}
+
+static void retired_free (ph2_t* tree, retired_list_t* list)
+{
+	for (size_t iter = 0; iter < list->count; iter++)
 	{
-		node_add_entry (sub_node, point);
+		retired_t* retired = &list->items[iter];
+
+		switch (retired->kind)
+		{
+			case RETIRED_NODES:
+				children_free (tree, false, retired->memory, retired->capacity);
+				break;
+			case RETIRED_ENTRIES:
+				children_free (tree, true, retired->memory, retired->capacity);
+				break;
+			case RETIRED_ROOT:
+				tree_aligned_free (tree, retired->memory);
+				break;
+			case RETIRED_ELEMENT:
+				element_delete (tree, retired->memory);
+				break;
+		}
 	}
 
-	return sub_node;
+	list->count = 0;
 }
 
 /*
- * add a new node to the tree
+ * a waiting writer spins this many times for readers which are almost done
+ * 	before it starts giving its core to them
  */
-static ph2_dual_node_t* node_add (ph2_dual_node_t* node, ph2_point_t* point)
-{
-	hypercube_address_t address = calculate_hypercube_address (point, node);
-	// because node_try_add will always return a node
-	// 	we need to keep track of if node_try_add created the node
-	// 		or if the node was already there
-	bool added_new_node = false;
-	ph2_dual_node_t* sub_node = node_try_add (&added_new_node, node, address, point);
+#define CONCURRENT_SPINS 64
 
-	// if there was not already a node at the point
-	// 	we created one and can return it now
-	if (added_new_node)
+static void concurrent_pause (int spins)
+{
+#if PHTREE_SCHED_YIELD
+	if (spins >= CONCURRENT_SPINS)
 	{
-		return sub_node;
+		sched_yield ();
+		return;
 	}
+#else
+	(void) spins;
+#endif
 
-	// if there was already a node at the point
-	return node_handle_collision (node, sub_node, point);
+	phtree_cpu_relax ();
 }
 
-static void entry_free (ph2_t* tree, ph2_dual_node_t* dual)
+/*
+ * try to move to the next epoch
+ * 	freeing everything retired during the previous epoch
+ *
+ * when wait is true this will wait for readers to finish instead of giving up
+ */
+static void concurrent_advance (ph2_t* tree, bool wait)
 {
-	if (dual->entry.element)
+	struct ph2_concurrent_t* concurrent = tree->concurrent;
+	unsigned int epoch = atomic_load (&concurrent->epoch);
+
+	// readers in the previous epoch could still be looking at anything retired during it
+	for (int spins = 0; atomic_load (&concurrent->readers[(epoch - 1) & 1]) != 0; spins++)
 	{
-		if (tree->element_destroy)
+		if (!wait)
 		{
-			tree->element_destroy (dual->entry.element);
+			return;
 		}
 
-		dual->entry.element = NULL;
+		concurrent_pause (spins);
 	}
-}
 
-int ph2_initialize (
-	ph2_t* tree,
-	void* (*element_create) (void* input),
-	void (*element_destroy) (void*),
-	phtree_key_t (*convert_to_key) (void* input),
-	void (*convert_to_point) (ph2_t* tree, ph2_point_t* out, void* input),
-	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input))
-{
-	ph2_point_t empty_point = {{0, 0}};
-	node_initialize (&tree->root, 0, PHTREE_DEPTH - 1, &empty_point);
+	retired_free (tree, &concurrent->previous);
 
-	tree->element_create = element_create;
-	tree->element_destroy = element_destroy;
-	tree->convert_to_key = convert_to_key;
-	tree->convert_to_point = convert_to_point;
-	tree->convert_to_box_point = convert_to_box_point;
+	retired_list_t swap = concurrent->previous;
+	concurrent->previous = concurrent->current;
+	concurrent->current = swap;
 
-	return 0;
+	atomic_store (&concurrent->epoch, epoch + 1);
 }
 
 /*
- * create a new tree
+ * wait until every reader which started before now is done
+ * 	and free everything that has been retired
  */
-ph2_t* ph2_create (
-	void* (*element_create) (void* input),
-	void (*element_destroy) (void* element),
-	phtree_key_t (*convert_to_key) (void* input),
-	void (*convert_to_point) (ph2_t* tree, ph2_point_t* out, void* input),
-	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input))
+static void concurrent_synchronize (ph2_t* tree)
 {
-	ph2_t* tree = phtree_calloc (1, sizeof (*tree));
+	concurrent_advance (tree, true);
+	concurrent_advance (tree, true);
+}
 
-	if (!tree)
+int ph2_read_begin (ph2_t* tree)
+{
+	if (!tree->concurrent)
 	{
-		return NULL;
+		return 0;
 	}
 
-	if (ph2_initialize (tree, element_create, element_destroy, convert_to_key, convert_to_point, convert_to_box_point))
+	struct ph2_concurrent_t* concurrent = tree->concurrent;
+
+	while (true)
 	{
-		phtree_free (tree);
-		return NULL;
-	}
+		unsigned int epoch = atomic_load (&concurrent->epoch);
 
-	return tree;
-}
+		atomic_fetch_add (&concurrent->readers[epoch & 1], 1);
 
-/*
- * recursively free _ALL_ of the nodes under and including the argument node
- * !! do not call this on root !!
- */
-static void free_nodes (ph2_t* tree, ph2_dual_node_t* dual)
-{
-	// this will free nodes recursively
-	// 	worst case our stack is PHTREE_DEPTH deep
-	void (*free_function) (ph2_t* tree, ph2_dual_node_t* node) = free_nodes;
+		// if the writer moved on while we were registering
+		// 	it may have already checked the counter we registered with
+		if (atomic_load (&concurrent->epoch) == epoch)
+		{
+			return epoch & 1;
+		}
 
-	if (phtree_node_is_leaf (dual))
-	{
-		// if the node is a leaf we dont need to recurse any further
-		// 	just free entries
-		free_function = entry_free;
+		atomic_fetch_sub (&concurrent->readers[epoch & 1], 1);
 	}
+}
 
-	for (int iter = 0; iter < dual->node.child_count; iter++)
+void ph2_read_end (ph2_t* tree, int token)
+{
+	if (!tree->concurrent)
 	{
-		free_function (tree, &dual->node.children[iter]);
+		return;
 	}
 
-	phtree_free (dual->node.children);
+	atomic_fetch_sub_explicit (&tree->concurrent->readers[token], 1, memory_order_release);
 }
 
 /*
- * free all of the nodes and entries in the tree
+ * the root to start reading from
  */
-void ph2_clear (ph2_t* tree)
+static ph2_node_t* tree_root (ph2_t* tree)
 {
-	if (!tree)
-	{
-		return;
-	}
-
-	for (int iter = 0; iter < tree->root.node.child_count; iter++)
+	if (!tree->concurrent)
 	{
-		free_nodes (tree, &tree->root.node.children[iter]);
+		return &tree->root;
 	}
 
-	tree->root.node.active_children = 0;
-	tree->root.node.child_count = 0;
-	tree->root.node.child_capacity = 0;
-
-	phtree_free (tree->root.node.children);
+	return atomic_load_explicit (&tree->concurrent->root, memory_order_acquire);
 }
 
-/*
- * free a tree
- */
-void ph2_free (ph2_t* tree)
+static void root_publish (ph2_t* tree, ph2_node_t* root)
 {
-	ph2_clear (tree);
-	phtree_free (tree);
+	atomic_store_explicit (&tree->concurrent->root, root, memory_order_release);
 }
 
 /*
- * internal for_each function
- * 	does not have safety check for tree, function, or node existence
+ * free children, unless readers could still be looking at them
  */
-static void for_each (ph2_t* tree, ph2_dual_node_t* dual, void (*function) (void* element, void* data), void* data)
+static void children_retire (ph2_t* tree, bool leaf, void* children, int capacity)
 {
-	if (phtree_node_is_leaf (dual))
+	if (!tree->concurrent || !children)
 	{
-		for (int iter = 0; iter < dual->node.child_count; iter++)
-		{
-			ph2_entry_t* entry = (ph2_entry_t*) &dual->node.children[iter];
-			function (entry->element, data);
-		}
-
+		children_free (tree, leaf, children, capacity);
 		return;
 	}
 
-	for (int iter = 0; iter < dual->node.child_count; iter++)
-	{
-		// do this recursively
-		// worst case our stack is 32 deep
-		for_each (tree, &dual->node.children[iter], function, data);
-	}
+	retired_add (tree, children, capacity, leaf ? RETIRED_ENTRIES : RETIRED_NODES);
 }
 
 /*
- * run the iteration function on every element in the tree
- *
- * data is any external data the user wishes to pass to the iteration function
+ * destroy element, unless readers could still be looking at it
  */
-void ph2_for_each (ph2_t* tree, phtree_iteration_function_t function, void* data)
+static void element_retire (ph2_t* tree, void* element)
 {
-	if (!tree || !function)
+	if (!tree->concurrent)
 	{
+		element_delete (tree, element);
 		return;
 	}
 
-	for (int iter = 0; iter < tree->root.node.child_count; iter++)
+	retired_add (tree, element, 0, RETIRED_ELEMENT);
+}
+
+/*
+ * give node its own copy of its children array
+ * 	so it can be changed without readers seeing the change
+ * node itself must already be private
+ * 	(in a children array which has already been copied)
+ *
+ * does nothing when not in concurrent mode
+ *
+ * returns false if there was no memory for the copy, node is not changed
+ */
+static bool node_privatize (ph2_t* tree, ph2_node_t* node)
+{
+	if (!tree->concurrent)
+	{
+		return true;
+	}
+
+	bool leaf = phtree_node_is_leaf (node);
+	// a root with no array still needs one to be changed
+	int capacity = children_capacity_fit (tree, node->child_count, node->child_capacity);
+	void* children = children_allocate (tree, leaf, capacity);
+
+	if (!children)
+	{
+		return false;
+	}
+
+	if (node->children.memory)
+	{
+		memcpy (children, node->children.memory, node->child_count * children_slot_size (leaf));
+	}
+
+	children_retire (tree, leaf, node->children.memory, node->child_capacity);
+	node->children.memory = children;
+	node->child_capacity = capacity;
+
+	return true;
+}
+
+/*
+ * start changing the tree
+ * 	returns the root to make changes to
+ * 	in concurrent mode this is a private copy of the root which readers can not see yet
+ * 		or NULL if there was no memory for the copy, the published root is not changed
+ * 		and write_end must not be called
+ * 	outside of concurrent mode this never fails
+ *
+ * once write_begin succeeded write_end has to publish the root even if the change is given up on
+ * 	the old root and arrays copied along the way are already retired
+ * 	the copies hold the same children, so publishing them changes nothing readers can see
+ */
+static ph2_node_t* write_begin (ph2_t* tree)
+{
+	tree->version++;
+
+	if (!tree->concurrent)
+	{
+		return &tree->root;
+	}
+
+	ph2_node_t* old_root = tree_root (tree);
+	ph2_node_t* root = tree_aligned_calloc (tree, 1, sizeof (*root), _Alignof (ph2_node_t));
+
+	if (!root)
+	{
+		return NULL;
+	}
+
+	*root = *old_root;
+
+	if (!node_privatize (tree, root))
+	{
+		tree_aligned_free (tree, root);
+		return NULL;
+	}
+
+	retired_add (tree, old_root, 0, RETIRED_ROOT);
+
+	return root;
+}
+
+/*
+ * finish changing the tree
+ * 	in concurrent mode this makes the changes visible to readers
+ */
+static void write_end (ph2_t* tree, ph2_node_t* root)
+{
+	if (!tree->concurrent)
+	{
+		return;
+	}
+
+	root_publish (tree, root);
+	concurrent_advance (tree, false);
+}
+
+/*
+ * the capacity the tree's growth policy wants a children array of capacity slots to have
+ * 	when it holds count children
+ */
+static int children_capacity_policy (ph2_t* tree, int count, int capacity)
+{
+	int new_capacity = capacity;
+
+	switch (tree->growth)
+	{
+		case PH2_GROWTH_EXACT:
+			new_capacity = count;
+			break;
+		case PH2_GROWTH_DOUBLE:
+			if (count > capacity)
+			{
+				new_capacity = (capacity < 1) ? 1 : capacity;
+
+				while (new_capacity < count)
+				{
+					new_capacity *= 2;
+				}
+			}
+			// halving at a quarter instead of at half
+			// 	so a node going back and forth over the line does not resize every time
+			else if (count <= capacity / 4)
+			{
+				new_capacity = capacity / 2;
+			}
+			break;
+		case PH2_GROWTH_CUSTOM:
+			new_capacity = tree->growth_function (count, capacity, tree->growth_data);
+			break;
+		case PH2_GROWTH_FIXED:
+		default:
+			// no performance testing/tuning was done on this, just adding 4
+			// 	the other policies are there for when this does not fit
+			if (count > capacity)
+			{
+				new_capacity = capacity + 4;
+			}
+			break;
+	}
+
+	return children_capacity_fit (tree, count, new_capacity);
+}
+
+/*
+ * resize the children array of node to what the growth policy wants for its children
+ * 	the array must be private to the writer in concurrent mode
+ * 	nothing is changed if the memory for the new array can not be allocated
+ *
+ * returns false if the array could not be resized
+ */
+static bool node_resize (ph2_t* tree, ph2_node_t* node, int count)
+{
+	int capacity = children_capacity_policy (tree, count, node->child_capacity);
+
+	if (capacity == node->child_capacity)
+	{
+		return true;
+	}
+
+	bool leaf = phtree_node_is_leaf (node);
+	void* children = children_resize (tree, leaf, node->children.memory, node->child_count, node->child_capacity, capacity);
+
+	if (!children)
+	{
+		return false;
+	}
+
+	node->children.memory = children;
+	node->child_capacity = capacity;
+
+	return true;
+}
+
+/*
+ * shrink the children array of node after a child was removed
+ * 	empty nodes are left alone, they are about to be removed
+ */
+static void node_shrink (ph2_t* tree, ph2_node_t* node)
+{
+	if (node->child_count > 0 && node->child_count < node->child_capacity)
+	{
+		// a failed shrink only wastes slots
+		node_resize (tree, node, node->child_count);
+	}
+}
+
+/*
+ * make room for a child at address
+ * 	returns the new child, a ph2_node_t in inner nodes or a ph2_entry_t in leaves
+ * 	or NULL if the children array could not grow, node is not changed
+ */
+static void* add_child (ph2_t* tree, ph2_node_t* node, hypercube_address_t address)
+{
+	bool leaf = phtree_node_is_leaf (node);
+	size_t slot_size = children_slot_size (leaf);
+
+	if (node->child_count >= node->child_capacity && !node_resize (tree, node, node->child_count + 1))
+	{
+		return NULL;
+	}
+
+	// need to set active_children before getting child index
+	// 	so we get the correct index
+	node->active_children |= child_flag (address);
+
+	int index = child_index (node, address);
+	char* slot = (char*) node->children.memory + (index * slot_size);
+	// move the children which need to be to the right of the child we are adding
+	memmove (slot + slot_size, slot, slot_size * (node->child_count - index));
+	stats_add (&tree->stats, memmove_bytes, slot_size * (node->child_count - index));
+	// zero the child we are adding
+	memset (slot, 0, slot_size);
+
+	node->child_count++;
+
+	return slot;
+}
+
+/*
+ * insert a ph2_entry_t in a node
+ * 	added_entry is set when there was not already an entry at point
+ *
+ * returns false if there was no memory for the new entry
+ */
+static bool node_add_entry (ph2_t* tree, ph2_node_t* node, ph2_point_t* point, bool* added_entry)
+{
+	hypercube_address_t address = calculate_hypercube_address (point, node);
+
+	*added_entry = false;
+
+	// if there is already an entry at address
+	// 	just return
+	// 	the entry we would add to will eventually be returned by ph2_insert
+	if (child_active (node, address))
+	{
+		return true;
+	}
+
+	// if there is _not_ an entry at address
+	// 	create a new entry
+	ph2_entry_t* new_entry = add_child (tree, node, address);
+
+	if (!new_entry)
+	{
+		return false;
+	}
+
+	new_entry->point = *point;
+	new_entry->element = NULL;
+	*added_entry = true;
+
+	return true;
+}
+
+/*
+ * initialize a node with no children array and a capacity of 0
+ * 	the array is allocated once it is known how many children the node gets
+ */
+static void node_initialize_empty (ph2_node_t* node, uint16_t infix_length, uint16_t postfix_length, ph2_point_t* point)
+{
+	node->children.memory = NULL;
+	node->child_capacity = 0;
+	node->child_count = 0;
+	node->active_children = 0;
+	node->infix_length = infix_length;
+	node->postfix_length = postfix_length;
+	node->point = *point;
+#if PHTREE_ENTRY_COUNTS
+	node->entry_count = 0;
+#endif
+
+	// shifting a key by its full bit width is undefined
+	// 	the root's postfix bits are the whole key
+	phtree_key_t key_mask = (postfix_length + 1 < PHTREE_BIT_WIDTH) ? PHTREE_KEY_MAX << (postfix_length + 1) : 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		// set the new node's postfix bits to 0
+		node->point.values[dimension] &= key_mask;
+		// set the bits at node to 1
+		// 	this makes the node->point the center of the node
+		// 	which is useful later in window queries
+		node->point.values[dimension] |= PHTREE_KEY_ONE << postfix_length;
+	}
+}
+
+/*
+ * initialize a node with room for capacity children
+ *
+ * returns false if the children array could not be allocated
+ * 	node is still initialized, with no array and a capacity of 0
+ */
+static bool node_initialize_capacity (ph2_t* tree, ph2_node_t* node, uint16_t infix_length, uint16_t postfix_length, ph2_point_t* point, int capacity)
+{
+	capacity = children_capacity_fit (tree, capacity, capacity);
+
+	node_initialize_empty (node, infix_length, postfix_length, point);
+	node->children.memory = children_allocate (tree, postfix_length == 0, capacity);
+	node->child_capacity = node->children.memory ? capacity : 0;
+
+	return node->children.memory != NULL;
+}
+
+static bool node_initialize (ph2_t* tree, ph2_node_t* node, uint16_t infix_length, uint16_t postfix_length, ph2_point_t* point)
+{
+	return node_initialize_capacity (tree, node, infix_length, postfix_length, point, 4);
+}
+
+/*
+ * set up a new leaf holding just an entry for point
+ * 	built outside of the tree so a failed allocation leaves the tree as it was
+ *
+ * returns false if there was no memory for the leaf
+ */
+static bool leaf_initialize (ph2_t* tree, ph2_node_t* leaf, uint16_t infix_length, ph2_point_t* point)
+{
+	bool added_entry;
+
+	if (!node_initialize (tree, leaf, infix_length, 0, point))
+	{
+		return false;
+	}
+
+	// the array always has room for the first child
+	node_add_entry (tree, leaf, point, &added_entry);
+
+	return true;
+}
+
+/*
+ * try to add a new child node to node
+ * 	if the node already has a child at the address
+ * 		return that existing node and set success to false
+ * 	returns NULL if there was no memory for the new node
+ */
+static ph2_node_t* node_try_add (ph2_t* tree, bool* added_new_node, ph2_node_t* node, hypercube_address_t address, ph2_point_t* point)
+{
+	ph2_node_t* node_out = NULL;
+
+	// if the child is empty
+	// 	create a new child
+	if (!child_active (node, address))
+	{
+		// if we are creating an entirely new child node
+		// 	because this is a patricia trie
+		// 		the child is going to be all the way at the bottom of the tree
+		// 			postfix = 0  // there will only be entries below this node, no other nodes
+		ph2_node_t leaf;
+
+		if (!leaf_initialize (tree, &leaf, node->postfix_length - 1, point))
+		{
+			return NULL;
+		}
+
+		node_out = add_child (tree, node, address);
+
+		if (!node_out)
+		{
+			children_free (tree, true, leaf.children.memory, leaf.child_capacity);
+			return NULL;
+		}
+
+		*node_out = leaf;
+		*added_new_node = true;
+	}
+	// if the child is not empty
+	// 	return the child
+	else
+	{
+		node_out = &node->children.nodes[child_index (node, address)];
+		*added_new_node = false;
+	}
+
+	return node_out;
+}
+
+/*
+ * return the bit at which the two points diverge
+ */
+static int number_of_diverging_bits (ph2_point_t* point_a, ph2_point_t* point_b)
+{
+	phtree_key_t difference = 0;
+
+	for (size_t dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		difference |= (point_a->values[dimension] ^ point_b->values[dimension]);
+	}
+
+	// count_leading_zeroes always uses the 64 bit implementation
+	// 	and will return a number based on a 64 bit input
+	// 	so we use PHTREE_BIT_WIDTH_MAX instead of PHTREE_BIT_WIDTH
+	return PHTREE_BIT_WIDTH_MAX - count_leading_zeroes (difference);
+}
+
+/*
+ * insert a new node between existing nodes
+ * 	returns NULL if there was no memory for the new nodes, child is not changed
+ */
+static ph2_node_t* node_insert_split (ph2_t* tree, ph2_node_t* parent, ph2_node_t* child, ph2_point_t* point, int max_conflicting_bits)
+{
+	/*
+	 * because child is already in the corrent array position we would want to put a new split node
+	 * 	we build the split node next to it and copy it over child once nothing can fail
+	 * add two new children to the new split node
+	 * copy the old child node into one of the new children
+	 * then initialize the other child to a new node for the point we are inserting
+	 */
+	ph2_node_t split;
+	ph2_node_t leaf;
+
+	if (!node_initialize (tree, &split, parent->postfix_length - max_conflicting_bits, max_conflicting_bits - 1, point))
+	{
+		return NULL;
+	}
+
+	if (!leaf_initialize (tree, &leaf, split.postfix_length - 1, point))
+	{
+		children_free (tree, false, split.children.memory, split.child_capacity);
+		return NULL;
+	}
+
+	stats_add (&tree->stats, splits, 1);
+
+	// node_initialize gave split room for 4 children
+	// 	so neither add_child can fail
+	// add a new child to split
+	// 	which is going to be where the old child goes
+	ph2_node_t* new_child = add_child (tree, &split, calculate_hypercube_address (&child->point, &split));
+	// copy the values from child into the new_child
+	*new_child = *child;
+
+	new_child->infix_length = (split.postfix_length - new_child->postfix_length) - 1;
+
+#if PHTREE_ENTRY_COUNTS
+	// the new leaf below always gets a new entry
+	split.entry_count = node_entry_count (child) + 1;
+#endif
+
+	// add the new child that we created the split for
+	new_child = add_child (tree, &split, calculate_hypercube_address (point, &split));
+	*new_child = leaf;
+	*child = split;
+
+	return new_child;
+}
+
+/*
+ * figure out what to do when trying to add a new node where a node already exists
+ * 	added_entry is set when a new entry was created for point
+ */
+static ph2_node_t* node_handle_collision (ph2_t* tree, ph2_node_t* node, ph2_node_t* sub_node, ph2_point_t* point, bool* added_entry)
+{
+	// if infix_length == 0
+	// 	we can not insert a node between node and sub_node
+	// 	point will be a child of sub_node
+	if (sub_node->infix_length > 0)
+	{
+		int max_conflicting_bits = number_of_diverging_bits (point, &sub_node->point);
+
+		/*
+		 * max_conflicting_bits == sub_node->postfix_length
+		 * 	means we are trying to insert a child of sub_node
+		 *
+		 * max_conflicting_bits == sub_node->postfix_length + 1
+		 * 	means we would be inserting the same sub_node that already exists
+		 *
+		 * max_conflicting_bits > sub_node->postfix_length + 1
+		 * 	we need to insert a node between node and sub_node
+		 */
+		if (max_conflicting_bits > sub_node->postfix_length + 1)
+		{
+			*added_entry = true;
+			return node_insert_split (tree, node, sub_node, point, max_conflicting_bits);
+		}
+	}
+
+	// sub_node is going to be changed or walked through to make changes below it
+	// 	a split doesnt need this because it moves sub_node's children array as is
+	if (!node_privatize (tree, sub_node))
+	{
+		return NULL;
+	}
+
+	if (phtree_node_is_leaf (sub_node) && !node_add_entry (tree, sub_node, point, added_entry))
+	{
+		return NULL;
+	}
+
+	return sub_node;
+}
+
+/*
+ * add a new node to the tree
+ * 	added_entry is set when a new entry was created for point
+ * 	returns NULL if there was no memory, the tree is not changed
+ */
+static ph2_node_t* node_add (ph2_t* tree, ph2_node_t* node, ph2_point_t* point, bool* added_entry)
+{
+	hypercube_address_t address = calculate_hypercube_address (point, node);
+	// because node_try_add will always return a node
+	// 	we need to keep track of if node_try_add created the node
+	// 		or if the node was already there
+	bool added_new_node = false;
+	ph2_node_t* sub_node = node_try_add (tree, &added_new_node, node, address, point);
+
+	if (!sub_node)
+	{
+		return NULL;
+	}
+
+	// if there was not already a node at the point
+	// 	we created one and can return it now
+	if (added_new_node)
+	{
+		*added_entry = true;
+		return sub_node;
+	}
+
+	// if there was already a node at the point
+	return node_handle_collision (tree, node, sub_node, point, added_entry);
+}
+
+static void entry_free (ph2_t* tree, ph2_entry_t* entry)
+{
+	if (entry->element)
+	{
+		element_delete (tree, entry->element);
+		entry->element = NULL;
+	}
+}
+
+void ph2_options_default (ph2_options_t* options)
+{
+	options->pool_children = true;
+	options->pool_slab_size = 0;
+	options->concurrent = false;
+	options->allocator = NULL;
+	options->element_size = 0;
+	options->element_initialize = NULL;
+	options->growth = PH2_GROWTH_FIXED;
+	options->growth_function = NULL;
+	options->growth_data = NULL;
+}
+
+static int root_initialize (ph2_t* tree, ph2_node_t* root)
+{
+	ph2_point_t empty_point = {{0, 0}};
+	node_initialize (tree, root, 0, PHTREE_DEPTH - 1, &empty_point);
+
+	if (!root->children.memory)
+	{
+		return 1;
+	}
+
+	return 0;
+}
+
+int ph2_initialize (
+	ph2_t* tree,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void*),
+	phtree_key_t (*convert_to_key) (void* input),
+	void (*convert_to_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	ph2_options_t* options)
+{
+	ph2_options_t default_options;
+
+	if (!options)
+	{
+		ph2_options_default (&default_options);
+		options = &default_options;
+	}
+
+	memset (&tree->allocator, 0, sizeof (tree->allocator));
+
+	if (options->allocator)
+	{
+		tree->allocator = *options->allocator;
+	}
+
+	tree->growth = options->growth;
+	tree->growth_function = options->growth_function;
+	tree->growth_data = options->growth_data;
+
+	// a custom policy without a function would crash on the first full node
+	if (tree->growth == PH2_GROWTH_CUSTOM && !tree->growth_function)
+	{
+		tree->growth = PH2_GROWTH_FIXED;
+	}
+
+	memset (&tree->node_pool, 0, sizeof (tree->node_pool));
+	memset (&tree->entry_pool, 0, sizeof (tree->entry_pool));
+
+	if (options->pool_children)
+	{
+		phtree_pool_initialize (&tree->node_pool, CHILDREN_POOL_SLOTS * sizeof (ph2_node_t), PHTREE_NODE_ALIGNMENT, PHTREE_POOL_CLASS_MAX, options->pool_slab_size, &tree->allocator);
+		phtree_pool_initialize (&tree->entry_pool, CHILDREN_POOL_SLOTS * sizeof (ph2_entry_t), 0, PHTREE_POOL_CLASS_MAX, options->pool_slab_size, &tree->allocator);
+	}
+
+	memset (&tree->element_pool, 0, sizeof (tree->element_pool));
+
+	if (options->element_size)
+	{
+		// pool blocks have to be a multiple of the alignment and big enough for the free list link
+		size_t alignment = _Alignof (max_align_t);
+		size_t block_size = (options->element_size < sizeof (void*)) ? sizeof (void*) : options->element_size;
+
+		block_size = (block_size + alignment - 1) & ~(alignment - 1);
+		phtree_pool_initialize (&tree->element_pool, block_size, alignment, 1, options->pool_slab_size, &tree->allocator);
+	}
+
+	tree->concurrent = NULL;
+
+	if (options->concurrent)
+	{
+		tree->concurrent = tree_calloc (tree, 1, sizeof (*tree->concurrent));
+
+		if (!tree->concurrent)
+		{
+			return 1;
+		}
+
+		ph2_node_t* root = tree_aligned_calloc (tree, 1, sizeof (*root), _Alignof (ph2_node_t));
+
+		if (!root || root_initialize (tree, root))
+		{
+			tree_aligned_free (tree, root);
+			tree_free (tree, tree->concurrent);
+			tree->concurrent = NULL;
+			return 1;
+		}
+
+		atomic_init (&tree->concurrent->root, root);
+		atomic_init (&tree->concurrent->epoch, 1);
+		atomic_init (&tree->concurrent->readers[0], 0);
+		atomic_init (&tree->concurrent->readers[1], 0);
+	}
+	else if (root_initialize (tree, &tree->root))
+	{
+		return 1;
+	}
+
+	tree->element_create = element_create;
+	tree->element_initialize = options->element_initialize;
+	tree->element_destroy = element_destroy;
+	tree->convert_to_key = convert_to_key;
+	tree->convert_to_point = convert_to_point;
+	tree->convert_to_box_point = convert_to_box_point;
+
+	return 0;
+}
+
+/*
+ * create a new tree
+ */
+ph2_t* ph2_create (
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	phtree_key_t (*convert_to_key) (void* input),
+	void (*convert_to_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	ph2_options_t* options)
+{
+	// the tree itself comes from the allocator in options too
+	phtree_allocator_t* allocator = options ? options->allocator : NULL;
+	// the root node makes the tree more aligned than phtree_calloc guarantees
+	ph2_t* tree = phtree_allocator_aligned_calloc (allocator, 1, sizeof (*tree), _Alignof (ph2_t));
+
+	if (!tree)
+	{
+		return NULL;
+	}
+
+	if (ph2_initialize (tree, element_create, element_destroy, convert_to_key, convert_to_point, convert_to_box_point, options))
+	{
+		phtree_allocator_aligned_free (allocator, tree);
+		return NULL;
+	}
+
+	return tree;
+}
+
+/*
+ * whole tree walks are iterative
+ * 	every frame of the stack is a node and the index of its next child to visit
+ * 	the tree is at most PHTREE_DEPTH nodes deep, so the stack never overflows
+ *
+ * every step down is a pointer chase in to a children array
+ * 	so while one child's subtree is walked the next sibling's children array is prefetched
+ * 		and is hopefully already in cache once the walk gets to it
+ */
+typedef struct
+{
+	ph2_node_t* node;
+	int index;
+} walk_frame_t;
+
+#define node_prefetch_children(node,index) phtree_prefetch ((node)->children.nodes[index].children.memory)
+
+/*
+ * free _ALL_ of the nodes under and including the argument node
+ * 	when free_children is false only the entries and the arrays too large for the pools are freed
+ * 		the other children arrays are left for the pool to drop
+ */
+static void free_nodes (ph2_t* tree, ph2_node_t* node, bool free_children)
+{
+	walk_frame_t stack[PHTREE_DEPTH];
+	int depth = 1;
+
+	stack[0] = (walk_frame_t) {node, 0};
+
+	while (depth > 0)
+	{
+		walk_frame_t* frame = &stack[depth - 1];
+		ph2_node_t* current_node = frame->node;
+
+		if (!phtree_node_is_leaf (current_node) && frame->index < current_node->child_count)
+		{
+			int index = frame->index;
+
+			frame->index++;
+
+			if (frame->index < current_node->child_count)
+			{
+				node_prefetch_children (current_node, frame->index);
+			}
+
+			stack[depth] = (walk_frame_t) {&current_node->children.nodes[index], 0};
+			depth++;
+			continue;
+		}
+
+		// everything below current_node is gone
+		// 	so it can be freed itself
+		if (phtree_node_is_leaf (current_node))
+		{
+			for (int iter = 0; iter < current_node->child_count; iter++)
+			{
+				entry_free (tree, &current_node->children.entries[iter]);
+			}
+		}
+
+		if (free_children || !children_pooled (tree, current_node->child_capacity))
+		{
+			children_free (tree, phtree_node_is_leaf (current_node), current_node->children.memory, current_node->child_capacity);
+		}
+
+		depth--;
+	}
+}
+
+/*
+ * free all of the nodes and entries under root, including root's children
+ */
+static void nodes_release (ph2_t* tree, ph2_node_t* root)
+{
+	if (!tree->node_pool.block_size)
+	{
+		free_nodes (tree, root, true);
+	}
+	else
+	{
+		// with few enough dimensions every children array came from the pools
+		// 	so we only have to walk the tree if elements need to be destroyed
+		if (tree->element_destroy || !children_pooled (tree, (int) NODE_CHILD_MAX))
+		{
+			free_nodes (tree, root, false);
+		}
+
+		phtree_pool_clear (&tree->node_pool);
+		phtree_pool_clear (&tree->entry_pool);
+	}
+
+	// every element was either destroyed above or needs no destroying
+	phtree_pool_clear (&tree->element_pool);
+
+	root->children.memory = NULL;
+	root->active_children = 0;
+	root->child_count = 0;
+	root->child_capacity = 0;
+#if PHTREE_ENTRY_COUNTS
+	root->entry_count = 0;
+#endif
+}
+
+/*
+ * free everything in the tree
+ * 	in concurrent mode this also frees the concurrent state
+ */
+static void tree_release (ph2_t* tree)
+{
+	if (!tree->concurrent)
+	{
+		nodes_release (tree, &tree->root);
+		return;
+	}
+
+	ph2_node_t* root = tree_root (tree);
+
+	concurrent_synchronize (tree);
+	nodes_release (tree, root);
+	tree_aligned_free (tree, root);
+
+	tree_free (tree, tree->concurrent->previous.items);
+	tree_free (tree, tree->concurrent->current.items);
+	tree_free (tree, tree->concurrent);
+	tree->concurrent = NULL;
+}
+
+/*
+ * free all of the nodes and entries in the tree
+ */
+void ph2_clear (ph2_t* tree)
+{
+	if (!tree)
+	{
+		return;
+	}
+
+	tree->version++;
+
+	if (!tree->concurrent)
+	{
+		nodes_release (tree, &tree->root);
+		root_initialize (tree, &tree->root);
+		return;
+	}
+
+	// readers need a root to look at while the old nodes are freed
+	// 	an empty root with no children array does not use the pool
+	ph2_node_t* old_root = tree_root (tree);
+	ph2_node_t* empty_root = tree_aligned_calloc (tree, 1, sizeof (*empty_root), _Alignof (ph2_node_t));
+
+	if (!empty_root)
+	{
+		return;
+	}
+
+	*empty_root = *old_root;
+	empty_root->children.memory = NULL;
+	empty_root->active_children = 0;
+	empty_root->child_count = 0;
+	empty_root->child_capacity = 0;
+#if PHTREE_ENTRY_COUNTS
+	empty_root->entry_count = 0;
+#endif
+
+	root_publish (tree, empty_root);
+	concurrent_synchronize (tree);
+
+	nodes_release (tree, old_root);
+	tree_aligned_free (tree, old_root);
+
+	// the empty root is a whole tree on its own
+	// 	the first write gives it a children array
+	// so without memory for a new root it can just stay
+	ph2_node_t* root = tree_aligned_calloc (tree, 1, sizeof (*root), _Alignof (ph2_node_t));
+
+	if (!root)
+	{
+		return;
+	}
+
+	root_initialize (tree, root);
+	root_publish (tree, root);
+	retired_add (tree, empty_root, 0, RETIRED_ROOT);
+}
+
+void ph2_release (ph2_t* tree)
+{
+	if (!tree)
+	{
+		return;
+	}
+
+	tree->version++;
+
+	tree_release (tree);
+}
+
+/*
+ * free a tree
+ */
+void ph2_free (ph2_t* tree)
+{
+	if (!tree)
+	{
+		return;
+	}
+
+	// the allocator is inside of the memory being freed
+	phtree_allocator_t allocator = tree->allocator;
+
+	tree_release (tree);
+	phtree_allocator_aligned_free (&allocator, tree);
+}
+
+/*
+ * internal for_each function
+ * 	does not have safety check for function, or node existence
+ */
+static void for_each (ph2_node_t* node, void (*function) (void* element, void* data), void* data)
+{
+	walk_frame_t stack[PHTREE_DEPTH];
+	int depth = 1;
+
+	stack[0] = (walk_frame_t) {node, 0};
+
+	while (depth > 0)
+	{
+		walk_frame_t* frame = &stack[depth - 1];
+		ph2_node_t* current_node = frame->node;
+
+		if (phtree_node_is_leaf (current_node))
+		{
+			for (int iter = 0; iter < current_node->child_count; iter++)
+			{
+				function (current_node->children.entries[iter].element, data);
+			}
+
+			depth--;
+			continue;
+		}
+
+		if (frame->index >= current_node->child_count)
+		{
+			depth--;
+			continue;
+		}
+
+		int index = frame->index;
+
+		frame->index++;
+
+		if (frame->index < current_node->child_count)
+		{
+			node_prefetch_children (current_node, frame->index);
+		}
+
+		stack[depth] = (walk_frame_t) {&current_node->children.nodes[index], 0};
+		depth++;
+	}
+}
+
+/*
+ * run the iteration function on every element in the tree
+ *
+ * data is any external data the user wishes to pass to the iteration function
+ */
+void ph2_for_each (ph2_t* tree, phtree_iteration_function_t function, void* data)
+{
+	if (!tree || !function)
+	{
+		return;
+	}
+
+	int token = ph2_read_begin (tree);
+
+	for_each (tree_root (tree), function, data);
+
+	ph2_read_end (tree, token);
+}
+
+/*
+ * find an entry below node
+ * 	point must have node's prefix
+ */
+static ph2_entry_t* node_find_entry (ph2_node_t* node, ph2_point_t* point)
+{
+	ph2_node_t* current_node = node;
+	hypercube_address_t address;
+
+	while (!phtree_node_is_leaf (current_node))
+	{
+		address = calculate_hypercube_address (point, current_node);
+
+		if (!child_active (current_node, address))
+		{
+			return NULL;
+		}
+
+		current_node = &current_node->children.nodes[child_index (current_node, address)];
+
+		if (!prefix_equal (point, &current_node->point, current_node->postfix_length))
+		{
+			return NULL;
+		}
+	}
+
+	address = calculate_hypercube_address (point, current_node);
+
+	if (!child_active (current_node, address))
+	{
+		return NULL;
+	}
+
+	ph2_entry_t* entry = &current_node->children.entries[child_index (current_node, address)];
+
+	if (!point_equal (point, &entry->point))
+	{
+		return NULL;
+	}
+
+	return entry;
+}
+
+/*
+ * find an entry in the tree
+ */
+static ph2_entry_t* entry_find (ph2_t* tree, ph2_point_t* point)
+{
+	return node_find_entry (tree_root (tree), point);
+}
+
+/*
+ * add an entry for point below node, or find the one which is already there
+ * 	point must have node's prefix
+ * 	returns NULL if there was no memory for the entry, the tree is not changed
+ */
+static ph2_entry_t* node_insert_entry (ph2_t* tree, ph2_node_t* node, ph2_point_t* point)
+{
+	ph2_node_t* current_node = node;
+	bool added_entry = false;
+#if PHTREE_ENTRY_COUNTS
+	// every inner node on the way down gets one more entry below it
+	// 	but only once we know the point was not already in the tree
+	ph2_node_t* node_stack[PHTREE_DEPTH];
+	int stack_index = 0;
+#endif
+
+	// walking down adds the entry to whichever leaf it ends at
+	// 	a leaf we start at has to have its entry added here
+	if (phtree_node_is_leaf (current_node) && !node_add_entry (tree, current_node, point, &added_entry))
+	{
+		return NULL;
+	}
+
+#if PHTREE_STATS
+	int depth = 0;
+#endif
+
+	while (!phtree_node_is_leaf (current_node))
+	{
+#if PHTREE_ENTRY_COUNTS
+		node_stack[stack_index] = current_node;
+		stack_index++;
+#endif
+		current_node = node_add (tree, current_node, point, &added_entry);
+
+		// nothing is added until the last node on the way down
+		// 	so the nodes above are still as they were
+		if (!current_node)
+		{
+			return NULL;
+		}
+#if PHTREE_STATS
+		depth++;
+#endif
+	}
+
+	// depth only counts the nodes below where the insert started
+	// 	which is the root for everything except ph2_relocate
+	stats_depth (&tree->stats, depth);
+
+#if PHTREE_ENTRY_COUNTS
+	if (added_entry)
+	{
+		for (int iter = 0; iter < stack_index; iter++)
+		{
+			node_stack[iter]->entry_count++;
+		}
+	}
+#else
+	(void) added_entry;
+#endif
+
+	int offset = child_index (current_node, calculate_hypercube_address (point, current_node));
+
+	return &current_node->children.entries[offset];
+}
+
+static void node_remove_child (ph2_t* tree, ph2_node_t* node, hypercube_address_t address)
+{
+	int index = child_index (node, address);
+	ph2_node_t* child = &node->children.nodes[index];
+
+	children_retire (tree, phtree_node_is_leaf (child), child->children.memory, child->child_capacity);
+
+	memmove (child, child + 1, sizeof (ph2_node_t) * (node->child_count - index - 1));
+	stats_add (&tree->stats, memmove_bytes, sizeof (ph2_node_t) * (node->child_count - index - 1));
+
+	node->child_count--;
+	node->active_children &= ~child_flag (address);
+
+	node_shrink (tree, node);
+}
+
+static void node_remove_entry (ph2_t* tree, ph2_node_t* node, hypercube_address_t address)
+{
+	int index = child_index (node, address);
+	ph2_entry_t* entry = &node->children.entries[index];
+
+	if (entry->element)
+	{
+		element_retire (tree, entry->element);
+		entry->element = NULL;
+	}
+
+	memmove (entry, entry + 1, sizeof (ph2_entry_t) * (node->child_count - index - 1));
+	stats_add (&tree->stats, memmove_bytes, sizeof (ph2_entry_t) * (node->child_count - index - 1));
+
+	node->child_count--;
+	node->active_children &= ~child_flag (address);
+
+	node_shrink (tree, node);
+}
+
+/*
+ * remove an empty leaf from the end of a path
+ * 	then collapse the nodes above it which are left with a single child
+ * node_stack holds the stack_index inner nodes from the root down to the leaf's parent
+ */
+static void path_collapse (ph2_t* tree, ph2_node_t** node_stack, int stack_index, ph2_point_t* point)
+{
+	// set stack_index to the last node in the stack
+	// 	the parent of the leaf
+	stack_index--;
+
+	ph2_node_t* parent = node_stack[stack_index];
+
+	node_remove_child (tree, parent, calculate_hypercube_address (point, parent));
+
+	// node_stack[0] is root
+	// 	we dont need to run this on root
+	while (stack_index > 0)
+	{
+		parent = node_stack[stack_index - 1];
+		ph2_node_t* current_node = node_stack[stack_index];
+
+		// XXX
+		// 	we dont need to check if current_node->child_count == 0
+		// 		because that would imply that we had a split node which didnt split anything
+		// 			and only had a single child
+		// 		such a node shouldnt exist
+		// 			it should have been removed before getting here
+		if (current_node->child_count > 1)
+		{
+			break;
+		}
+
+		int index = child_index (parent, calculate_hypercube_address (point, parent));
+		// current_node _is_ parent->children[index]
+		// 	so hold on to its children array before it gets overwritten
+		ph2_node_t* children = current_node->children.nodes;
+		int capacity = current_node->child_capacity;
+		ph2_node_t* child = &parent->children.nodes[index];
+
+		// current_node->children.nodes[0] is the only child
+		*child = children[0];
+		child->infix_length = parent->postfix_length - child->postfix_length - 1;
+
+		children_retire (tree, false, children, capacity);
+
+		stack_index--;
+	}
+}
+
+/*
+ * remove the entry at point from below root
+ * 	nodes left empty or with a single child are collapsed the same as always
+ * 		root itself is never taken out, not even when it is a leaf
+ * 	root must already be private to the writer
+ *
+ * returns false if there was no entry at point
+ * 	or, in concurrent mode, no memory to copy the path to it
+ */
+static bool node_remove_point (ph2_t* tree, ph2_node_t* root, ph2_point_t* point)
+{
+	int stack_index = 0;
+	ph2_node_t* node_stack[PHTREE_DEPTH] = {0};
+	ph2_node_t* current_node = root;
+	hypercube_address_t address;
+
+	while (!phtree_node_is_leaf (current_node))
+	{
+		address = calculate_hypercube_address (point, current_node);
+
+		// if the point doesnt exist in the tree we dont need to remove it
+		if (!child_active (current_node, address))
+		{
+			return false;
+		}
+
+		node_stack[stack_index] = current_node;
+		stack_index++;
+		current_node = &current_node->children.nodes[child_index (current_node, address)];
+
+		if (!prefix_equal (point, &current_node->point, current_node->postfix_length)
+			|| !node_privatize (tree, current_node))
+		{
+			return false;
+		}
+	}
+
+	address = calculate_hypercube_address (point, current_node);
+
+	if (!child_active (current_node, address)
+		|| !point_equal (point, &current_node->children.entries[child_index (current_node, address)].point))
+	{
+		return false;
+	}
+
+	node_remove_entry (tree, current_node, address);
+
+#if PHTREE_ENTRY_COUNTS
+	// before any nodes are collapsed
+	// 	so the counts which get moved up are already correct
+	for (int iter = 0; iter < stack_index; iter++)
+	{
+		node_stack[iter]->entry_count--;
+	}
+#endif
+
+	if (current_node->child_count == 0 && stack_index > 0)
+	{
+		path_collapse (tree, node_stack, stack_index, point);
+	}
+
+	return true;
+}
+
+void* ph2_insert (ph2_t* tree, void* index)
+{
+	ph2_point_t point;
+	tree->convert_to_point (tree, &point, index);
+
+	void* element = NULL;
+
+	// in concurrent mode we dont want to copy the whole path
+	// 	just to find out the element already exists
+	// the writer can always read the tree without registering as a reader
+	if (tree->concurrent)
+	{
+		ph2_entry_t* existing = entry_find (tree, &point);
+
+		if (existing)
+		{
+			return existing->element;
+		}
+
+		// the point is known to be new
+		// 	so the element is made first and a failure never reaches the tree
+		element = element_new (tree, index);
+
+		if (!element)
+		{
+			return NULL;
+		}
+	}
+
+	ph2_node_t* root = write_begin (tree);
+	ph2_entry_t* entry = root ? node_insert_entry (tree, root, &point) : NULL;
+
+	if (!entry)
+	{
+		// the element was never in the tree, so it does not have to be retired
+		if (element)
+		{
+			element_delete (tree, element);
+		}
+
+		if (root)
+		{
+			write_end (tree, root);
+		}
+
+		return NULL;
+	}
+
+	if (!entry->element)
+	{
+		entry->element = element ? element : element_new (tree, index);
+
+		// an entry without an element would look like a missing point to everything else
+		// 	so outside of concurrent mode it is taken back out
+		// 		no copies are needed for that, so it can not fail
+		if (!entry->element)
+		{
+			node_remove_point (tree, root, &point);
+			write_end (tree, root);
+			return NULL;
+		}
+	}
+
+	element = entry->element;
+	write_end (tree, root);
+
+	return element;
+}
+
+/*
+ * bulk loading
+ */
+typedef struct
+{
+	ph2_point_t point;
+	// where the point came from in the bulk load input
+	size_t input;
+} bulk_item_t;
+
+static int bulk_item_compare (const void* a_in, const void* b_in)
+{
+	bulk_item_t* a = (bulk_item_t*) a_in;
+	bulk_item_t* b = (bulk_item_t*) b_in;
+	int order = point_z_order_compare (&a->point, &b->point);
+
+	if (order)
+	{
+		return order;
+	}
+
+	// equal points keep their input order
+	// 	so the first input at a point is the one which creates the element
+	// 		same as inserting them one at a time
+	return (a->input > b->input) - (a->input < b->input);
+}
+
+/*
+ * sort items the same way as bulk_item_compare without calling it n log n times
+ * 	a least significant digit first radix sort of the interleaved keys
+ * 		every pass takes RADIX_LEVELS bits of every dimension
+ * 		the sort is stable so equal points keep their input order
+ * 	passes where every item has the same digit are skipped without looking at the items again
+ * 		which is most of the high bits when the points are close together
+ * falls back to qsort when there is no memory for the second array
+ */
+#define RADIX_LEVELS ((DIMENSIONS <= 2) ? 4 : (DIMENSIONS <= 4) ? 2 : 1)
+#define RADIX_BUCKETS (1 << (DIMENSIONS * RADIX_LEVELS))
+
+/*
+ * the RADIX_LEVELS bits of a dimension spread out to every DIMENSIONS'th bit of a digit
+ * 	RADIX_LEVELS is never more than 4
+ */
+#define RADIX_SPREAD(bits) ((((bits) & 1) << 0) | ((((bits) >> 1) & 1) << DIMENSIONS) | ((((bits) >> 2) & 1) << (2 * DIMENSIONS)) | ((((bits) >> 3) & 1) << (3 * DIMENSIONS)))
+
+static const uint32_t radix_spread[16] =
+{
+	RADIX_SPREAD (0), RADIX_SPREAD (1), RADIX_SPREAD (2), RADIX_SPREAD (3),
+	RADIX_SPREAD (4), RADIX_SPREAD (5), RADIX_SPREAD (6), RADIX_SPREAD (7),
+	RADIX_SPREAD (8), RADIX_SPREAD (9), RADIX_SPREAD (10), RADIX_SPREAD (11),
+	RADIX_SPREAD (12), RADIX_SPREAD (13), RADIX_SPREAD (14), RADIX_SPREAD (15),
+};
+
+static uint32_t point_radix_digit (ph2_point_t* point, int level)
+{
+	uint32_t digit = 0;
+
+	// highest bit first, dimension 0 first within a bit
+	// 	the same order as point_z_order_compare
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		uint32_t bits = (uint32_t) (point->values[dimension] >> level) & ((1 << RADIX_LEVELS) - 1);
+
+		digit |= radix_spread[bits] << (DIMENSIONS - 1 - dimension);
+	}
+
+	return digit;
+}
+
+static void bulk_items_sort (ph2_t* tree, bulk_item_t* items, size_t count)
+{
+	if (count < 2)
+	{
+		return;
+	}
+
+	// every digit is also kept from counting to moving, the buckets always fit in a byte
+	bulk_item_t* buffer = tree_calloc (tree, count, sizeof (*buffer) + sizeof (uint8_t));
+
+	if (!buffer)
+	{
+		qsort (items, count, sizeof (*items), bulk_item_compare);
+		return;
+	}
+
+	bulk_item_t* from = items;
+	bulk_item_t* to = buffer;
+	uint8_t* digits = (uint8_t*) (buffer + count);
+	size_t offsets[RADIX_BUCKETS];
+	// the bits which are not the same in every item
+	phtree_key_t varying = 0;
+
+	for (size_t iter = 1; iter < count; iter++)
+	{
+		for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+		{
+			varying |= items[iter].point.values[dimension] ^ items[0].point.values[dimension];
+		}
+	}
+
+	for (int level = 0; level < PHTREE_BIT_WIDTH; level += RADIX_LEVELS)
+	{
+		if (!((varying >> level) & ((PHTREE_KEY_ONE << RADIX_LEVELS) - 1)))
+		{
+			continue;
+		}
+
+		memset (offsets, 0, sizeof (offsets));
+
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			digits[iter] = (uint8_t) point_radix_digit (&from[iter].point, level);
+			offsets[digits[iter]]++;
+		}
+
+		size_t offset = 0;
+
+		for (int bucket = 0; bucket < RADIX_BUCKETS; bucket++)
+		{
+			size_t bucket_count = offsets[bucket];
+
+			offsets[bucket] = offset;
+			offset += bucket_count;
+		}
+
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			to[offsets[digits[iter]]++] = from[iter];
+		}
+
+		bulk_item_t* swap = from;
+
+		from = to;
+		to = swap;
+	}
+
+	if (from != items)
+	{
+		memcpy (items, from, count * sizeof (*items));
+	}
+
+	tree_free (tree, buffer);
+}
+
+/*
+ * build all of the children of an initialized node out of items
+ * 	items are sorted by z-order, unique, and all inside of the node
+ * 	node has no children array yet
+ *
+ * every children array is allocated at its final size
+ * 	so nothing is ever moved or reallocated
+ *
+ * returns 1 if memory ran out
+ * 	everything built below node is freed again, node is left with no children array
+ */
+static int bulk_build (ph2_t* tree, ph2_node_t* node, bulk_item_t* items, size_t count, void** inputs)
+{
+	// count how many children we need
+	// 	items are sorted so all items at a single address are next to each other
+	int child_count = 1;
+
+	for (size_t iter = 1; iter < count; iter++)
+	{
+		if (calculate_hypercube_address (&items[iter].point, node) != calculate_hypercube_address (&items[iter - 1].point, node))
+		{
+			child_count++;
+		}
+	}
+
+	if (!node_initialize_capacity (tree, node, node->infix_length, node->postfix_length, &node->point, child_count))
+	{
+		return 1;
+	}
+
+	size_t start = 0;
+
+	while (start < count)
+	{
+		hypercube_address_t address = calculate_hypercube_address (&items[start].point, node);
+		size_t end = start + 1;
+
+		while (end < count && calculate_hypercube_address (&items[end].point, node) == address)
+		{
+			end++;
+		}
+
+		int index = node->child_count;
+
+		node->active_children |= child_flag (address);
+		node->child_count++;
+
+		bool failed;
+
+		if (phtree_node_is_leaf (node))
+		{
+			ph2_entry_t* entry = &node->children.entries[index];
+
+			entry->point = items[start].point;
+			entry->element = element_new (tree, inputs[items[start].input]);
+			failed = !entry->element;
+		}
+		else
+		{
+			ph2_node_t* child = &node->children.nodes[index];
+
+			// the first and last items of a z-order sorted run
+			// 	diverge at the highest bit of any two items in the run
+			// a run of a single item becomes a leaf, same as in node_try_add
+			int postfix_length = 0;
+
+			if (end - start > 1)
+			{
+				postfix_length = number_of_diverging_bits (&items[start].point, &items[end - 1].point) - 1;
+			}
+
+			child->infix_length = node->postfix_length - postfix_length - 1;
+			child->postfix_length = postfix_length;
+			child->point = items[start].point;
+
+			failed = bulk_build (tree, child, items + start, end - start, inputs) != 0;
+		}
+
+		if (failed)
+		{
+			// a failed child already freed what was below it
+			// 	and a failed entry has no element
+			// 		so only the children before it are left
+			node->child_count = index;
+			free_nodes (tree, node, true);
+
+			node->children.memory = NULL;
+			node->active_children = 0;
+			node->child_count = 0;
+			node->child_capacity = 0;
+
+			return 1;
+		}
+
+		start = end;
+	}
+
+#if PHTREE_ENTRY_COUNTS
+	node->entry_count = count;
+#endif
+
+	return 0;
+}
+
+int ph2_bulk_load (ph2_t* tree, void** inputs, size_t count)
+{
+	if (!tree || !inputs)
+	{
+		return 1;
+	}
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	// there is nothing to gain from building bottom up
+	// 	if we have to merge with existing nodes anyway
+	// in concurrent mode every insert has to be published
+	// 	so we also insert one at a time
+	if (!ph2_empty (tree) || tree->concurrent)
+	{
+		int result = 0;
+
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			if (!ph2_insert (tree, inputs[iter]))
+			{
+				result = 1;
+			}
+		}
+
+		return result;
+	}
+
+	bulk_item_t* items = tree_calloc (tree, count, sizeof (*items));
+
+	if (!items)
+	{
+		return 1;
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		tree->convert_to_point (tree, &items[iter].point, inputs[iter]);
+		items[iter].input = iter;
+	}
+
+	bulk_items_sort (tree, items, count);
+
+	// drop duplicate points
+	size_t unique_count = 1;
+
+	for (size_t iter = 1; iter < count; iter++)
+	{
+		if (!point_equal (&items[iter].point, &items[unique_count - 1].point))
+		{
+			items[unique_count] = items[iter];
+			unique_count++;
+		}
+	}
+
+	tree->version++;
+
+	// the root gets rebuilt with exactly as many children as it needs
+	children_free (tree, false, tree->root.children.memory, tree->root.child_capacity);
+
+	int result = bulk_build (tree, &tree->root, items, unique_count, inputs);
+
+	// the tree was empty before, so a failed build leaves it empty again
+	if (result)
+	{
+		root_initialize (tree, &tree->root);
+	}
+
+	tree_free (tree, items);
+
+	return result;
+}
+
+/*
+ * find an element at a specific index
+ * returns NULL if there is no element at the index
+ */
+void* ph2_find (ph2_t* tree, void* index)
+{
+	ph2_point_t point;
+	tree->convert_to_point (tree, &point, index);
+
+	int token = ph2_read_begin (tree);
+	ph2_entry_t* entry = entry_find (tree, &point);
+	void* element = entry ? entry->element : NULL;
+
+	ph2_read_end (tree, token);
+
+	return element;
+}
+
+void ph2_remove (ph2_t* tree, void* index)
+{
+	ph2_point_t point;
+	tree->convert_to_point (tree, &point, index);
+
+	// in concurrent mode we dont want to copy the whole path
+	// 	just to find out there is nothing to remove
+	if (tree->concurrent && !entry_find (tree, &point))
+	{
+		return;
+	}
+
+	ph2_node_t* root = write_begin (tree);
+
+	if (!root)
+	{
+		return;
+	}
+
+	node_remove_point (tree, root, &point);
+	write_end (tree, root);
+}
+
+/*
+ * move the element at old_index to new_index
+ * 	the walk for new_index starts at the deepest node on old_index's path which can also hold new_index
+ * 		so nodes above that are never touched
+ * 	the element is moved as is, element_create and element_destroy are not called
+ */
+int ph2_relocate (ph2_t* tree, void* old_index, void* new_index)
+{
+	ph2_point_t old_point;
+	ph2_point_t new_point;
+
+	tree->convert_to_point (tree, &old_point, old_index);
+	tree->convert_to_point (tree, &new_point, new_index);
+
+	if (point_equal (&old_point, &new_point))
+	{
+		return entry_find (tree, &old_point) ? 0 : 1;
+	}
+
+	// in concurrent mode we dont want to copy the whole path
+	// 	just to find out there is nothing to move
+	if (tree->concurrent && (!entry_find (tree, &old_point) || entry_find (tree, &new_point)))
+	{
+		return 1;
+	}
+
+	// unlike ph2_remove the leaf is on the stack too
+	ph2_node_t* node_stack[PHTREE_DEPTH + 1];
+	int stack_index = 0;
+	// the deepest node on the stack which new_point also belongs to
+	int common = 0;
+	ph2_node_t* root = write_begin (tree);
+	ph2_node_t* current_node = root;
+	hypercube_address_t address;
+
+	if (!root)
+	{
+		return 1;
+	}
+
+	node_stack[0] = root;
+
+	while (!phtree_node_is_leaf (current_node))
+	{
+		address = calculate_hypercube_address (&old_point, current_node);
+
+		if (!child_active (current_node, address))
+		{
+			write_end (tree, root);
+			return 1;
+		}
+
+		current_node = &current_node->children.nodes[child_index (current_node, address)];
+
+		if (!prefix_equal (&old_point, &current_node->point, current_node->postfix_length)
+			|| !node_privatize (tree, current_node))
+		{
+			write_end (tree, root);
+			return 1;
+		}
+
+		stack_index++;
+		node_stack[stack_index] = current_node;
+
+		if (common == stack_index - 1 && prefix_equal (&new_point, &current_node->point, current_node->postfix_length))
+		{
+			common = stack_index;
+		}
+	}
+
+	address = calculate_hypercube_address (&old_point, current_node);
+
+	if (!child_active (current_node, address)
+		|| !point_equal (&old_point, &current_node->children.entries[child_index (current_node, address)].point)
+		|| node_find_entry (node_stack[common], &new_point))
+	{
+		write_end (tree, root);
+		return 1;
+	}
+
+	// take the element out so node_remove_entry doesnt destroy it
+	ph2_entry_t* old_entry = &current_node->children.entries[child_index (current_node, address)];
+	void* element = old_entry->element;
+
+	old_entry->element = NULL;
+	node_remove_entry (tree, current_node, address);
+
+	// the nodes from first_changed down are removed or replaced when the path collapses
+	// 	an emptied leaf is removed, and its parent is replaced if that leaves it with a single child
+	// 		every other inner node has at least 2 children, so the collapse stops there
+	int first_changed = stack_index + 1;
+
+	if (current_node->child_count == 0)
+	{
+		first_changed = stack_index;
+
+		if (stack_index > 1 && node_stack[stack_index - 1]->child_count == 2)
+		{
+			first_changed = stack_index - 1;
+		}
+	}
+
+	int start = (common < first_changed) ? common : first_changed - 1;
+
+#if PHTREE_ENTRY_COUNTS
+	// start and everything above it lose the old entry and gain the new one
+	// 	node_insert_entry counts the new entry in start and below
+	for (int iter = start; iter < stack_index; iter++)
+	{
+		node_stack[iter]->entry_count--;
+	}
+#endif
+
+	if (current_node->child_count == 0)
+	{
+		path_collapse (tree, node_stack, stack_index, &old_point);
+	}
+
+	ph2_entry_t* new_entry = node_insert_entry (tree, node_stack[start], &new_point);
+	int result = 0;
+
+	// without memory for the new path the element goes back where it was
+	// 	start is on the old path and was not changed by the collapse
+	// 		so old_point can be inserted below it
+	if (!new_entry)
+	{
+		new_entry = node_insert_entry (tree, node_stack[start], &old_point);
+		result = 1;
+	}
+
+	if (new_entry)
+	{
+		new_entry->element = element;
+	}
+	else
+	{
+		element_retire (tree, element);
+
+#if PHTREE_ENTRY_COUNTS
+		// the entry is gone, so the nodes above start lose it too
+		for (int iter = 0; iter < start; iter++)
+		{
+			node_stack[iter]->entry_count--;
+		}
+#endif
+	}
+
+	write_end (tree, root);
+
+	return result;
+}
+
+/*
+ * check if the tree is empty
+ */
+bool ph2_empty (ph2_t* tree)
+{
+	int token = ph2_read_begin (tree);
+	bool empty = (tree_root (tree)->child_count == 0);
+
+	ph2_read_end (tree, token);
+
+	return empty;
+}
+
+/*
+ * give node, and every node below it, children arrays with as few slots as their children fit in
+ * 	in concurrent mode arrays which are already the right size are still copied
+ * 		so the nodes inside of them can be changed
+ */
+static int node_compact (ph2_t* tree, ph2_node_t* node)
+{
+	bool leaf = phtree_node_is_leaf (node);
+	int capacity = children_capacity_fit (tree, node->child_count, node->child_count);
+
+	if (capacity != node->child_capacity)
+	{
+		// not children_resize
+		// 	in concurrent mode the old array has to be retired instead of freed
+		void* children = children_allocate (tree, leaf, capacity);
+
+		if (!children)
+		{
+			return 1;
+		}
+
+		stats_add (&tree->stats, reallocs, 1);
+
+		if (node->children.memory)
+		{
+			memcpy (children, node->children.memory, node->child_count * children_slot_size (leaf));
+		}
+
+		children_retire (tree, leaf, node->children.memory, node->child_capacity);
+		node->children.memory = children;
+		node->child_capacity = capacity;
+	}
+	else if (!leaf && !node_privatize (tree, node))
+	{
+		return 1;
+	}
+
+	if (leaf)
+	{
+		return 0;
+	}
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		if (node_compact (tree, &node->children.nodes[iter]))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+int ph2_compact (ph2_t* tree)
+{
+	ph2_node_t* root = write_begin (tree);
+
+	if (!root)
+	{
+		return 1;
+	}
+
+	int result = node_compact (tree, root);
+
+	write_end (tree, root);
+
+	return result;
+}
+
+/*
+ * address_bit_sets[bit] is the set of addresses which have that bit set
+ * 	example:
+ * 		address_bit_sets[1] has addresses 2, 3, 6, 7, 10, 11, ...
+ * 		0xCC = 11001100
+ */
+static const uint64_t address_bit_sets[6] =
+{
+	UINT64_C(0xAAAAAAAAAAAAAAAA),
+	UINT64_C(0xCCCCCCCCCCCCCCCC),
+	UINT64_C(0xF0F0F0F0F0F0F0F0),
+	UINT64_C(0xFF00FF00FF00FF00),
+	UINT64_C(0xFFFF0000FFFF0000),
+	UINT64_C(0xFFFFFFFF00000000),
+};
+
+/*
+ * the set of child addresses which overlap the query window
+ * 	this is used to accelerate queries
+ * 		we can do a broad check if a child node overlaps the query window at all
+ * 		without needing to go to the child node and performing node_in_window
+ *
+ * 	if the child node does not overlap the query window
+ * 		we save a memory jump to that node
+ */
+static uint64_t node_window_children (ph2_node_t* node, ph2_query_t* query)
+{
+	uint64_t children = CHILD_MASK_ALL;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		// dimension 0 is the highest bit of an address
+		int bit = DIMENSIONS - 1 - dimension;
+
+		/*
+		 * for these >= to work properly
+		 * 	node->point has to be set to the mid point of the node
+		 * 	we set node->point to the mid point, during node creation
+		 * 		so we dont have to calculate it here
+		 */
+		// the window is entirely in the upper half of this dimension
+		if (query->min.values[dimension] >= node->point.values[dimension])
+		{
+			children &= address_bit_sets[bit];
+		}
+
+		// the window is entirely in the lower half of this dimension
+		if (query->max.values[dimension] < node->point.values[dimension])
+		{
+			children &= ~address_bit_sets[bit];
+		}
+	}
+
+	return children;
+}
+
+/*
+ * the vector filter only handles points which pack in to a 128 bit vector
+ * 	two 2d points or one 4d point of 32 bit keys
+ * 	every other tree uses the scalar filter below
+ */
+#if PHTREE_SIMD && PHTREE_BIT_WIDTH == 32 && (DIMENSIONS == 2 || DIMENSIONS == 4)
+/*
+ * bit n of the result is set when node->children.entries[n] is inside of the window
+ * 	every entry is compared, so the child address masks are not needed
+ * keys are unsigned but SSE2 only compares signed integers
+ * 	flipping the top bit of both sides of a compare keeps the unsigned order
+ */
+static inline uint64_t leaf_window_hits (ph2_node_t* node, ph2_query_t* query)
+{
+	const __m128i flip = _mm_set1_epi32 ((int) 0x80000000u);
+	ph2_entry_t* entries = node->children.entries;
+	uint64_t hits = 0;
+	int index = 0;
+
+#if DIMENSIONS == 2
+	// x0 y0 x1 y1
+	__m128i min = _mm_loadl_epi64 ((__m128i*) &query->min);
+	__m128i max = _mm_loadl_epi64 ((__m128i*) &query->max);
+
+	min = _mm_xor_si128 (_mm_unpacklo_epi64 (min, min), flip);
+	max = _mm_xor_si128 (_mm_unpacklo_epi64 (max, max), flip);
+
+	for (; index + 1 < node->child_count; index += 2)
+	{
+		__m128i points = _mm_unpacklo_epi64 (_mm_loadl_epi64 ((__m128i*) &entries[index].point), _mm_loadl_epi64 ((__m128i*) &entries[index + 1].point));
+
+		points = _mm_xor_si128 (points, flip);
+
+		__m128i outside = _mm_or_si128 (_mm_cmpgt_epi32 (min, points), _mm_cmpgt_epi32 (points, max));
+		int mask = _mm_movemask_ps (_mm_castsi128_ps (outside));
+
+		hits |= (uint64_t) ((mask & 0x3) == 0) << index;
+		hits |= (uint64_t) ((mask & 0xc) == 0) << (index + 1);
+	}
+#else
+	__m128i min = _mm_xor_si128 (_mm_loadu_si128 ((__m128i*) &query->min), flip);
+	__m128i max = _mm_xor_si128 (_mm_loadu_si128 ((__m128i*) &query->max), flip);
+
+	for (; index < node->child_count; index++)
+	{
+		__m128i point = _mm_xor_si128 (_mm_loadu_si128 ((__m128i*) &entries[index].point), flip);
+		__m128i outside = _mm_or_si128 (_mm_cmpgt_epi32 (min, point), _mm_cmpgt_epi32 (point, max));
+
+		hits |= (uint64_t) (_mm_movemask_ps (_mm_castsi128_ps (outside)) == 0) << index;
+	}
+#endif
+
+	// an odd entry left over
+	for (; index < node->child_count; index++)
+	{
+		hits |= (uint64_t) entry_in_window (&entries[index], query) << index;
+	}
+
+	stats_add (&query->stats, entries_tested, node->child_count);
+
+	return hits;
+}
+#else
+/*
+ * bit n of the result is set when node->children.entries[n] is inside of the window
+ * 	only the entries whose address is under the window are compared
+ */
+static inline uint64_t leaf_window_hits (ph2_node_t* node, ph2_query_t* query)
+{
+	uint64_t window_children = node_window_children (node, query);
+	// walk the active children in address order
+	// 	the lowest bit of remaining is always the child at children[index]
+	// 	so we never need to popcount an index
+	uint64_t remaining = node->active_children;
+	uint64_t hits = 0;
+	int index = 0;
+
+	while (remaining & window_children)
+	{
+		if ((window_children >> count_trailing_zeroes (remaining)) & 1)
+		{
+			stats_add (&query->stats, entries_tested, 1);
+
+			hits |= (uint64_t) entry_in_window (&node->children.entries[index], query) << index;
+		}
+
+		remaining &= remaining - 1;
+		index++;
+	}
+
+	return hits;
+}
+#endif
+
+/*
+ * run a window query on the entries of a leaf
+ */
+static void leaf_query_window (ph2_node_t* node, ph2_query_t* query, void* data)
+{
+	uint64_t hits = leaf_window_hits (node, query);
+
+	stats_add (&query->stats, hits, popcount (hits));
+
+	while (hits)
+	{
+		query->function (node->children.entries[count_trailing_zeroes (hits)].element, data);
+		hits &= hits - 1;
+	}
+}
+
+/*
+ * the lowest and highest key in every dimension which node can hold
+ * 	the node covers every point from prefix|000... to prefix|111...
+ */
+static void node_bounds (ph2_node_t* node, ph2_point_t* min, ph2_point_t* max)
+{
+	phtree_key_t key_mask = (node->postfix_length + 1 < PHTREE_BIT_WIDTH) ? PHTREE_KEY_MAX << (node->postfix_length + 1) : 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		min->values[dimension] = node->point.values[dimension] & key_mask;
+		max->values[dimension] = min->values[dimension] | ~key_mask;
+	}
+}
+
+/*
+ * box intersect queries
+ * 	ph2_query_box_set widens the window to 0 in the min corner dimensions
+ * 		and to PHTREE_KEY_MAX in the max corner dimensions
+ * 	so each dimension has a single bound which can fail
+ *
+ * open_min and open_max have a bit set for every dimension
+ * 	whose min or max bound still has to be checked
+ * a node entirely inside of a bound drops it for its whole subtree
+ * 	and once there are no bounds left every entry below the node is in the window
+ */
+static void window_open_bounds (ph2_query_t* query, unsigned int* open_min, unsigned int* open_max)
+{
+	*open_min = 0;
+	*open_max = 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		if (query->min.values[dimension] > 0)
+		{
+			*open_min |= 1u << dimension;
+		}
+
+		if (query->max.values[dimension] < PHTREE_KEY_MAX)
+		{
+			*open_max |= 1u << dimension;
+		}
+	}
+}
+
+/*
+ * node_window_children with only the open bounds
+ */
+static uint64_t node_box_children (ph2_node_t* node, ph2_query_t* query, unsigned int open_min, unsigned int open_max)
+{
+	uint64_t children = CHILD_MASK_ALL;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		int bit = DIMENSIONS - 1 - dimension;
+
+		if (((open_min >> dimension) & 1) && query->min.values[dimension] >= node->point.values[dimension])
+		{
+			children &= address_bit_sets[bit];
+		}
+
+		if (((open_max >> dimension) & 1) && query->max.values[dimension] < node->point.values[dimension])
+		{
+			children &= ~address_bit_sets[bit];
+		}
+	}
+
+	return children;
+}
+
+static bool entry_in_box_window (ph2_entry_t* entry, ph2_query_t* query, unsigned int open_min, unsigned int open_max)
+{
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		if (((open_min >> dimension) & 1) && entry->point.values[dimension] < query->min.values[dimension])
+		{
+			return false;
+		}
+
+		if (((open_max >> dimension) & 1) && entry->point.values[dimension] > query->max.values[dimension])
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * run query->function on every entry below node
+ * 	without checking them against the window
+ */
+static void node_query_all (ph2_node_t* node, ph2_query_t* query, void* data)
+{
+	if (phtree_node_is_leaf (node))
+	{
+		stats_add (&query->stats, hits, node->child_count);
+
+		for (int iter = 0; iter < node->child_count; iter++)
+		{
+			query->function (node->children.entries[iter].element, data);
+		}
+
+		return;
+	}
+
+	for (int iter = 0; iter < node->child_count; iter++)
+	{
+		node_query_all (&node->children.nodes[iter], query, data);
+	}
+}
+
+/*
+ * check node against the open bounds of a box intersect query
+ * 	the bounds node is entirely inside of are dropped from open_min and open_max
+ *
+ * returns false if node is outside of one of the bounds
+ */
+static bool node_box_bounds (ph2_node_t* node, ph2_query_t* query, unsigned int* open_min, unsigned int* open_max)
+{
+	ph2_point_t min;
+	ph2_point_t max;
+
+	node_bounds (node, &min, &max);
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		unsigned int flag = 1u << dimension;
+
+		if (*open_min & flag)
+		{
+			if (max.values[dimension] < query->min.values[dimension])
+			{
+				return false;
+			}
+
+			if (min.values[dimension] >= query->min.values[dimension])
+			{
+				*open_min &= ~flag;
+			}
+		}
+
+		if (*open_max & flag)
+		{
+			if (min.values[dimension] > query->max.values[dimension])
+			{
+				return false;
+			}
+
+			if (max.values[dimension] <= query->max.values[dimension])
+			{
+				*open_max &= ~flag;
+			}
+		}
+	}
+
+	return true;
+}
+
+/*
+ * run a box intersect query on a specific node
+ */
+static void node_query_box (ph2_node_t* node, ph2_query_t* query, void* data, int depth, unsigned int open_min, unsigned int open_max)
+{
+	if (!node_box_bounds (node, query, &open_min, &open_max))
+	{
+		return;
+	}
+
+	stats_add (&query->stats, nodes_visited, 1);
+	stats_depth (&query->stats, depth);
+
+	if (!open_min && !open_max)
+	{
+		node_query_all (node, query, data);
+		return;
+	}
+
+	uint64_t children = node_box_children (node, query, open_min, open_max);
+	uint64_t remaining = node->active_children;
+	int index = 0;
+
+	while (remaining & children)
+	{
+		if ((children >> count_trailing_zeroes (remaining)) & 1)
+		{
+			if (phtree_node_is_leaf (node))
+			{
+				ph2_entry_t* entry = &node->children.entries[index];
+
+				stats_add (&query->stats, entries_tested, 1);
+
+				if (entry_in_box_window (entry, query, open_min, open_max))
+				{
+					stats_add (&query->stats, hits, 1);
+					query->function (entry->element, data);
+				}
+			}
+			else
+			{
+				node_query_box (&node->children.nodes[index], query, data, depth + 1, open_min, open_max);
+			}
+		}
+
+		remaining &= remaining - 1;
+		index++;
+	}
+}
+
+/*
+ * run a window query on a specific node
+ * 	walked iteratively the same as for_each
+ * 		but only through the children which overlap the window
+ * 	leaves are queried as soon as they are found instead of getting a frame
+ */
+static void node_query_window (ph2_node_t* node, ph2_query_t* query, void* data)
+{
+	if (query->box_intersect)
+	{
+		unsigned int open_min;
+		unsigned int open_max;
+
+		window_open_bounds (query, &open_min, &open_max);
+		node_query_box (node, query, data, 1, open_min, open_max);
+		return;
+	}
+
+	if (!node_in_window (node, query))
+	{
+		return;
+	}
+
+	stats_add (&query->stats, nodes_visited, 1);
+	stats_depth (&query->stats, 1);
+
+	if (phtree_node_is_leaf (node))
+	{
+		leaf_query_window (node, query, data);
+		return;
+	}
+
+	struct ph2_query_iterator_frame_t stack[PHTREE_DEPTH];
+	int depth = 1;
+
+	stack[0] = (struct ph2_query_iterator_frame_t) {node, node->active_children, node_window_children (node, query), 0};
+
+	while (depth > 0)
+	{
+		struct ph2_query_iterator_frame_t* frame = &stack[depth - 1];
+		uint64_t remaining = frame->remaining;
+		uint64_t window_children = frame->window_children;
+		int index = frame->index;
+
+		// skip ahead to the next child which overlaps the window
+		while ((remaining & window_children) && !((window_children >> count_trailing_zeroes (remaining)) & 1))
+		{
+			remaining &= remaining - 1;
+			index++;
+		}
+
+		if (!(remaining & window_children))
+		{
+			depth--;
+			continue;
+		}
+
+		ph2_node_t* child = &frame->node->children.nodes[index];
+
+		frame->remaining = remaining & (remaining - 1);
+		frame->index = index + 1;
+
+		if (!node_in_window (child, query))
+		{
+			continue;
+		}
+
+		stats_add (&query->stats, nodes_visited, 1);
+		stats_depth (&query->stats, depth + 1);
+
+		if (phtree_node_is_leaf (child))
+		{
+			leaf_query_window (child, query, data);
+			continue;
+		}
+
+		// the next sibling is usually in the window too
+		// 	and is visited once child's subtree is done
+		if (frame->remaining & window_children)
+		{
+			node_prefetch_children (frame->node, frame->index);
+		}
+
+		stack[depth] = (struct ph2_query_iterator_frame_t) {child, child->active_children, node_window_children (child, query), 0};
+		depth++;
+	}
+}
+
+/*
+ * run a window query on a tree
+ */
+void ph2_query (ph2_t* tree, ph2_query_t* query, void* data)
+{
+	if (!tree || !query || !query->function)
+	{
+		return;
+	}
+
+	int token = ph2_read_begin (tree);
+	ph2_node_t* root = tree_root (tree);
+
+	for (int iter = 0; iter < root->child_count; iter++)
+	{
+		node_query_window (&root->children.nodes[iter], query, data);
+	}
+
+	ph2_read_end (tree, token);
+}
+
+/*
+ * count the entries of node which are inside of the query window
+ */
+static size_t node_query_count (ph2_node_t* node, ph2_query_t* query, int depth)
+{
+	if (!node_in_window (node, query))
+	{
+		return 0;
+	}
+
+	stats_add (&query->stats, nodes_visited, 1);
+	stats_depth (&query->stats, depth);
+
+	// the whole node is counted at once
+	// 	without entry counts only leaves know how many entries they have
+	if (node_inside_window (node, query))
+	{
+		if (phtree_node_is_leaf (node))
+		{
+			return node->child_count;
+		}
+
+#if PHTREE_ENTRY_COUNTS
+		return node->entry_count;
+#endif
+	}
+
+	uint64_t window_children = node_window_children (node, query);
+	uint64_t remaining = node->active_children;
+	int index = 0;
+	size_t count = 0;
+
+	if (phtree_node_is_leaf (node))
+	{
+		while (remaining & window_children)
+		{
+			if ((window_children >> count_trailing_zeroes (remaining)) & 1)
+			{
+				stats_add (&query->stats, entries_tested, 1);
+				count += entry_in_window (&node->children.entries[index], query);
+			}
+
+			remaining &= remaining - 1;
+			index++;
+		}
+
+		return count;
+	}
+
+	while (remaining & window_children)
+	{
+		if ((window_children >> count_trailing_zeroes (remaining)) & 1)
+		{
+			count += node_query_count (&node->children.nodes[index], query, depth + 1);
+		}
+
+		remaining &= remaining - 1;
+		index++;
+	}
+
+	return count;
+}
+
+size_t ph2_query_count (ph2_t* tree, ph2_query_t* query)
+{
+	if (!tree || !query)
+	{
+		return 0;
+	}
+
+	int token = ph2_read_begin (tree);
+	ph2_node_t* root = tree_root (tree);
+	size_t count = 0;
+
+	for (int iter = 0; iter < root->child_count; iter++)
+	{
+		count += node_query_count (&root->children.nodes[iter], query, 1);
+	}
+
+	// nodes counted as a whole are hits too
+	stats_add (&query->stats, hits, count);
+
+	ph2_read_end (tree, token);
+
+	return count;
+}
+
+typedef struct
+{
+	ph2_query_t* old_query;
+	ph2_query_t* new_query;
+	phtree_iteration_function_t on_enter;
+	phtree_iteration_function_t on_exit;
+	void* data;
+} query_delta_t;
+
+/*
+ * report the entries of node which are in exactly one of the two windows
+ * 	nodes outside of both windows, or entirely inside of both, can not have any
+ * 		so only the nodes along the edges of the windows are walked
+ */
+static void node_query_delta (ph2_node_t* node, query_delta_t* delta, int depth)
+{
+	bool in_old = node_in_window (node, delta->old_query);
+	bool in_new = node_in_window (node, delta->new_query);
+
+	if (!in_old && !in_new)
+	{
+		return;
+	}
+
+	if (in_old && in_new && node_inside_window (node, delta->old_query) && node_inside_window (node, delta->new_query))
+	{
+		return;
+	}
+
+	stats_add (&delta->new_query->stats, nodes_visited, 1);
+	stats_depth (&delta->new_query->stats, depth);
+
+	uint64_t old_children = in_old ? node_window_children (node, delta->old_query) : 0;
+	uint64_t new_children = in_new ? node_window_children (node, delta->new_query) : 0;
+	uint64_t window_children = old_children | new_children;
+	uint64_t remaining = node->active_children;
+	int index = 0;
+
+	while (remaining & window_children)
+	{
+		int address = count_trailing_zeroes (remaining);
+
+		if ((window_children >> address) & 1)
+		{
+			if (phtree_node_is_leaf (node))
+			{
+				ph2_entry_t* entry = &node->children.entries[index];
+
+				stats_add (&delta->new_query->stats, entries_tested, 1);
+
+				bool entry_old = ((old_children >> address) & 1) && entry_in_window (entry, delta->old_query);
+				bool entry_new = ((new_children >> address) & 1) && entry_in_window (entry, delta->new_query);
+
+				// hits are the entries which changed
+				if (entry_new != entry_old)
+				{
+					stats_add (&delta->new_query->stats, hits, 1);
+				}
+
+				if (entry_new && !entry_old && delta->on_enter)
+				{
+					delta->on_enter (entry->element, delta->data);
+				}
+				else if (entry_old && !entry_new && delta->on_exit)
+				{
+					delta->on_exit (entry->element, delta->data);
+				}
+			}
+			else
+			{
+				node_query_delta (&node->children.nodes[index], delta, depth + 1);
+			}
+		}
+
+		remaining &= remaining - 1;
+		index++;
+	}
+}
+
+void ph2_query_delta (ph2_t* tree, ph2_query_t* old_query, ph2_query_t* new_query, phtree_iteration_function_t on_enter, phtree_iteration_function_t on_exit, void* data)
+{
+	if (!tree || !old_query || !new_query || (!on_enter && !on_exit))
+	{
+		return;
+	}
+
+	query_delta_t delta = {old_query, new_query, on_enter, on_exit, data};
+	int token = ph2_read_begin (tree);
+	ph2_node_t* root = tree_root (tree);
+
+	for (int iter = 0; iter < root->child_count; iter++)
+	{
+		node_query_delta (&root->children.nodes[iter], &delta, 1);
+	}
+
+	ph2_read_end (tree, token);
+}
+
+/*
+ * batched window queries
+ *
+ * the tree is walked once for the whole batch
+ * 	every node is visited with the list of queries which overlap it
+ * 		and each child is only visited with the queries whose window children include it
+ *
+ * every level of the walk has its own scratch list of query indexes and window children masks
+ * 	a node filters the list its parent wrote in place
+ * 	then writes the list for each of its children into the next level
+ * box intersect queries also carry their open bounds down the list
+ * 	so they get the same pruning as in node_query_box
+ */
+typedef struct
+{
+	uint32_t* indexes;
+	uint64_t* window_children;
+	unsigned int* open_min;
+	unsigned int* open_max;
+} batch_level_t;
+
+typedef struct
+{
+	ph2_t* tree;
+	ph2_query_t* queries;
+	void** data;
+	size_t count;
+	batch_level_t levels[PHTREE_DEPTH + 1];
+} batch_t;
+
+typedef struct
+{
+	ph2_point_t center;
+	uint32_t index;
+} batch_item_t;
+
+static int batch_item_compare (const void* a_in, const void* b_in)
+{
+	const batch_item_t* a = a_in;
+	const batch_item_t* b = b_in;
+
+	return point_z_order_compare ((ph2_point_t*) &a->center, (ph2_point_t*) &b->center);
+}
+
+static bool batch_level_allocate (batch_t* batch, int level)
+{
+	batch_level_t* scratch = &batch->levels[level];
+
+	if (scratch->indexes)
+	{
+		return true;
+	}
+
+	scratch->indexes = tree_calloc (batch->tree, batch->count, sizeof (*scratch->indexes));
+	scratch->window_children = tree_calloc (batch->tree, batch->count, sizeof (*scratch->window_children));
+	scratch->open_min = tree_calloc (batch->tree, batch->count, sizeof (*scratch->open_min));
+	scratch->open_max = tree_calloc (batch->tree, batch->count, sizeof (*scratch->open_max));
+
+	return scratch->indexes && scratch->window_children && scratch->open_min && scratch->open_max;
+}
+
+/*
+ * run the count queries listed in batch->levels[level] on node
+ *
+ * returns false if scratch memory could not be allocated
+ */
+static bool node_query_batch (batch_t* batch, ph2_node_t* node, int level, size_t count)
+{
+	batch_level_t* scratch = &batch->levels[level];
+	uint64_t any_window_children = 0;
+	size_t overlapping = 0;
+
+	// once the batch is down to a single query there is nothing left to share
+	// 	and the plain walk is faster
+	if (count == 1)
+	{
+		uint32_t query_index = scratch->indexes[0];
+		ph2_query_t* query = &batch->queries[query_index];
+		void* data = batch->data ? batch->data[query_index] : NULL;
+
+		if (query->box_intersect)
+		{
+			node_query_box (node, query, data, 1, scratch->open_min[0], scratch->open_max[0]);
+		}
+		else
+		{
+			node_query_window (node, query, data);
+		}
+
+		return true;
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		uint32_t query_index = scratch->indexes[iter];
+		ph2_query_t* query = &batch->queries[query_index];
+		unsigned int open_min = scratch->open_min[iter];
+		unsigned int open_max = scratch->open_max[iter];
+		uint64_t window_children;
+
+		if (query->box_intersect)
+		{
+			if (!node_box_bounds (node, query, &open_min, &open_max))
+			{
+				continue;
+			}
+
+			// nothing left to check, so the query does not need to stay in the list
+			if (!open_min && !open_max)
+			{
+				node_query_all (node, query, batch->data ? batch->data[query_index] : NULL);
+				continue;
+			}
+
+			window_children = node_box_children (node, query, open_min, open_max);
+		}
+		else
+		{
+			if (!node_in_window (node, query))
+			{
+				continue;
+			}
+
+			window_children = node_window_children (node, query);
+		}
+
+		scratch->indexes[overlapping] = query_index;
+		scratch->window_children[overlapping] = window_children;
+		scratch->open_min[overlapping] = open_min;
+		scratch->open_max[overlapping] = open_max;
+		any_window_children |= window_children;
+		overlapping++;
+	}
+
+	uint64_t remaining = node->active_children;
+	int index = 0;
+
+	if (phtree_node_is_leaf (node))
+	{
+		while (remaining & any_window_children)
+		{
+			hypercube_address_t address = count_trailing_zeroes (remaining);
+
+			if ((any_window_children >> address) & 1)
+			{
+				ph2_entry_t* entry = &node->children.entries[index];
+
+				for (size_t iter = 0; iter < overlapping; iter++)
+				{
+					uint32_t query_index = scratch->indexes[iter];
+					ph2_query_t* query = &batch->queries[query_index];
+
+					if (!((scratch->window_children[iter] >> address) & 1))
+					{
+						continue;
+					}
+
+					bool in_window = query->box_intersect
+						? entry_in_box_window (entry, query, scratch->open_min[iter], scratch->open_max[iter])
+						: entry_in_window (entry, query);
+
+					if (in_window)
+					{
+						query->function (entry->element, batch->data ? batch->data[query_index] : NULL);
+					}
+				}
+			}
+
+			remaining &= remaining - 1;
+			index++;
+		}
+
+		return true;
+	}
+
+	if (!any_window_children)
+	{
+		return true;
+	}
+
+	if (!batch_level_allocate (batch, level + 1))
+	{
+		return false;
+	}
+
+	batch_level_t* next = &batch->levels[level + 1];
+
+	while (remaining & any_window_children)
+	{
+		hypercube_address_t address = count_trailing_zeroes (remaining);
+
+		if ((any_window_children >> address) & 1)
+		{
+			size_t child_count = 0;
+
+			for (size_t iter = 0; iter < overlapping; iter++)
+			{
+				if ((scratch->window_children[iter] >> address) & 1)
+				{
+					next->indexes[child_count] = scratch->indexes[iter];
+					next->open_min[child_count] = scratch->open_min[iter];
+					next->open_max[child_count] = scratch->open_max[iter];
+					child_count++;
+				}
+			}
+
+			if (!node_query_batch (batch, &node->children.nodes[index], level + 1, child_count))
+			{
+				return false;
+			}
+		}
+
+		remaining &= remaining - 1;
+		index++;
+	}
+
+	return true;
+}
+
+int ph2_query_batch (ph2_t* tree, ph2_query_t* queries, size_t count, void** data)
+{
+	if (!tree || !queries || count > UINT32_MAX)
+	{
+		return 1;
+	}
+
+	batch_t batch = {.tree = tree, .queries = queries, .data = data, .count = count};
+	batch_item_t* items = tree_calloc (tree, count ? count : 1, sizeof (*items));
+	int result = 0;
+	int token = ph2_read_begin (tree);
+
+	if (!items || !batch_level_allocate (&batch, 0))
+	{
+		// without memory to set up the batch we can still run the queries one at a time
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			ph2_query (tree, &queries[iter], data ? data[iter] : NULL);
+		}
+	}
+	else
+	{
+		size_t valid = 0;
+
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			if (!queries[iter].function)
+			{
+				continue;
+			}
+
+			ph2_query_center (&queries[iter], &items[valid].center);
+			items[valid].index = iter;
+			valid++;
+		}
+
+		// queries next to each other in z-order tend to go down the same paths
+		// 	so sorting keeps the lists each node walks through close together
+		qsort (items, valid, sizeof (*items), batch_item_compare);
+
+		for (size_t iter = 0; iter < valid; iter++)
+		{
+			batch.levels[0].indexes[iter] = items[iter].index;
+
+			// other queries never look at their open bounds
+			if (queries[items[iter].index].box_intersect)
+			{
+				window_open_bounds (&queries[items[iter].index], &batch.levels[0].open_min[iter], &batch.levels[0].open_max[iter]);
+			}
+		}
+
+		if (!node_query_batch (&batch, tree_root (tree), 0, valid))
+		{
+			result = 1;
+		}
+	}
+
+	tree_free (tree, items);
+
+	for (int level = 0; level <= PHTREE_DEPTH; level++)
+	{
+		tree_free (tree, batch.levels[level].indexes);
+		tree_free (tree, batch.levels[level].window_children);
+		tree_free (tree, batch.levels[level].open_min);
+		tree_free (tree, batch.levels[level].open_max);
+	}
+
+	ph2_read_end (tree, token);
+
+	return result;
+}
+
+/*
+ * parallel window queries
+ *
+ * the top of the tree is split into a frontier of nodes
+ * 	every frontier node becomes a task which runs node_query_window on it
+ * the frontier starts as just the root
+ * 	then every node in it is replaced by its children in the window
+ * 		until there are enough tasks to keep every worker busy
+ * 		or PARALLEL_SPLIT_LEVELS levels have been split
+ */
+#define PARALLEL_SPLIT_LEVELS 4
+#define PARALLEL_TASKS_PER_THREAD 8
+
+typedef struct
+{
+	ph2_node_t* node;
+	ph2_query_t* query;
+	void** per_thread_data;
+#if PHTREE_STATS
+	// tasks count in to their own copy of the query
+	// 	which is added to the real query once every task is done
+	ph2_query_t stats_query;
+#endif
+} parallel_task_t;
+
+typedef struct
+{
+	ph2_t* tree;
+	ph2_node_t** nodes;
+	size_t count;
+	size_t capacity;
+} frontier_t;
+
+static bool frontier_push (frontier_t* frontier, ph2_node_t* node)
+{
+	if (frontier->count >= frontier->capacity)
+	{
+		size_t new_capacity = frontier->capacity ? frontier->capacity * 2 : 64;
+		ph2_node_t** nodes = tree_realloc (frontier->tree, frontier->nodes, new_capacity * sizeof (*nodes));
+
+		if (!nodes)
+		{
+			return false;
+		}
+
+		frontier->nodes = nodes;
+		frontier->capacity = new_capacity;
+	}
+
+	frontier->nodes[frontier->count] = node;
+	frontier->count++;
+
+	return true;
+}
+
+/*
+ * replace every node in from with its children which are in the window
+ * 	leaves can not be split further and are kept as they are
+ *
+ * returns false if memory could not be allocated
+ */
+static bool frontier_split (frontier_t* from, frontier_t* to, ph2_query_t* query)
+{
+	to->count = 0;
+
+	for (size_t iter = 0; iter < from->count; iter++)
+	{
+		ph2_node_t* node = from->nodes[iter];
+
+		if (phtree_node_is_leaf (node))
+		{
+			if (!frontier_push (to, node))
+			{
+				return false;
+			}
+
+			continue;
+		}
+
+		if (!node_in_window (node, query))
+		{
+			continue;
+		}
+
+		uint64_t window_children = node_window_children (node, query);
+		uint64_t remaining = node->active_children;
+		int index = 0;
+
+		while (remaining & window_children)
+		{
+			if ((window_children >> count_trailing_zeroes (remaining)) & 1)
+			{
+				if (!frontier_push (to, &node->children.nodes[index]))
+				{
+					return false;
+				}
+			}
+
+			remaining &= remaining - 1;
+			index++;
+		}
+	}
+
+	return true;
+}
+
+static void parallel_task_run (void* argument, int worker)
+{
+	parallel_task_t* task = argument;
+
+	node_query_window (task->node, task->query, task->per_thread_data[worker]);
+}
+
+void ph2_query_parallel (ph2_t* tree, ph2_query_t* query, phtree_thread_pool_t* pool, void** per_thread_data)
+{
+	if (!tree || !query || !query->function || !pool || !per_thread_data)
+	{
+		return;
+	}
+
+	int token = ph2_read_begin (tree);
+	frontier_t frontier = {.tree = tree};
+	frontier_t next = {.tree = tree};
+	parallel_task_t* tasks = NULL;
+	size_t target = (size_t) pool->thread_count * PARALLEL_TASKS_PER_THREAD;
+	bool failed = !frontier_push (&frontier, tree_root (tree));
+
+	for (int level = 0; !failed && level < PARALLEL_SPLIT_LEVELS && frontier.count < target; level++)
+	{
+		failed = !frontier_split (&frontier, &next, query);
+
+		frontier_t swap = frontier;
+		frontier = next;
+		next = swap;
+	}
+
+	if (!failed)
+	{
+		tasks = tree_calloc (tree, frontier.count ? frontier.count : 1, sizeof (*tasks));
+		failed = !tasks;
+	}
+
+	if (failed)
+	{
+		// without memory for tasks we can still run the query
+		// 	just not in parallel
+		tree_free (tree, frontier.nodes);
+		tree_free (tree, next.nodes);
+		ph2_query (tree, query, per_thread_data[0]);
+		ph2_read_end (tree, token);
+		return;
+	}
+
+	size_t submitted = 0;
+
+	for (; submitted < frontier.count; submitted++)
+	{
+		tasks[submitted] = (parallel_task_t) {.node = frontier.nodes[submitted], .query = query, .per_thread_data = per_thread_data};
+#if PHTREE_STATS
+		tasks[submitted].stats_query = *query;
+		tasks[submitted].stats_query.stats = (ph2_stats_t) {0};
+		tasks[submitted].query = &tasks[submitted].stats_query;
+#endif
+
+		if (phtree_thread_pool_submit (pool, parallel_task_run, &tasks[submitted]))
+		{
+			break;
+		}
+	}
+
+	phtree_thread_pool_wait (pool);
+
+#if PHTREE_STATS
+	for (size_t iter = 0; iter < submitted; iter++)
+	{
+		stats_merge (&query->stats, &tasks[iter].stats_query.stats);
+	}
+#endif
+
+	// once the pool is idle none of the workers are using per_thread_data[0]
+	// 	so any tasks which could not be submitted can run here
+	for (size_t iter = submitted; iter < frontier.count; iter++)
+	{
+		node_query_window (frontier.nodes[iter], query, per_thread_data[0]);
+	}
+
+	tree_free (tree, tasks);
+	tree_free (tree, frontier.nodes);
+	tree_free (tree, next.nodes);
+	ph2_read_end (tree, token);
+}
+
+/*
+ * sharded trees
+ */
+
+/*
+ * how many of the shard bits dimension gets
+ * 	the z-order takes one bit from every dimension in turn, starting with dimension 0
+ */
+static int shard_dimension_bits (ph2_sharded_t* sharded, int dimension)
+{
+	return sharded->shard_bits / DIMENSIONS + (dimension < sharded->shard_bits % DIMENSIONS);
+}
+
+/*
+ * the top shard_bits bits of the z-order of point
+ * 	in the same order calculate_hypercube_address uses, dimension 0 is the highest bit of every level
+ */
+static int point_shard (ph2_sharded_t* sharded, ph2_point_t* point)
+{
+	int shard = 0;
+
+	for (int bit = 0; bit < sharded->shard_bits; bit++)
+	{
+		int dimension = bit % DIMENSIONS;
+		int level = bit / DIMENSIONS;
+
+		shard = (shard << 1) | (int) ((point->values[dimension] >> (sharded->key_bits - 1 - level)) & 1);
+	}
+
+	return shard;
+}
+
+/*
+ * check if shard can hold points inside of the window of query
+ * 	in every dimension a shard is a digit of shard_dimension_bits bits just below key_bits
+ * 	the digits of the keys in [min, max] run from the digit of min up to the digit of max
+ * 		wrapping back around to 0 when the window crosses in to the bits above the digit
+ */
+static bool shard_in_window (ph2_sharded_t* sharded, int shard, ph2_query_t* query)
+{
+	phtree_key_t digits[DIMENSIONS] = {0};
+
+	for (int bit = 0; bit < sharded->shard_bits; bit++)
+	{
+		int dimension = bit % DIMENSIONS;
+
+		digits[dimension] = (digits[dimension] << 1) | ((shard >> (sharded->shard_bits - 1 - bit)) & 1);
+	}
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		int bits = shard_dimension_bits (sharded, dimension);
+
+		if (bits == 0)
+		{
+			continue;
+		}
+
+		int shift = sharded->key_bits - bits;
+		phtree_key_t mask = (PHTREE_KEY_ONE << bits) - 1;
+		phtree_key_t low = query->min.values[dimension] >> shift;
+		phtree_key_t high = query->max.values[dimension] >> shift;
+
+		// the window covers every digit
+		if (high - low >= mask)
+		{
+			continue;
+		}
+
+		if (((digits[dimension] - low) & mask) > high - low)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+ph2_sharded_t* ph2_sharded_create (
+	int shard_bits,
+	int key_bits,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	phtree_key_t (*convert_to_key) (void* input),
+	void (*convert_to_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	ph2_options_t* options)
+{
+	// the first dimension gets the most bits
+	if (shard_bits < 0 || shard_bits > PH2_SHARD_BITS_MAX
+		|| key_bits < 1 || key_bits > PHTREE_BIT_WIDTH
+		|| (shard_bits + DIMENSIONS - 1) / DIMENSIONS > key_bits)
+	{
+		return NULL;
+	}
+
+	phtree_allocator_t* allocator = options ? options->allocator : NULL;
+	ph2_sharded_t* sharded = phtree_allocator_calloc (allocator, 1, sizeof (*sharded));
+
+	if (!sharded)
+	{
+		return NULL;
+	}
+
+	if (allocator)
+	{
+		sharded->allocator = *allocator;
+	}
+
+	sharded->shard_bits = shard_bits;
+	sharded->key_bits = key_bits;
+	sharded->shard_count = 1 << shard_bits;
+	sharded->shards = phtree_allocator_calloc (&sharded->allocator, sharded->shard_count, sizeof (*sharded->shards));
+
+	if (!sharded->shards)
+	{
+		phtree_allocator_free (&sharded->allocator, sharded);
+		return NULL;
+	}
+
+	for (int shard = 0; shard < sharded->shard_count; shard++)
+	{
+		sharded->shards[shard] = ph2_create (element_create, element_destroy, convert_to_key, convert_to_point, convert_to_box_point, options);
+
+		if (!sharded->shards[shard])
+		{
+			ph2_sharded_free (sharded);
+			return NULL;
+		}
+	}
+
+	return sharded;
+}
+
+void ph2_sharded_free (ph2_sharded_t* sharded)
+{
+	if (!sharded)
+	{
+		return;
+	}
+
+	// the allocator is inside of the memory being freed
+	phtree_allocator_t allocator = sharded->allocator;
+
+	for (int shard = 0; shard < sharded->shard_count; shard++)
+	{
+		ph2_free (sharded->shards[shard]);
+	}
+
+	phtree_allocator_free (&allocator, sharded->shards);
+	phtree_allocator_free (&allocator, sharded);
+}
+
+int ph2_sharded_shard (ph2_sharded_t* sharded, void* index)
+{
+	// every shard converts points the same way
+	ph2_t* tree = sharded->shards[0];
+	ph2_point_t point;
+
+	tree->convert_to_point (tree, &point, index);
+
+	return point_shard (sharded, &point);
+}
+
+ph2_t* ph2_sharded_tree (ph2_sharded_t* sharded, int shard)
+{
+	if (!sharded || shard < 0 || shard >= sharded->shard_count)
+	{
+		return NULL;
+	}
+
+	return sharded->shards[shard];
+}
+
+void* ph2_sharded_insert (ph2_sharded_t* sharded, void* index)
+{
+	return ph2_insert (sharded->shards[ph2_sharded_shard (sharded, index)], index);
+}
+
+void* ph2_sharded_find (ph2_sharded_t* sharded, void* index)
+{
+	return ph2_find (sharded->shards[ph2_sharded_shard (sharded, index)], index);
+}
+
+void ph2_sharded_remove (ph2_sharded_t* sharded, void* index)
+{
+	ph2_remove (sharded->shards[ph2_sharded_shard (sharded, index)], index);
+}
+
+typedef struct
+{
+	ph2_t* tree;
+	void** inputs;
+	size_t count;
+	int result;
+} shard_load_t;
+
+static void shard_load_run (void* argument, int worker)
+{
+	shard_load_t* load = argument;
+
+	(void) worker;
+
+	load->result = ph2_bulk_load (load->tree, load->inputs, load->count);
+}
+
+int ph2_sharded_bulk_load (ph2_sharded_t* sharded, void** inputs, size_t count, phtree_thread_pool_t* pool)
+{
+	if (!sharded || (!inputs && count))
+	{
+		return 1;
+	}
+
+	if (count == 0)
+	{
+		return 0;
+	}
+
+	int* input_shards = phtree_allocator_calloc (&sharded->allocator, count, sizeof (*input_shards));
+	void** sorted = phtree_allocator_calloc (&sharded->allocator, count, sizeof (*sorted));
+	size_t* starts = phtree_allocator_calloc (&sharded->allocator, sharded->shard_count + 1, sizeof (*starts));
+	shard_load_t* loads = phtree_allocator_calloc (&sharded->allocator, sharded->shard_count, sizeof (*loads));
+	int result = 1;
+
+	if (!input_shards || !sorted || !starts || !loads)
+	{
+		goto done;
+	}
+
+	// counting sort by shard
+	// 	inputs keep their order inside of a shard so the first of several inputs at a point still wins
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		input_shards[iter] = ph2_sharded_shard (sharded, inputs[iter]);
+		starts[input_shards[iter] + 1]++;
+	}
+
+	for (int shard = 0; shard < sharded->shard_count; shard++)
+	{
+		starts[shard + 1] += starts[shard];
+		loads[shard] = (shard_load_t) {sharded->shards[shard], sorted + starts[shard], 0, 0};
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		shard_load_t* load = &loads[input_shards[iter]];
+
+		load->inputs[load->count] = inputs[iter];
+		load->count++;
+	}
+
+	for (int shard = 0; shard < sharded->shard_count; shard++)
+	{
+		if (!loads[shard].count)
+		{
+			continue;
+		}
+
+		// shards are independent
+		// 	so one which could not be submitted can be loaded here while the workers run
+		if (!pool || phtree_thread_pool_submit (pool, shard_load_run, &loads[shard]))
+		{
+			shard_load_run (&loads[shard], 0);
+		}
+	}
+
+	if (pool)
+	{
+		phtree_thread_pool_wait (pool);
+	}
+
+	result = 0;
+
+	for (int shard = 0; shard < sharded->shard_count; shard++)
+	{
+		result |= loads[shard].result;
+	}
+
+done:
+	phtree_allocator_free (&sharded->allocator, input_shards);
+	phtree_allocator_free (&sharded->allocator, sorted);
+	phtree_allocator_free (&sharded->allocator, starts);
+	phtree_allocator_free (&sharded->allocator, loads);
+
+	return result;
+}
+
+void ph2_sharded_query (ph2_sharded_t* sharded, ph2_query_t* query, void* data)
+{
+	if (!sharded || !query || !query->function)
+	{
+		return;
+	}
+
+	for (int shard = 0; shard < sharded->shard_count; shard++)
+	{
+		if (shard_in_window (sharded, shard, query))
+		{
+			ph2_query (sharded->shards[shard], query, data);
+		}
+	}
+}
+
+typedef struct
+{
+	ph2_t* tree;
+	ph2_query_t* query;
+	void** per_thread_data;
+#if PHTREE_STATS
+	// the same as parallel_task_t
+	ph2_query_t stats_query;
+#endif
+} shard_query_t;
+
+static void shard_query_run (void* argument, int worker)
+{
+	shard_query_t* task = argument;
+
+	ph2_query (task->tree, task->query, task->per_thread_data[worker]);
+}
+
+void ph2_sharded_query_parallel (ph2_sharded_t* sharded, ph2_query_t* query, phtree_thread_pool_t* pool, void** per_thread_data)
+{
+	if (!sharded || !query || !query->function || !pool || !per_thread_data)
+	{
+		return;
+	}
+
+	int overlapping = 0;
+	int last = 0;
+
+	for (int shard = 0; shard < sharded->shard_count; shard++)
+	{
+		if (shard_in_window (sharded, shard, query))
+		{
+			overlapping++;
+			last = shard;
+		}
+	}
+
+	if (overlapping == 0)
+	{
+		return;
+	}
+
+	// a single shard would only keep one worker busy
+	if (overlapping == 1)
+	{
+		ph2_query_parallel (sharded->shards[last], query, pool, per_thread_data);
+		return;
+	}
+
+	shard_query_t* tasks = phtree_allocator_calloc (&sharded->allocator, overlapping, sizeof (*tasks));
+
+	if (!tasks)
+	{
+		ph2_sharded_query (sharded, query, per_thread_data[0]);
+		return;
+	}
+
+	int task_count = 0;
+
+	for (int shard = 0; shard < sharded->shard_count; shard++)
+	{
+		if (shard_in_window (sharded, shard, query))
+		{
+			tasks[task_count] = (shard_query_t) {.tree = sharded->shards[shard], .query = query, .per_thread_data = per_thread_data};
+#if PHTREE_STATS
+			tasks[task_count].stats_query = *query;
+			tasks[task_count].stats_query.stats = (ph2_stats_t) {0};
+			tasks[task_count].query = &tasks[task_count].stats_query;
+#endif
+			task_count++;
+		}
+	}
+
+	int submitted = 0;
+
+	for (; submitted < task_count; submitted++)
+	{
+		if (phtree_thread_pool_submit (pool, shard_query_run, &tasks[submitted]))
+		{
+			break;
+		}
+	}
+
+	phtree_thread_pool_wait (pool);
+
+	// the same as ph2_query_parallel
+	// 	tasks which could not be submitted run here once the pool is idle
+	for (int iter = submitted; iter < task_count; iter++)
+	{
+		ph2_query (tasks[iter].tree, tasks[iter].query, per_thread_data[0]);
+	}
+
+#if PHTREE_STATS
+	for (int iter = 0; iter < task_count; iter++)
+	{
+		stats_merge (&query->stats, &tasks[iter].stats_query.stats);
+	}
+#endif
+
+	phtree_allocator_free (&sharded->allocator, tasks);
+}
+
+/*
+ * query iterators
+ */
+
+/*
+ * a leaf is filtered once, before it is pushed
+ * 	remaining and window_children then both hold the entries left to return
+ * 	bit n is node->children.entries[n], instead of a child address
+ */
+static void iterator_frame_push (ph2_query_iterator_t* iterator, ph2_node_t* node, uint64_t remaining, uint64_t window_children)
+{
+	iterator->stack[iterator->depth] = (struct ph2_query_iterator_frame_t) {node, remaining, window_children, 0};
+	iterator->depth++;
+}
+
+static void iterator_push (ph2_query_iterator_t* iterator, ph2_node_t* node)
+{
+	// the root is not counted
+	stats_add (&iterator->query->stats, nodes_visited, iterator->depth > 0);
+	stats_depth (&iterator->query->stats, iterator->depth);
+
+	if (phtree_node_is_leaf (node))
+	{
+		uint64_t hits = leaf_window_hits (node, iterator->query);
+
+		stats_add (&iterator->query->stats, hits, popcount (hits));
+
+		iterator_frame_push (iterator, node, hits, hits);
+	}
+	else
+	{
+		iterator_frame_push (iterator, node, node->active_children, node_window_children (node, iterator->query));
+	}
+}
+
+void ph2_query_iterator_initialize (ph2_t* tree, ph2_query_t* query, ph2_query_iterator_t* iterator)
+{
+	iterator->query = query;
+	iterator->depth = 0;
+
+	if (!tree || !query)
+	{
+		return;
+	}
+
+	ph2_node_t* root = tree_root (tree);
+
+	if (root->child_count == 0)
+	{
+		return;
+	}
+
+	// the root is the center of the whole key space
+	// 	so its masks are valid the same as any other node
+	iterator_push (iterator, root);
+}
+
+ph2_entry_t* ph2_query_iterator_next (ph2_query_iterator_t* iterator)
+{
+	ph2_query_t* query = iterator->query;
+
+	while (iterator->depth > 0)
+	{
+		struct ph2_query_iterator_frame_t* frame = &iterator->stack[iterator->depth - 1];
+		ph2_node_t* node = frame->node;
+
+		// no more children which overlap the window, go back up to the parent
+		if (!(frame->remaining & frame->window_children))
+		{
+			iterator->depth--;
+			continue;
+		}
+
+		if (phtree_node_is_leaf (node))
+		{
+			ph2_entry_t* entry = &node->children.entries[count_trailing_zeroes (frame->remaining)];
+
+			frame->remaining &= frame->remaining - 1;
+
+			return entry;
+		}
+
+		bool in_window = (frame->window_children >> count_trailing_zeroes (frame->remaining)) & 1;
+		int index = frame->index;
+
+		frame->remaining &= frame->remaining - 1;
+		frame->index++;
+
+		if (in_window && node_in_window (&node->children.nodes[index], query))
+		{
+			iterator_push (iterator, &node->children.nodes[index]);
+		}
+	}
+
+	return NULL;
+}
+
+int ph2_query_iterator_collect (ph2_query_iterator_t* iterator, ph2_entry_t** out, size_t capacity, size_t* count)
+{
+	ph2_query_t* query = iterator->query;
+	size_t written = 0;
+
+	while (iterator->depth > 0 && written < capacity)
+	{
+		struct ph2_query_iterator_frame_t* frame = &iterator->stack[iterator->depth - 1];
+		ph2_node_t* node = frame->node;
+
+		if (!(frame->remaining & frame->window_children))
+		{
+			iterator->depth--;
+			continue;
+		}
+
+		uint64_t remaining = frame->remaining;
+		uint64_t window_children = frame->window_children;
+		int index = frame->index;
+
+		// write out as much of the leaf's hits as fits before looking at the stack again
+		// 	the leaf is popped as soon as it is done
+		if (phtree_node_is_leaf (node))
+		{
+			while (remaining && written < capacity)
+			{
+				out[written] = &node->children.entries[count_trailing_zeroes (remaining)];
+				written++;
+				remaining &= remaining - 1;
+			}
+
+			frame->remaining = remaining;
+			iterator->depth -= !remaining;
+			continue;
+		}
+
+		// skip ahead to the next child which overlaps the window
+		while ((remaining & window_children) && !((window_children >> count_trailing_zeroes (remaining)) & 1))
+		{
+			remaining &= remaining - 1;
+			index++;
+		}
+
+		if (!(remaining & window_children))
+		{
+			iterator->depth--;
+			continue;
+		}
+
+		ph2_node_t* child = &node->children.nodes[index];
+
+		frame->remaining = remaining & (remaining - 1);
+		frame->index = index + 1;
+
+		if (!node_in_window (child, query))
+		{
+			continue;
+		}
+
+		// the same as node_query_window
+		// 	a leaf is written out in place and only pushed when out fills up part way through it
+		if (phtree_node_is_leaf (child))
+		{
+			uint64_t hits = leaf_window_hits (child, query);
+
+			stats_add (&query->stats, nodes_visited, 1);
+			stats_depth (&query->stats, iterator->depth);
+			stats_add (&query->stats, hits, popcount (hits));
+
+			while (hits && written < capacity)
+			{
+				out[written] = &child->children.entries[count_trailing_zeroes (hits)];
+				written++;
+				hits &= hits - 1;
+			}
+
+			if (hits)
+			{
+				iterator_frame_push (iterator, child, hits, hits);
+			}
+
+			continue;
+		}
+
+		if (frame->remaining & window_children)
+		{
+			node_prefetch_children (node, frame->index);
+		}
+
+		iterator_push (iterator, child);
+	}
+
+	if (count)
+	{
+		*count = written;
+	}
+
+	return iterator->depth > 0;
+}
+
+int ph2_query_collect (ph2_t* tree, ph2_query_t* query, ph2_entry_t** out, size_t capacity, size_t* count, ph2_query_iterator_t* iterator)
+{
+	ph2_query_iterator_t local_iterator;
+
+	if (!iterator)
+	{
+		iterator = &local_iterator;
+	}
+
+	int token = ph2_read_begin (tree);
+
+	ph2_query_iterator_initialize (tree, query, iterator);
+	int result = ph2_query_iterator_collect (iterator, out, capacity, count);
+
+	ph2_read_end (tree, token);
+
+	return result;
+}
+
+/*
+ * cursors
+ */
+
+/*
+ * the deepest node on the cursor's path which point is under
+ * 	the path is thrown away if the tree has changed since it was found
+ */
+static ph2_node_t* cursor_start (ph2_cursor_t* cursor, ph2_point_t* point)
+{
+	ph2_t* tree = cursor->tree;
+
+	if (cursor->depth == 0 || cursor->version != tree->version)
+	{
+		cursor->stack[0] = &tree->root;
+		cursor->depth = 1;
+		cursor->version = tree->version;
+	}
+
+	// the root is never popped, every point is under it
+	while (cursor->depth > 1)
+	{
+		ph2_node_t* node = cursor->stack[cursor->depth - 1];
+
+		if (prefix_equal (point, &node->point, node->postfix_length))
+		{
+			break;
+		}
+
+		cursor->depth--;
+	}
+
+	return cursor->stack[cursor->depth - 1];
+}
+
+/*
+ * the same as node_find_entry starting from cursor_start
+ * 	every node walked through is pushed on to the cursor's path
+ * 	when point is not in the tree the path ends at the node it would be inserted below
+ */
+static ph2_entry_t* cursor_find_entry (ph2_cursor_t* cursor, ph2_point_t* point)
+{
+	ph2_node_t* current_node = cursor_start (cursor, point);
+	hypercube_address_t address;
+
+	while (!phtree_node_is_leaf (current_node))
+	{
+		address = calculate_hypercube_address (point, current_node);
+
+		if (!child_active (current_node, address))
+		{
+			return NULL;
+		}
+
+		ph2_node_t* child = &current_node->children.nodes[child_index (current_node, address)];
+
+		if (!prefix_equal (point, &child->point, child->postfix_length))
+		{
+			return NULL;
+		}
+
+		cursor->stack[cursor->depth] = child;
+		cursor->depth++;
+		current_node = child;
+	}
+
+	address = calculate_hypercube_address (point, current_node);
+
+	if (!child_active (current_node, address))
+	{
+		return NULL;
+	}
+
+	ph2_entry_t* entry = &current_node->children.entries[child_index (current_node, address)];
+
+	return point_equal (point, &entry->point) ? entry : NULL;
+}
+
+void ph2_cursor_initialize (ph2_t* tree, ph2_cursor_t* cursor)
+{
+	cursor->tree = tree;
+	cursor->version = 0;
+	cursor->depth = 0;
+}
+
+void* ph2_cursor_find (ph2_cursor_t* cursor, void* index)
+{
+	ph2_t* tree = cursor->tree;
+
+	// a path can not be kept across read sections
+	if (tree->concurrent)
+	{
+		return ph2_find (tree, index);
+	}
+
+	ph2_point_t point;
+	tree->convert_to_point (tree, &point, index);
+
+	ph2_entry_t* entry = cursor_find_entry (cursor, &point);
+
+	return entry ? entry->element : NULL;
+}
+
+void* ph2_cursor_insert (ph2_cursor_t* cursor, void* index)
+{
+	ph2_t* tree = cursor->tree;
+
+	// in concurrent mode every insert copies its path from the root anyway
+	if (tree->concurrent)
+	{
+		return ph2_insert (tree, index);
+	}
+
+	ph2_point_t point;
+	tree->convert_to_point (tree, &point, index);
+
+	ph2_entry_t* entry = cursor_find_entry (cursor, &point);
+
+	if (entry)
+	{
+		return entry->element;
+	}
+
+	// the point is known to be new
+	// 	so the element is made first and a failure never reaches the tree
+	void* element = element_new (tree, index);
+
+	if (!element)
+	{
+		return NULL;
+	}
+
+	// nodes only move when their parent's children array changes
+	// 	the insert only changes arrays at or below the end of the path
+	// 		so the whole path is still valid afterwards
+	ph2_node_t* root = write_begin (tree);
+
+	entry = node_insert_entry (tree, cursor->stack[cursor->depth - 1], &point);
+
+	if (!entry)
+	{
+		element_delete (tree, element);
+		write_end (tree, root);
+		return NULL;
+	}
+
+	entry->element = element;
+
+#if PHTREE_ENTRY_COUNTS
+	// node_insert_entry only counts from where it started
+	for (int iter = 0; iter < cursor->depth - 1; iter++)
+	{
+		cursor->stack[iter]->entry_count++;
+	}
+#endif
+
+	write_end (tree, root);
+	cursor->version = tree->version;
+
+	return element;
+}
+
+/*
+ * batched changes
+ *
+ * ops are sorted by the z-order of their points and applied in a single walk down the tree
+ * 	the ops below a node are next to each other in the sorted ops
+ * 		so every node is visited once for all of them
+ * 	a node applies its removes first, then resizes its children array once
+ * 		to the size the growth policy wants for what is left plus every new child
+ * 	never used in concurrent mode, so nothing has to be retired
+ */
+
+typedef struct
+{
+	ph2_t* tree;
+	ph2_batch_op_t* ops;
+	bulk_item_t* items;
+	int result;
+} batch_changes_t;
+
+#define batch_op(batch,iter) (&(batch)->ops[(batch)->items[(iter)].input])
+#define batch_inserts(batch,iter) (batch_op (batch, iter)->type == PH2_BATCH_INSERT)
+
+/*
+ * the items below a node split up by the address they are at in the node
+ * 	run iter is items start[iter] to start[iter + 1]
+ */
+typedef struct
+{
+	size_t start[NODE_CHILD_MAX + 1];
+	hypercube_address_t address[NODE_CHILD_MAX];
+	int count;
+} batch_runs_t;
+
+/*
+ * split items start to end up in to runs
+ * 	every item must be under node, so the addresses only go up
+ */
+static void batch_runs (batch_changes_t* batch, ph2_node_t* node, size_t start, size_t end, batch_runs_t* runs)
+{
+	runs->count = 0;
+
+	for (size_t iter = start; iter < end; iter++)
+	{
+		hypercube_address_t address = calculate_hypercube_address (&batch->items[iter].point, node);
+
+		if (runs->count == 0 || runs->address[runs->count - 1] != address)
+		{
+			runs->start[runs->count] = iter;
+			runs->address[runs->count] = address;
+			runs->count++;
+		}
+	}
+
+	runs->start[runs->count] = end;
+}
+
+/*
+ * the first and last inserts in items start to end
+ * 	returns false if there are none
+ */
+static bool batch_insert_bounds (batch_changes_t* batch, size_t start, size_t end, size_t* first, size_t* last)
+{
+	while (start < end && !batch_inserts (batch, start))
+	{
+		start++;
+	}
+
+	while (end > start && !batch_inserts (batch, end - 1))
+	{
+		end--;
+	}
+
+	*first = start;
+	*last = end - 1;
+
+	return start < end;
+}
+
+/*
+ * ops which can not be applied
+ * 	removes of points which are not in the tree do nothing
+ * 	inserts only end up here when there was no memory for them
+ */
+static void batch_skip (batch_changes_t* batch, size_t start, size_t end)
+{
+	for (size_t iter = start; iter < end; iter++)
+	{
+		if (batch_inserts (batch, iter))
+		{
+			batch->result = 1;
+		}
+	}
+}
+
+/*
+ * set first and last to the items from start to end which are under node
+ * 	they are next to each other in z-order
+ * 	the ones around them are skipped
+ *
+ * returns false if there are none
+ */
+static bool batch_under (batch_changes_t* batch, ph2_node_t* node, size_t start, size_t end, size_t* first, size_t* last)
+{
+	*first = start;
+	*last = end;
+
+	while (*first < *last && !prefix_equal (&batch->items[*first].point, &node->point, node->postfix_length))
+	{
+		(*first)++;
+	}
+
+	while (*last > *first && !prefix_equal (&batch->items[*last - 1].point, &node->point, node->postfix_length))
+	{
+		(*last)--;
+	}
+
+	batch_skip (batch, start, *first);
+	batch_skip (batch, *last, end);
+
+	return *first < *last;
+}
+
+/*
+ * apply the ops in items start to end to the entries of leaf
+ * 	the new entries are merged with the old ones in a local array
+ * 		then copied in to an array of the final size in one go
+ */
+static void batch_leaf (batch_changes_t* batch, ph2_node_t* leaf, size_t start, size_t end)
+{
+	ph2_t* tree = batch->tree;
+	ph2_entry_t merged[NODE_CHILD_MAX];
+	ph2_child_set_t active_children = 0;
+	batch_runs_t runs;
+	int count = leaf->child_count;
+
+	batch_runs (batch, leaf, start, end, &runs);
+
+	// every point only has one address in a leaf
+	// 	so a run is every op on one point, in input order
+	// 		and the last op decides if the point is there afterwards
+	for (int run = 0; run < runs.count; run++)
+	{
+		count += (int) batch_inserts (batch, runs.start[run + 1] - 1) - (int) (child_active (leaf, runs.address[run]) != 0);
+	}
+
+	void* children = leaf->children.memory;
+	int capacity = leaf->child_capacity;
+	int new_capacity = (count > 0) ? children_capacity_policy (tree, count, capacity) : capacity;
+
+	if (new_capacity != capacity)
+	{
+		void* new_children = children_allocate (tree, true, new_capacity);
+
+		// without memory for the new array the old one is used as far as it goes
+		if (new_children)
+		{
+			children = new_children;
+			capacity = new_capacity;
+		}
+	}
+
+	// every insert fits unless the new array could not be allocated
+	bool fits = count <= capacity;
+	int index = 0;
+
+	count = 0;
+
+	for (int run = 0; run < runs.count || index < leaf->child_count;)
+	{
+		ph2_entry_t* entry = (index < leaf->child_count) ? &leaf->children.entries[index] : NULL;
+		hypercube_address_t entry_address = entry ? calculate_hypercube_address (&entry->point, leaf) : NODE_CHILD_MAX;
+		hypercube_address_t address = (run < runs.count) ? runs.address[run] : NODE_CHILD_MAX;
+
+		// entries without ops are kept as they are
+		if (entry_address < address)
+		{
+			active_children |= child_flag (entry_address);
+			merged[count++] = *entry;
+			index++;
+			continue;
+		}
+
+		void* element = NULL;
+
+		if (entry_address == address)
+		{
+			element = entry->element;
+			index++;
+		}
+
+		size_t run_end = runs.start[run + 1];
+		// a point which is removed again by the end of the run never needs a slot
+		bool kept = batch_inserts (batch, run_end - 1);
+		ph2_point_t* point = &batch->items[runs.start[run]].point;
+
+		for (size_t iter = runs.start[run]; iter < run_end; iter++)
+		{
+			ph2_batch_op_t* op = batch_op (batch, iter);
+
+			if (op->type == PH2_BATCH_REMOVE)
+			{
+				if (element)
+				{
+					element_delete (tree, element);
+					element = NULL;
+				}
+
+				continue;
+			}
+
+			// otherwise the slot has to fit next to every old entry still to be copied
+			if (!element && (!kept || fits || count + (leaf->child_count - index) < capacity))
+			{
+				element = element_new (tree, op->index);
+			}
+
+			if (!element)
+			{
+				batch->result = 1;
+			}
+
+			op->element = element;
+		}
+
+		if (element)
+		{
+			active_children |= child_flag (address);
+			merged[count].point = *point;
+			merged[count].element = element;
+			count++;
+		}
+
+		run++;
+	}
+
+	if (count > 0)
+	{
+		memcpy (children, merged, count * sizeof (ph2_entry_t));
+	}
+
+	if (children != leaf->children.memory)
+	{
+		if (leaf->children.memory)
+		{
+			stats_add (&tree->stats, reallocs, 1);
+		}
+
+		children_free (tree, true, leaf->children.memory, leaf->child_capacity);
+		leaf->children.memory = children;
+		leaf->child_capacity = capacity;
+	}
+
+	leaf->child_count = count;
+	leaf->active_children = active_children;
+}
+
+/*
+ * take the children of node which the batch left empty out of its array
+ * 	and replace the ones left with a single child with that child, same as path_collapse
+ * nothing is reallocated, that is up to the caller
+ *
+ * returns true if any children were taken out
+ */
+static bool batch_compact (ph2_t* tree, ph2_node_t* node)
+{
+	int count = 0;
+
+	for (int index = 0; index < node->child_count; index++)
+	{
+		ph2_node_t* child = &node->children.nodes[index];
+
+		if (child->child_count == 0)
+		{
+			node->active_children &= ~child_flag (calculate_hypercube_address (&child->point, node));
+			children_free (tree, phtree_node_is_leaf (child), child->children.memory, child->child_capacity);
+			continue;
+		}
+
+		if (!phtree_node_is_leaf (child) && child->child_count == 1)
+		{
+			ph2_node_t* children = child->children.nodes;
+			int capacity = child->child_capacity;
+
+			*child = children[0];
+			child->infix_length = node->postfix_length - child->postfix_length - 1;
+
+			children_free (tree, false, children, capacity);
+		}
+
+		if (count != index)
+		{
+			node->children.nodes[count] = *child;
+		}
+
+		count++;
+	}
+
+	bool removed = count != node->child_count;
+
+	node->child_count = count;
+
+	return removed;
+}
+
+/*
+ * get child ready for items start to end, the ops at its address in node
+ * 	inserts which are not under child get a split node put in above it, same as node_insert_split
+ * 		the split node gets room for all of the children the inserts give it at once
+ * first and last are set to the items under child afterwards
+ *
+ * returns false if there are none
+ */
+static bool batch_child (batch_changes_t* batch, ph2_node_t* node, ph2_node_t* child, size_t start, size_t end, size_t* first, size_t* last)
+{
+	ph2_t* tree = batch->tree;
+	size_t first_insert;
+	size_t last_insert;
+
+	if (batch_insert_bounds (batch, start, end, &first_insert, &last_insert))
+	{
+		// no insert in between diverges from child higher than the first or the last one
+		int diverging = number_of_diverging_bits (&batch->items[first_insert].point, &child->point);
+		int last_diverging = number_of_diverging_bits (&batch->items[last_insert].point, &child->point);
+
+		if (last_diverging > diverging)
+		{
+			diverging = last_diverging;
+		}
+
+		if (diverging > child->postfix_length + 1)
+		{
+			ph2_node_t split;
+
+			node_initialize_empty (&split, node->postfix_length - diverging, diverging - 1, &child->point);
+
+			hypercube_address_t child_address = calculate_hypercube_address (&child->point, &split);
+			batch_runs_t runs;
+			int capacity = 1;
+
+			batch_runs (batch, &split, first_insert, last_insert + 1, &runs);
+
+			for (int run = 0; run < runs.count; run++)
+			{
+				if (runs.address[run] != child_address)
+				{
+					capacity++;
+				}
+			}
+
+			// without memory for the split node the inserts which needed it fail below
+			if (node_initialize_capacity (tree, &split, split.infix_length, split.postfix_length, &split.point, capacity))
+			{
+				stats_add (&tree->stats, splits, 1);
+
+				split.children.nodes[0] = *child;
+				split.children.nodes[0].infix_length = (split.postfix_length - child->postfix_length) - 1;
+				split.active_children = child_flag (child_address);
+				split.child_count = 1;
+#if PHTREE_ENTRY_COUNTS
+				split.entry_count = node_entry_count (child);
+#endif
+				*child = split;
+			}
+		}
+	}
+
+	return batch_under (batch, child, start, end, first, last);
+}
+
+/*
+ * apply the op of item iter below node, the same as ph2_insert or ph2_remove would
+ * 	node is left for the caller to take out if the op leaves it empty
+ */
+static void batch_single (batch_changes_t* batch, ph2_node_t* node, size_t iter)
+{
+	ph2_t* tree = batch->tree;
+	ph2_batch_op_t* op = batch_op (batch, iter);
+	ph2_point_t* point = &batch->items[iter].point;
+
+	if (op->type == PH2_BATCH_REMOVE)
+	{
+		node_remove_point (tree, node, point);
+		return;
+	}
+
+	ph2_entry_t* entry = node_insert_entry (tree, node, point);
+
+	if (entry && !entry->element)
+	{
+		entry->element = element_new (tree, op->index);
+
+		if (!entry->element)
+		{
+			node_remove_point (tree, node, point);
+			entry = NULL;
+		}
+	}
+
+	if (!entry)
+	{
+		batch->result = 1;
+		return;
+	}
+
+	op->element = entry->element;
+}
+
+/*
+ * apply the ops in items start to end below node
+ * 	every item is under node
+ */
+static void batch_node (batch_changes_t* batch, ph2_node_t* node, size_t start, size_t end)
+{
+	// a single op has no walk to share
+	// 	so it is applied from node the same way it would be from the root
+	if (end - start == 1)
+	{
+		batch_single (batch, node, start);
+		return;
+	}
+
+	if (phtree_node_is_leaf (node))
+	{
+		batch_leaf (batch, node, start, end);
+		return;
+	}
+
+	ph2_t* tree = batch->tree;
+	ph2_child_set_t wanted_children = 0;
+	batch_runs_t runs;
+	size_t first;
+	size_t last;
+
+	batch_runs (batch, node, start, end, &runs);
+
+	// children which are already there first
+	// 	so their removes are done before the array is resized
+	for (int run = 0; run < runs.count; run++)
+	{
+		hypercube_address_t address = runs.address[run];
+
+		if (child_active (node, address))
+		{
+			ph2_node_t* child = &node->children.nodes[child_index (node, address)];
+
+			// a single op at a child has nothing to share below here
+			// 	inserts start from node so they still get their split node if they need one
+			// 		that only ever changes child, never the array it is in
+			if (runs.start[run + 1] - runs.start[run] == 1)
+			{
+				batch_single (batch, batch_inserts (batch, runs.start[run]) ? node : child, runs.start[run]);
+			}
+			else if (batch_child (batch, node, child, runs.start[run], runs.start[run + 1], &first, &last))
+			{
+				batch_node (batch, child, first, last);
+			}
+		}
+		else if (batch_insert_bounds (batch, runs.start[run], runs.start[run + 1], &first, &last))
+		{
+			wanted_children |= child_flag (address);
+		}
+	}
+
+	bool removed = batch_compact (tree, node);
+	ph2_child_set_t new_children = wanted_children;
+	int needed = node->child_count + popcount (new_children);
+
+	if ((removed || new_children) && needed > 0 && !node_resize (tree, node, needed))
+	{
+		// without memory to grow only the new children which fit are added
+		while (new_children && node->child_count + popcount (new_children) > node->child_capacity)
+		{
+			new_children &= new_children - 1;
+		}
+	}
+
+	if (new_children)
+	{
+		// the old children move up to make room for the new ones, from the back
+		// 	so every child is moved at most once
+		ph2_child_set_t active_children = node->active_children | new_children;
+		int read = node->child_count - 1;
+		int write = node->child_count + popcount (new_children) - 1;
+
+		stats_add (&tree->stats, memmove_bytes, sizeof (ph2_node_t) * node->child_count);
+
+		for (int address = (int) NODE_CHILD_MAX - 1; write > read; address--)
+		{
+			if (new_children & child_flag (address))
+			{
+				memset (&node->children.nodes[write], 0, sizeof (ph2_node_t));
+				write--;
+			}
+			else if (active_children & child_flag (address))
+			{
+				node->children.nodes[write] = node->children.nodes[read];
+				read--;
+				write--;
+			}
+		}
+
+		node->active_children = active_children;
+		node->child_count += popcount (new_children);
+	}
+
+	for (int run = 0; run < runs.count && wanted_children; run++)
+	{
+		hypercube_address_t address = runs.address[run];
+
+		if (new_children & child_flag (address))
+		{
+			batch_insert_bounds (batch, runs.start[run], runs.start[run + 1], &first, &last);
+
+			// the first and last inserts of a z-order sorted run
+			// 	diverge at the highest bit of any two items in the run
+			// a run of inserts at a single point becomes a leaf, same as in bulk_build
+			ph2_point_t* point = &batch->items[first].point;
+			int postfix_length = number_of_diverging_bits (point, &batch->items[last].point) - 1;
+
+			if (postfix_length < 0)
+			{
+				postfix_length = 0;
+			}
+
+			ph2_node_t* child = &node->children.nodes[child_index (node, address)];
+
+			node_initialize_empty (child, node->postfix_length - postfix_length - 1, postfix_length, point);
+			// removes after the last insert can still be under child
+			batch_under (batch, child, runs.start[run], runs.start[run + 1], &first, &last);
+			batch_node (batch, child, first, last);
+		}
+		else if (wanted_children & child_flag (address))
+		{
+			batch_skip (batch, runs.start[run], runs.start[run + 1]);
+		}
+	}
+
+	// new children whose inserts all failed or were removed again
+	if (new_children && batch_compact (tree, node))
+	{
+		node_shrink (tree, node);
+	}
+
+#if PHTREE_ENTRY_COUNTS
+	node->entry_count = 0;
+
+	for (int index = 0; index < node->child_count; index++)
+	{
+		node->entry_count += node_entry_count (&node->children.nodes[index]);
+	}
+#endif
+}
+
+int ph2_apply_batch (ph2_t* tree, ph2_batch_op_t* ops, size_t count)
+{
+	if (!tree || (!ops && count))
+	{
+		return 1;
+	}
+
+	bulk_item_t* items = tree->concurrent ? NULL : tree_calloc (tree, count ? count : 1, sizeof (*items));
+	int result = 0;
+
+	// in concurrent mode every op has to be published on its own anyway
+	// 	without memory to sort the ops they still get applied, just in their input order
+	if (!items)
+	{
+		for (size_t iter = 0; iter < count; iter++)
+		{
+			if (ops[iter].type == PH2_BATCH_INSERT)
+			{
+				ops[iter].element = ph2_insert (tree, ops[iter].index);
+
+				if (!ops[iter].element)
+				{
+					result = 1;
+				}
+			}
+			else
+			{
+				ph2_remove (tree, ops[iter].index);
+				ops[iter].element = NULL;
+			}
+		}
+
+		return result;
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		tree->convert_to_point (tree, &items[iter].point, ops[iter].index);
+		items[iter].input = iter;
+		ops[iter].element = NULL;
+	}
+
+	// ops on the same point stay in input order
+	bulk_items_sort (tree, items, count);
+
+	batch_changes_t batch;
+
+	batch.tree = tree;
+	batch.ops = ops;
+	batch.items = items;
+	batch.result = 0;
+
+	// outside of concurrent mode write_begin never fails
+	ph2_node_t* root = write_begin (tree);
+
+	if (count > 0)
+	{
+		batch_node (&batch, root, 0, count);
+	}
+
+	write_end (tree, root);
+	tree_free (tree, items);
+
+	return batch.result;
+}
+
+/*
+ * nearest neighbor queries
+ */
+
+double ph2_distance_euclidean (ph2_point_t* point_a, ph2_point_t* point_b)
+{
+	double sum = 0.0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		double difference = (double) point_a->values[dimension] - (double) point_b->values[dimension];
+		sum += difference * difference;
+	}
+
+	return sqrt (sum);
+}
+
+/*
+ * the point inside of a node which is closest to point
+ * 	all points inside of a node share the bits above postfix_length
+ * 	so the node covers every point from prefix|000... to prefix|111...
+ */
+static void node_closest_point (ph2_node_t* node, ph2_point_t* point, ph2_point_t* out)
+{
+	phtree_key_t key_mask = (node->postfix_length + 1 < PHTREE_BIT_WIDTH) ? PHTREE_KEY_MAX << (node->postfix_length + 1) : 0;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		phtree_key_t min = node->point.values[dimension] & key_mask;
+		phtree_key_t max = min | ~key_mask;
+		phtree_key_t value = point->values[dimension];
+
+		out->values[dimension] = (value < min) ? min : ((value > max) ? max : value);
+	}
+}
+
+typedef struct
+{
+	// for nodes this is the smallest distance any entry inside of the node can have
+	double distance;
+	// exactly one of node and entry is set
+	ph2_node_t* node;
+	ph2_entry_t* entry;
+} knn_item_t;
+
+/*
+ * a binary min heap of nodes and entries ordered by distance
+ */
+typedef struct
+{
+	ph2_t* tree;
+	knn_item_t* items;
+	size_t count;
+	size_t capacity;
+} knn_heap_t;
+
+static bool knn_heap_push (knn_heap_t* heap, double distance, ph2_node_t* node, ph2_entry_t* entry)
+{
+	if (heap->count >= heap->capacity)
+	{
+		size_t capacity = heap->capacity ? heap->capacity * 2 : 64;
+		knn_item_t* items = tree_realloc (heap->tree, heap->items, capacity * sizeof (*items));
+
+		if (!items)
+		{
+			return false;
+		}
+
+		heap->items = items;
+		heap->capacity = capacity;
+	}
+
+	size_t index = heap->count;
+	heap->count++;
+
+	// sift up
+	while (index > 0)
+	{
+		size_t parent = (index - 1) / 2;
+
+		if (heap->items[parent].distance <= distance)
+		{
+			break;
+		}
+
+		heap->items[index] = heap->items[parent];
+		index = parent;
+	}
+
+	heap->items[index] = (knn_item_t) {distance, node, entry};
+
+	return true;
+}
+
+static knn_item_t knn_heap_pop (knn_heap_t* heap)
+{
+	knn_item_t top = heap->items[0];
+	knn_item_t last = heap->items[heap->count - 1];
+	size_t index = 0;
+
+	heap->count--;
+
+	// sift down
+	while (true)
+	{
+		size_t child = (index * 2) + 1;
+
+		if (child >= heap->count)
+		{
+			break;
+		}
+
+		if (child + 1 < heap->count && heap->items[child + 1].distance < heap->items[child].distance)
+		{
+			child++;
+		}
+
+		if (last.distance <= heap->items[child].distance)
+		{
+			break;
+		}
+
+		heap->items[index] = heap->items[child];
+		index = child;
+	}
+
+	if (heap->count > 0)
+	{
+		heap->items[index] = last;
+	}
+
+	return top;
+}
+
+/*
+ * best first search
+ * 	nodes go in the heap with the smallest distance any of their entries could have
+ * 	entries go in the heap with their real distance
+ * 	when an entry comes off the top of the heap
+ * 		nothing left in the heap can be closer than it
+ */
+size_t ph2_knn (ph2_t* tree, void* center_in, size_t k, ph2_distance_function_t distance, ph2_entry_t** out)
+{
+	if (!tree || !center_in || !out || k == 0)
+	{
+		return 0;
+	}
+
+	if (!distance)
+	{
+		distance = ph2_distance_euclidean;
+	}
+
+	ph2_point_t center;
+	tree->convert_to_point (tree, &center, center_in);
+
+	knn_heap_t heap = {.tree = tree};
+	size_t found = 0;
+	int token = ph2_read_begin (tree);
+
+	if (!knn_heap_push (&heap, 0.0, tree_root (tree), NULL))
+	{
+		ph2_read_end (tree, token);
+		return 0;
+	}
+
+	while (heap.count > 0 && found < k)
+	{
+		knn_item_t item = knn_heap_pop (&heap);
+
+		if (item.entry)
+		{
+			out[found] = item.entry;
+			found++;
+			continue;
+		}
+
+		ph2_node_t* node = item.node;
+		bool leaf = phtree_node_is_leaf (node);
+
+		for (int iter = 0; iter < node->child_count; iter++)
+		{
+			bool pushed;
+
+			if (leaf)
+			{
+				ph2_entry_t* entry = &node->children.entries[iter];
+
+				pushed = knn_heap_push (&heap, distance (&center, &entry->point), NULL, entry);
+			}
+			else
+			{
+				ph2_node_t* child = &node->children.nodes[iter];
+				ph2_point_t closest;
+
+				node_closest_point (child, &center, &closest);
+				pushed = knn_heap_push (&heap, distance (&center, &closest), child, NULL);
+			}
+
+			if (!pushed)
+			{
+				tree_free (tree, heap.items);
+				ph2_read_end (tree, token);
+				return found;
+			}
+		}
+	}
+
+	tree_free (tree, heap.items);
+	ph2_read_end (tree, token);
+
+	return found;
+}
+
+/*
+ * query_set_internal does not need to convert external values in to internal points/keys
+ * so it needs to be its own function
+ */
+static void query_set_internal (ph2_t* tree, ph2_query_t* query, ph2_point_t* min, ph2_point_t* max, phtree_iteration_function_t function)
+{
+	ph2_query_clear (query);
+
+	query->min = *min;
+	query->max = *max;
+
+	// make sure min and max are properly populated
+	// 	all minimum values in min
+	// 	all maximum values in max
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		if (query->max.values[dimension] < query->min.values[dimension])
+		{
+			phtree_key_t temp = query->min.values[dimension];
+			query->min.values[dimension] = query->max.values[dimension];
+			query->max.values[dimension] = temp;
+		}
+	}
+
+	query->function = function;
+}
+
+void ph2_query_set (ph2_t* tree, ph2_query_t* query, void* min_in, void* max_in, phtree_iteration_function_t function)
+{
+	if (!query)
+	{
+		return;
+	}
+
+	ph2_point_t min = {0};
+	ph2_point_t max = {0};
+
+	tree->convert_to_point (tree, &min, min_in);
+	tree->convert_to_point (tree, &max, max_in);
+
+	query_set_internal (tree, query, &min, &max, function);
+}
+
+void ph2_query_box_set (ph2_t* tree, ph2_query_t* query, bool intersect, void* min_in, void* max_in, phtree_iteration_function_t function)
+{
+	if (!query)
+	{
+		return;
+	}
+
+	ph2_point_t min = {0};
+	ph2_point_t max = {0};
+
+	if (!tree->convert_to_box_point)
+	{
+		query->min = min;
+		query->max = max;
+		query->function = function;
+		query->box_intersect = false;
+
+		return;
+	}
+
+	tree->convert_to_box_point (tree, &min, min_in);
+	tree->convert_to_box_point (tree, &max, max_in);
+
+	if (intersect)
 	{
-		for_each (tree, &tree->root.node.children[iter], function, data);
+		for (int iter = 0; iter < DIMENSIONS / 2; iter++)
+		{
+			min.values[iter] = 0;
+		}
+
+		for (int iter = DIMENSIONS / 2; iter < DIMENSIONS; iter++)
+		{
+			max.values[iter] = PHTREE_KEY_MAX;
+		}
 	}
+
+	query_set_internal (tree, query, &min, &max, function);
+	query->box_intersect = intersect;
 }
 
-void* ph2_insert (ph2_t* tree, void* index)
+void ph2_query_box_point_set (ph2_t* tree, ph2_query_t* query, void* point, phtree_iteration_function_t function)
 {
-	ph2_point_t point;
-	tree->convert_to_point (tree, &point, index);
-	ph2_dual_node_t* current_dual = &tree->root;
+	ph2_query_box_set (tree, query, true, point, point, function);
+}
 
-	while (!phtree_node_is_leaf (current_dual))
+typedef struct
+{
+	ph2_pair_function_t function;
+	void* data;
+} box_pairs_t;
+
+/*
+ * boxes are min corner then max corner
+ * 	two boxes intersect when each min corner is <= the max corner of the other box
+ */
+static bool boxes_intersect (ph2_point_t* box_a, ph2_point_t* box_b)
+{
+	for (int dimension = 0; dimension < DIMENSIONS / 2; dimension++)
 	{
-		current_dual = node_add (current_dual, &point);
+		if (box_a->values[dimension] > box_b->values[dimension + DIMENSIONS / 2]
+			|| box_b->values[dimension] > box_a->values[dimension + DIMENSIONS / 2])
+		{
+			return false;
+		}
 	}
 
-	int offset = child_index (current_dual, calculate_hypercube_address (&point, current_dual));
-	ph2_entry_t* entry = (ph2_entry_t*) (current_dual->node.children + offset);
+	return true;
+}
 
-	if (!entry->element)
+/*
+ * could any box below node_a intersect any box below node_b
+ * 	the lowest min corner one node can hold has to be <= the highest max corner the other can hold
+ */
+static bool nodes_boxes_intersect (ph2_node_t* node_a, ph2_node_t* node_b)
+{
+	ph2_point_t min_a;
+	ph2_point_t max_a;
+	ph2_point_t min_b;
+	ph2_point_t max_b;
+
+	node_bounds (node_a, &min_a, &max_a);
+	node_bounds (node_b, &min_b, &max_b);
+
+	for (int dimension = 0; dimension < DIMENSIONS / 2; dimension++)
+	{
+		if (min_a.values[dimension] > max_b.values[dimension + DIMENSIONS / 2]
+			|| min_b.values[dimension] > max_a.values[dimension + DIMENSIONS / 2])
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * every intersecting pair with one box below node_a and the other below node_b
+ */
+static void box_pairs_between (box_pairs_t* pairs, ph2_node_t* node_a, ph2_node_t* node_b)
+{
+	if (!nodes_boxes_intersect (node_a, node_b))
+	{
+		return;
+	}
+
+	bool leaf_a = phtree_node_is_leaf (node_a);
+	bool leaf_b = phtree_node_is_leaf (node_b);
+
+	if (leaf_a && leaf_b)
+	{
+		for (int iter_a = 0; iter_a < node_a->child_count; iter_a++)
+		{
+			ph2_entry_t* entry_a = &node_a->children.entries[iter_a];
+
+			for (int iter_b = 0; iter_b < node_b->child_count; iter_b++)
+			{
+				ph2_entry_t* entry_b = &node_b->children.entries[iter_b];
+
+				if (boxes_intersect (&entry_a->point, &entry_b->point))
+				{
+					pairs->function (entry_a->element, entry_b->element, pairs->data);
+				}
+			}
+		}
+
+		return;
+	}
+
+	// split the bigger node
+	// 	so the two sides get smaller at the same rate
+	if (!leaf_a && (leaf_b || node_a->postfix_length >= node_b->postfix_length))
+	{
+		for (int iter = 0; iter < node_a->child_count; iter++)
+		{
+			box_pairs_between (pairs, &node_a->children.nodes[iter], node_b);
+		}
+	}
+	else
+	{
+		for (int iter = 0; iter < node_b->child_count; iter++)
+		{
+			box_pairs_between (pairs, node_a, &node_b->children.nodes[iter]);
+		}
+	}
+}
+
+/*
+ * every intersecting pair with both boxes below node
+ */
+static void box_pairs_within (box_pairs_t* pairs, ph2_node_t* node)
+{
+	if (phtree_node_is_leaf (node))
+	{
+		for (int iter_a = 0; iter_a < node->child_count; iter_a++)
+		{
+			ph2_entry_t* entry_a = &node->children.entries[iter_a];
+
+			for (int iter_b = iter_a + 1; iter_b < node->child_count; iter_b++)
+			{
+				ph2_entry_t* entry_b = &node->children.entries[iter_b];
+
+				if (boxes_intersect (&entry_a->point, &entry_b->point))
+				{
+					pairs->function (entry_a->element, entry_b->element, pairs->data);
+				}
+			}
+		}
+
+		return;
+	}
+
+	for (int iter_a = 0; iter_a < node->child_count; iter_a++)
+	{
+		box_pairs_within (pairs, &node->children.nodes[iter_a]);
+
+		for (int iter_b = iter_a + 1; iter_b < node->child_count; iter_b++)
+		{
+			box_pairs_between (pairs, &node->children.nodes[iter_a], &node->children.nodes[iter_b]);
+		}
+	}
+}
+
+void ph2_box_pairs (ph2_t* tree, ph2_pair_function_t function, void* data)
+{
+	if (!tree || !function)
+	{
+		return;
+	}
+
+	box_pairs_t pairs = {function, data};
+	int token = ph2_read_begin (tree);
+
+	box_pairs_within (&pairs, tree_root (tree));
+
+	ph2_read_end (tree, token);
+}
+
+/*
+ * create a new window query
+ */
+ph2_query_t* ph2_query_create (ph2_t* tree)
+{
+	ph2_query_t* new_query = tree_calloc (tree, 1, sizeof (*new_query));
+
+	if (!new_query)
+	{
+		return NULL;
+	}
+
+	return new_query;
+}
+
+void ph2_query_free (ph2_t* tree, ph2_query_t* query)
+{
+	tree_free (tree, query);
+}
+
+/*
+ * clear a window query
+ */
+void ph2_query_clear (ph2_query_t* query)
+{
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		query->min.values[dimension] = 0;
+		query->max.values[dimension] = 0;
+	}
+
+	query->function = NULL;
+	query->box_intersect = false;
+#if PHTREE_STATS
+	query->stats = (ph2_stats_t) {0};
+#endif
+}
+
+void ph2_query_center (ph2_query_t* query, ph2_point_t* out)
+{
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	{
+		out->values[dimension] = query->min.values[dimension] + (query->max.values[dimension] - query->min.values[dimension]) / 2;
+	}
+}
+
+/*
+ * analyze
+ */
+
+static void node_analyze (ph2_t* tree, ph2_node_t* node, int depth, ph2_tree_info_t* info)
+{
+	bool leaf = phtree_node_is_leaf (node);
+	size_t bytes = (size_t) node->child_capacity * children_slot_size (leaf);
+
+	info->postfix_lengths[node->postfix_length]++;
+	info->infix_lengths[node->infix_length]++;
+	info->children_bytes += bytes;
+
+	if (!children_pooled (tree, node->child_capacity))
+	{
+		info->total_bytes += bytes;
+	}
+
+	if (leaf)
+	{
+		info->leaf_count++;
+		info->entry_count += node->child_count;
+		info->entry_slots += node->child_capacity;
+		info->entry_slots_used += node->child_count;
+
+		if (depth > info->max_depth)
+		{
+			info->max_depth = depth;
+		}
+	}
+	else
+	{
+		info->node_count++;
+		info->node_slots += node->child_capacity;
+		info->node_slots_used += node->child_count;
+	}
+}
+
+void ph2_analyze (ph2_t* tree, ph2_tree_info_t* out)
+{
+	*out = (ph2_tree_info_t) {0};
+
+	if (!tree)
+	{
+		return;
+	}
+
+	int token = ph2_read_begin (tree);
+	walk_frame_t stack[PHTREE_DEPTH];
+	int depth = 1;
+
+	stack[0] = (walk_frame_t) {tree_root (tree), 0};
+	node_analyze (tree, stack[0].node, 0, out);
+
+	// the same walk as free_nodes, but every node is looked at on the way down
+	while (depth > 0)
+	{
+		walk_frame_t* frame = &stack[depth - 1];
+		ph2_node_t* node = frame->node;
+
+		if (phtree_node_is_leaf (node) || frame->index >= node->child_count)
+		{
+			depth--;
+			continue;
+		}
+
+		ph2_node_t* child = &node->children.nodes[frame->index];
+
+		frame->index++;
+
+		if (frame->index < node->child_count)
+		{
+			node_prefetch_children (node, frame->index);
+		}
+
+		node_analyze (tree, child, depth, out);
+		stack[depth] = (walk_frame_t) {child, 0};
+		depth++;
+	}
+
+	ph2_read_end (tree, token);
+
+	size_t slots = out->node_slots + out->entry_slots;
+
+	out->fill_ratio = slots ? (double) (out->node_slots_used + out->entry_slots_used) / slots : 0.0;
+	out->pool_bytes = phtree_pool_reserved (&tree->node_pool) + phtree_pool_reserved (&tree->entry_pool) + phtree_pool_reserved (&tree->element_pool);
+	out->total_bytes += sizeof (*tree) + out->pool_bytes;
+}
+
+/*
+ * stats
+ */
+
+void ph2_stats (ph2_t* tree, ph2_stats_t* out)
+{
+	*out = (ph2_stats_t) {0};
+#if PHTREE_STATS
+	*out = tree->stats;
+#else
+	(void) tree;
+#endif
+}
+
+void ph2_stats_reset (ph2_t* tree)
+{
+#if PHTREE_STATS
+	tree->stats = (ph2_stats_t) {0};
+#else
+	(void) tree;
+#endif
+}
+
+void ph2_query_stats (ph2_query_t* query, ph2_stats_t* out)
+{
+	*out = (ph2_stats_t) {0};
+#if PHTREE_STATS
+	*out = query->stats;
+#else
+	(void) query;
+#endif
+}
+
+/*
+ * saving and mapping
+ *
+ * file layout, every section starts on an 8 byte boundary
+ * 	map_header_t
+ * 	map_node_t nodes[node_count]
+ * 		breadth first, so the children of every node are next to each other
+ * 		node 0 is the root
+ * 	map_entry_t entries[entry_count]
+ * 		the entries of each leaf are next to each other, in the same order as in the tree
+ * 	element data
+ * 		every element starts on a MAP_ELEMENT_ALIGNMENT boundary
+ *
+ * children are indexes in to the nodes or entries arrays instead of pointers
+ * 	so a mapped file can be queried exactly as it is on disk
+ */
+#define MAP_MAGIC "phtree\0\0"
+#define MAP_VERSION 1
+#define MAP_ELEMENT_ALIGNMENT 16
+#define map_align(size,alignment) (((size) + (alignment) - 1) & ~((uint64_t) (alignment) - 1))
+
+typedef struct
+{
+	char magic[8];
+	uint32_t version;
+	// a file can only be mapped by a tree with the same layout
+	uint32_t dimensions;
+	uint32_t bit_width;
+	uint32_t depth;
+	uint32_t node_size;
+	uint32_t entry_size;
+	uint64_t node_count;
+	uint64_t entry_count;
+	// byte offsets from the start of the file
+	uint64_t nodes_offset;
+	uint64_t entries_offset;
+	uint64_t elements_offset;
+	uint64_t elements_size;
+} map_header_t;
+
+typedef struct
+{
+	uint64_t active_children;
+	// index of the first child in the nodes array, or in the entries array for leaves
+	uint64_t children;
+	int8_t postfix_length;
+	int8_t infix_length;
+	int8_t child_count;
+	ph2_point_t point;
+} map_node_t;
+
+typedef struct
+{
+	ph2_point_t point;
+	// byte offset of the element in the element data
+	uint64_t element_offset;
+	// 0 when the element was not saved
+	uint64_t element_size;
+} map_entry_t;
+
+struct ph2_map_t
+{
+	// the whole file
+	char* memory;
+	size_t size;
+	// false when the file was read in to memory instead of being mapped
+	bool mapped;
+	map_header_t* header;
+	map_node_t* nodes;
+	map_entry_t* entries;
+	char* elements;
+};
+
+static int map_write (FILE* file, void* data, size_t size)
+{
+	return fwrite (data, 1, size, file) != size;
+}
+
+static int map_write_padding (FILE* file, uint64_t size)
+{
+	static const char zeroes[MAP_ELEMENT_ALIGNMENT] = {0};
+
+	return map_write (file, (void*) zeroes, size);
+}
+
+int ph2_save (ph2_t* tree, const char* path, ph2_element_serializer_t element_serializer)
+{
+	if (!tree || !path)
 	{
-		entry->element = tree->element_create (index);
+		return 1;
 	}
 
-	return entry->element;
-}
+	int token = ph2_read_begin (tree);
+	ph2_node_t* root = tree_root (tree);
+	FILE* file = fopen (path, "wb");
+	// every node in breadth first order
+	size_t node_capacity = 64;
+	size_t node_count = 1;
+	ph2_node_t** nodes = tree_calloc (tree, node_capacity, sizeof (*nodes));
+	void* buffer = NULL;
+	size_t buffer_size = 0;
+	int result = 1;
+
+	if (!file || !nodes)
+	{
+		goto done;
+	}
 
-/*
- * find an entry in the tree
- */
-ph2_entry_t* ph2_find_entry (ph2_t* tree, ph2_point_t* point)
-{
-	ph2_dual_node_t* current_dual = &tree->root.node.children[child_index (&tree->root, calculate_hypercube_address (point, &tree->root))];
-	hypercube_address_t address;
+	nodes[0] = root;
 
-	while (!phtree_node_is_leaf (current_dual))
+	for (size_t iter = 0; iter < node_count; iter++)
 	{
-		address = calculate_hypercube_address (point, current_dual);
+		ph2_node_t* node = nodes[iter];
 
-		if (!child_active (current_dual, address)
-			|| !prefix_equal (point, &current_dual->node.point, current_dual->node.postfix_length))
+		if (phtree_node_is_leaf (node))
 		{
-			return NULL;
+			continue;
 		}
 
-		current_dual = &current_dual->node.children[child_index (current_dual, address)];
-	}
+		if (node_count + node->child_count > node_capacity)
+		{
+			size_t new_capacity = node_capacity * 2 + node->child_count;
+			ph2_node_t** new_nodes = tree_realloc (tree, nodes, new_capacity * sizeof (*nodes));
 
-	address = calculate_hypercube_address (point, current_dual);
+			if (!new_nodes)
+			{
+				goto done;
+			}
 
-	if (!child_active (current_dual, address)
-		|| !point_equal (point, &current_dual->node.point))
-	{
-		return NULL;
+			nodes = new_nodes;
+			node_capacity = new_capacity;
+		}
+
+		for (int child = 0; child < node->child_count; child++)
+		{
+			nodes[node_count] = &node->children.nodes[child];
+			node_count++;
+		}
 	}
 
-	return (ph2_entry_t*) &current_dual->node.children[child_index (current_dual, address)];
-}
+	map_header_t header = {0};
 
-/*
- * find an element at a specific index
- * returns NULL if there is no element at the index
- */
-void* ph2_find (ph2_t* tree, void* index)
-{
-	ph2_point_t point;
-	tree->convert_to_point (tree, &point, index);
-	ph2_entry_t* entry = ph2_find_entry (tree, &point);
+	memcpy (header.magic, MAP_MAGIC, sizeof (header.magic));
+	header.version = MAP_VERSION;
+	header.dimensions = DIMENSIONS;
+	header.bit_width = PHTREE_BIT_WIDTH;
+	header.depth = PHTREE_DEPTH;
+	header.node_size = sizeof (map_node_t);
+	header.entry_size = sizeof (map_entry_t);
+	header.node_count = node_count;
+	header.nodes_offset = map_align (sizeof (header), 8);
 
-	if (!entry)
+	// the header is written again at the end once the element sizes are known
+	if (map_write (file, &header, sizeof (header)) || map_write_padding (file, header.nodes_offset - sizeof (header)))
 	{
-		return NULL;
+		goto done;
 	}
 
-	return entry->element;
-}
-
-void ph2_remove_child (ph2_dual_node_t* dual, hypercube_address_t address)
-{
-	int index = child_index (dual, address);
-	ph2_dual_node_t* child = &dual->node.children[index];
-
-	phtree_free (child->node.children);
+	// children are laid out in the same order as nodes
+	// 	so the first child of each node comes right after the children of the node before it
+	uint64_t next_node = 1;
+	uint64_t next_entry = 0;
 
-	memmove (dual->node.children + index, dual->node.children + index + 1, sizeof (ph2_node_t) * (dual->node.child_count - index - 1));
-
-	dual->node.child_count--;
-	dual->node.active_children &= ~(PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
-}
+	for (size_t iter = 0; iter < node_count; iter++)
+	{
+		ph2_node_t* node = nodes[iter];
+		map_node_t out = {0};
 
-void ph2_remove_entry (ph2_t* tree, ph2_dual_node_t* dual, hypercube_address_t address)
-{
-	int index = child_index (dual, address);
-	ph2_entry_t* entry = &dual->node.children[index].entry;
+		out.active_children = node->active_children;
+		out.postfix_length = node->postfix_length;
+		out.infix_length = node->infix_length;
+		out.child_count = node->child_count;
+		out.point = node->point;
 
-	if (entry->element)
-	{
-		if (tree->element_destroy)
+		if (phtree_node_is_leaf (node))
 		{
-			tree->element_destroy (entry->element);
+			out.children = next_entry;
+			next_entry += node->child_count;
+		}
+		else
+		{
+			out.children = next_node;
+			next_node += node->child_count;
 		}
 
-		entry->element = NULL;
+		if (map_write (file, &out, sizeof (out)))
+		{
+			goto done;
+		}
 	}
 
-	memmove (dual->node.children + index, dual->node.children + index + 1, sizeof (ph2_dual_node_t) * (dual->node.child_count - index - 1));
+	header.entry_count = next_entry;
+	header.entries_offset = map_align (header.nodes_offset + node_count * sizeof (map_node_t), 8);
 
-	dual->node.child_count--;
-	dual->node.active_children &= ~(PHTREE_CHILD_FLAG << (CHILD_SHIFT - address));
-}
+	if (map_write_padding (file, header.entries_offset - (header.nodes_offset + node_count * sizeof (map_node_t))))
+	{
+		goto done;
+	}
 
-void ph2_remove (ph2_t* tree, void* index)
-{
-	ph2_point_t point;
-	tree->convert_to_point (tree, &point, index);
-	int stack_index = 0;
-	ph2_dual_node_t* node_stack[PHTREE_DEPTH] = {0};
-	ph2_dual_node_t* current_node = &tree->root;
-	hypercube_address_t address;
+	uint64_t element_offset = 0;
 
-	while (!phtree_node_is_leaf (current_node))
+	for (size_t iter = 0; iter < node_count; iter++)
 	{
-		address = calculate_hypercube_address (&point, current_node);
+		ph2_node_t* node = nodes[iter];
 
-		if (child_active (current_node, address))
+		if (!phtree_node_is_leaf (node))
 		{
-			node_stack[stack_index] = current_node;
-			stack_index++;
-			current_node = &current_node->node.children[child_index (current_node, address)];
+			continue;
 		}
-		// if the point doesnt exist in the tree we dont need to remove it
-		else
+
+		for (int child = 0; child < node->child_count; child++)
 		{
-			return;
+			ph2_entry_t* entry = &node->children.entries[child];
+			map_entry_t out = {0};
+
+			out.point = entry->point;
+			out.element_offset = element_offset;
+			out.element_size = (element_serializer && entry->element) ? element_serializer (entry->element, NULL) : 0;
+			element_offset += map_align (out.element_size, MAP_ELEMENT_ALIGNMENT);
+
+			if (map_write (file, &out, sizeof (out)))
+			{
+				goto done;
+			}
 		}
 	}
 
-	ph2_remove_entry (tree, current_node, calculate_hypercube_address (&point, current_node));
+	header.elements_offset = map_align (header.entries_offset + header.entry_count * sizeof (map_entry_t), MAP_ELEMENT_ALIGNMENT);
+	header.elements_size = element_offset;
 
-	if (current_node->node.child_count == 0)
+	if (map_write_padding (file, header.elements_offset - (header.entries_offset + header.entry_count * sizeof (map_entry_t))))
 	{
-		// set stack_index to the last node in the stack
-		// 	the parent of current_node
-		stack_index--;
+		goto done;
+	}
 
-		ph2_dual_node_t* parent = node_stack[stack_index];
+	for (size_t iter = 0; iter < node_count && element_serializer; iter++)
+	{
+		ph2_node_t* node = nodes[iter];
 
-		ph2_remove_child (parent, calculate_hypercube_address (&point, parent));
-		stack_index--;
+		if (!phtree_node_is_leaf (node))
+		{
+			continue;
+		}
 
-		// node_stack[0] is root
-		// 	we dont need to run this on root
-		while (stack_index > 0)
+		for (int child = 0; child < node->child_count; child++)
 		{
-			parent = node_stack[stack_index - 1];
-			current_node = node_stack[stack_index];
+			void* element = node->children.entries[child].element;
+			size_t size = element ? element_serializer (element, NULL) : 0;
 
-			// XXX
-			// 	we dont need to check if current_node->child_count == 0
-			// 		because that would imply that we had a split node which didnt split anything
-			// 			and only had a single child
-			// 		such a node shouldnt exist
-			// 			it should have been removed before getting here
-			if (current_node->node.child_count > 1)
+			if (size > buffer_size)
 			{
-				break;
-			}
+				void* new_buffer = tree_realloc (tree, buffer, size);
 
-			int index = child_index (parent, calculate_hypercube_address (&point, parent));
+				if (!new_buffer)
+				{
+					goto done;
+				}
 
-			// current_node->children[0] is the only child
-			parent->node.children[index] = current_node->node.children[0];
-			parent->node.children[index].node.infix_length = parent->node.postfix_length - parent->node.children[index].node.postfix_length - 1;
+				buffer = new_buffer;
+				buffer_size = size;
+			}
 
-			phtree_free (current_node->node.children);
+			if (size)
+			{
+				memset (buffer, 0, size);
+				element_serializer (element, buffer);
+			}
 
-			stack_index--;
+			if (map_write (file, buffer, size) || map_write_padding (file, map_align (size, MAP_ELEMENT_ALIGNMENT) - size))
+			{
+				goto done;
+			}
 		}
 	}
+
+	if (fseek (file, 0, SEEK_SET) || map_write (file, &header, sizeof (header)))
+	{
+		goto done;
+	}
+
+	result = 0;
+
+done:
+	if (file && fclose (file))
+	{
+		result = 1;
+	}
+
+	tree_free (tree, buffer);
+	tree_free (tree, nodes);
+	ph2_read_end (tree, token);
+
+	return result;
 }
 
 /*
- * check if the tree is empty
+ * check that the header describes a file this tree can read
+ * 	and that every section is inside of the file
+ * the nodes and entries themselves are not checked
  */
-bool ph2_empty (ph2_t* tree)
+static bool map_header_valid (map_header_t* header, size_t size)
 {
-	return (tree->root.node.child_count == 0);
+	if (size < sizeof (*header)
+		|| memcmp (header->magic, MAP_MAGIC, sizeof (header->magic))
+		|| header->version != MAP_VERSION
+		|| header->dimensions != DIMENSIONS
+		|| header->bit_width != PHTREE_BIT_WIDTH
+		|| header->depth != PHTREE_DEPTH
+		|| header->node_size != sizeof (map_node_t)
+		|| header->entry_size != sizeof (map_entry_t)
+		|| header->node_count == 0)
+	{
+		return false;
+	}
+
+	// sizes are checked by dividing so they can not overflow
+	if (header->nodes_offset > size || header->node_count > (size - header->nodes_offset) / sizeof (map_node_t)
+		|| header->entries_offset > size || header->entry_count > (size - header->entries_offset) / sizeof (map_entry_t)
+		|| header->elements_offset > size || header->elements_size > size - header->elements_offset)
+	{
+		return false;
+	}
+
+	return true;
 }
 
-/*
- * run a window query on a specific node
- */
-static void node_query_window (ph2_dual_node_t* dual, ph2_query_t* query, void* data)
+ph2_map_t* ph2_map (const char* path)
 {
-	if (!node_in_window (dual, query))
+	if (!path)
 	{
-		return;
+		return NULL;
 	}
 
-	/*
-	 * these masks are used to accelerate queries
-	 * 	when iterating children
-	 * 		we can do a broad check if a child node overlaps the query window at all
-	 * 		without needing to go to the child node and performing node_in_window
-	 * 		
-	 * 	if the child node does not overlap the query window
-	 * 		we save a memory jump to that node
-	 */
-	phtree_key_t mask_lower = 0;
-	phtree_key_t mask_upper = 0;
+	ph2_map_t* map = phtree_calloc (1, sizeof (*map));
 
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	if (!map)
 	{
-		/*
-		 * for these >= to work properly
-		 * 	dual->node.point has to be set to the mid point of the node
-		 * 	we set dual->node.point to the mid point, during node creation
-		 * 		so we dont have to calculate it here
-		 */
-		mask_lower <<= 1;
-		mask_lower |= query->min.values[dimension] >= dual->node.point.values[dimension];
-
-		mask_upper <<= 1;
-		mask_upper |= query->max.values[dimension] >= dual->node.point.values[dimension];
+		return NULL;
 	}
 
-	if (phtree_node_is_leaf (dual))
+#if PHTREE_MAP_MMAP
+	int descriptor = open (path, O_RDONLY);
+	struct stat status;
+
+	if (descriptor < 0 || fstat (descriptor, &status) || status.st_size <= 0)
 	{
-		for (int iter = 0; iter < NODE_CHILD_MAX; iter++)
+		if (descriptor >= 0)
 		{
-			if (child_active (dual, iter) && ((iter | mask_lower) & mask_upper) == iter)
-			{
-				ph2_dual_node_t* child = &dual->node.children[child_index (dual, iter)];
-
-				if (entry_in_window (child, query))
-				{
-					query->function (child->entry.element, data);
-				}
-			}
+			close (descriptor);
 		}
 
-		return;
+		phtree_free (map);
+		return NULL;
 	}
 
-	// if the node _is_ in the window and _is not_ a leaf
-	// 	recurse through the node's children
-	for (unsigned int iter = 0; iter < NODE_CHILD_MAX; iter++)
+	map->size = status.st_size;
+	map->memory = mmap (NULL, map->size, PROT_READ, MAP_SHARED, descriptor, 0);
+	map->mapped = true;
+	// the mapping stays valid after the descriptor is closed
+	close (descriptor);
+
+	if (map->memory == MAP_FAILED)
 	{
-		if (child_active (dual, iter) && ((iter | mask_lower) & mask_upper) == iter)
-		{
-			node_query_window (&dual->node.children[child_index (dual, iter)], query, data);
-		}
+		phtree_free (map);
+		return NULL;
 	}
-}
+#else
+	// without mmap the file is read in to memory as is
+	// 	it is still used without any conversion
+	FILE* file = fopen (path, "rb");
+	long size = -1;
 
-/*
- * run a window query on a tree
- */
-void ph2_query (ph2_t* tree, ph2_query_t* query, void* data)
-{
-	if (!tree || !query || !query->function)
+	if (file && !fseek (file, 0, SEEK_END))
 	{
-		return;
+		size = ftell (file);
 	}
 
-	for (int iter = 0; iter < tree->root.node.child_count; iter++)
+	if (size > 0 && !fseek (file, 0, SEEK_SET))
 	{
-		node_query_window (&tree->root.node.children[iter], query, data);
+		map->size = size;
+		map->memory = phtree_aligned_calloc (1, map->size, MAP_ELEMENT_ALIGNMENT);
 	}
-}
-
-/*
- * query_set_internal does not need to convert external values in to internal points/keys
- * so it needs to be its own function
- */
-static void query_set_internal (ph2_t* tree, ph2_query_t* query, ph2_point_t* min, ph2_point_t* max, phtree_iteration_function_t function)
-{
-	ph2_query_clear (query);
 
-	query->min = *min;
-	query->max = *max;
-
-	// make sure min and max are properly populated
-	// 	all minimum values in min
-	// 	all maximum values in max
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	if (!map->memory || fread (map->memory, 1, map->size, file) != map->size)
 	{
-		if (query->max.values[dimension] < query->min.values[dimension])
+		if (file)
 		{
-			phtree_key_t temp = query->min.values[dimension];
-			query->min.values[dimension] = query->max.values[dimension];
-			query->max.values[dimension] = temp;
+			fclose (file);
 		}
+
+		phtree_aligned_free (map->memory);
+		phtree_free (map);
+		return NULL;
 	}
 
-	query->function = function;
-}
+	fclose (file);
+#endif
 
-void ph2_query_set (ph2_t* tree, ph2_query_t* query, void* min_in, void* max_in, phtree_iteration_function_t function)
-{
-	if (!query)
+	map->header = (map_header_t*) map->memory;
+
+	if (!map_header_valid (map->header, map->size))
 	{
-		return;
+		ph2_unmap (map);
+		return NULL;
 	}
 
-	ph2_point_t min = {0};
-	ph2_point_t max = {0};
-
-	tree->convert_to_point (tree, &min, min_in);
-	tree->convert_to_point (tree, &max, max_in);
+	map->nodes = (map_node_t*) (map->memory + map->header->nodes_offset);
+	map->entries = (map_entry_t*) (map->memory + map->header->entries_offset);
+	map->elements = map->memory + map->header->elements_offset;
 
-	query_set_internal (tree, query, &min, &max, function);
+	return map;
 }
 
-void ph2_query_box_set (ph2_t* tree, ph2_query_t* query, bool intersect, void* min_in, void* max_in, phtree_iteration_function_t function)
+void ph2_unmap (ph2_map_t* map)
 {
-	if (!query)
+	if (!map)
 	{
 		return;
 	}
 
-	ph2_point_t min = {0};
-	ph2_point_t max = {0};
+#if PHTREE_MAP_MMAP
+	munmap (map->memory, map->size);
+#else
+	phtree_aligned_free (map->memory);
+#endif
 
-	if (!tree->convert_to_box_point)
-	{
-		query->min = min;
-		query->max = max;
-		query->function = function;
+	phtree_free (map);
+}
 
-		return;
-	}
+size_t ph2_map_count (ph2_map_t* map)
+{
+	return map ? map->header->entry_count : 0;
+}
 
-	tree->convert_to_box_point (tree, &min, min_in);
-	tree->convert_to_box_point (tree, &max, max_in);
+static void* map_entry_element (ph2_map_t* map, map_entry_t* entry)
+{
+	return entry->element_size ? map->elements + entry->element_offset : NULL;
+}
 
-	if (intersect)
+/*
+ * the mapped versions of node_in_window and node_window_children
+ */
+static bool map_node_in_window (map_node_t* node, ph2_query_t* window)
+{
+	return (prefix_greater_equal (&node->point, &window->min, node->postfix_length) && prefix_less_equal (&node->point, &window->max, node->postfix_length));
+}
+
+static uint64_t map_node_window_children (map_node_t* node, ph2_query_t* query)
+{
+	uint64_t children = CHILD_MASK_ALL;
+
+	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
 	{
-		for (int iter = 0; iter < DIMENSIONS / 2; iter++)
+		int bit = DIMENSIONS - 1 - dimension;
+
+		if (query->min.values[dimension] >= node->point.values[dimension])
 		{
-			min.values[iter] = 0;
+			children &= address_bit_sets[bit];
 		}
 
-		for (int iter = DIMENSIONS / 2; iter < DIMENSIONS; iter++)
+		if (query->max.values[dimension] < node->point.values[dimension])
 		{
-			max.values[iter] = PHTREE_KEY_MAX;
+			children &= ~address_bit_sets[bit];
 		}
 	}
 
-	query_set_internal (tree, query, &min, &max, function);
-}
-
-void ph2_query_box_point_set (ph2_t* tree, ph2_query_t* query, void* point, phtree_iteration_function_t function)
-{
-	ph2_query_box_set (tree, query, true, point, point, function);
+	return children;
 }
 
-/*
- * create a new window query
- */
-ph2_query_t* ph2_query_create ()
+static void map_node_query (ph2_map_t* map, map_node_t* node, ph2_query_t* query, void* data)
 {
-	ph2_query_t* new_query = phtree_calloc (1, sizeof (*new_query));
+	uint64_t window_children = map_node_window_children (node, query);
+	uint64_t remaining = node->active_children;
+	uint64_t index = node->children;
 
-	if (!new_query)
+	while (remaining & window_children)
 	{
-		return NULL;
-	}
+		if ((window_children >> count_trailing_zeroes (remaining)) & 1)
+		{
+			if (node->postfix_length == 0)
+			{
+				map_entry_t* entry = &map->entries[index];
 
-	return new_query;
-}
+				if (point_greater_equal (&entry->point, &query->min) && point_less_equal (&entry->point, &query->max))
+				{
+					query->function (map_entry_element (map, entry), data);
+				}
+			}
+			else if (map_node_in_window (&map->nodes[index], query))
+			{
+				// worst case our stack is PHTREE_DEPTH deep
+				map_node_query (map, &map->nodes[index], query, data);
+			}
+		}
 
-void ph2_query_free (ph2_query_t* query)
-{
-	phtree_free (query);
+		remaining &= remaining - 1;
+		index++;
+	}
 }
 
-/*
- * clear a window query
- */
-void ph2_query_clear (ph2_query_t* query)
+void ph2_map_query (ph2_map_t* map, ph2_query_t* query, void* data)
 {
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	if (!map || !query || !query->function)
 	{
-		query->min.values[dimension] = 0;
-		query->max.values[dimension] = 0;
+		return;
 	}
 
-	query->function = NULL;
+	map_node_query (map, &map->nodes[0], query, data);
 }
 
-void ph2_query_center (ph2_query_t* query, ph2_point_t* out)
+void* ph2_map_find (ph2_map_t* map, ph2_point_t* point)
 {
-	for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+	if (!map || !point)
+	{
+		return NULL;
+	}
+
+	map_node_t* node = &map->nodes[0];
+
+	while (true)
 	{
-		out->values[dimension] = (query->max.values[dimension] - query->min.values[dimension]) / 2;
+		hypercube_address_t address = 0;
+
+		// same as calculate_hypercube_address
+		for (int dimension = 0; dimension < DIMENSIONS; dimension++)
+		{
+			address = (address << 1) | ((point->values[dimension] >> node->postfix_length) & 1);
+		}
+
+		if (!child_active (node, address))
+		{
+			return NULL;
+		}
+
+		uint64_t index = node->children + child_index (node, address);
+
+		if (node->postfix_length == 0)
+		{
+			map_entry_t* entry = &map->entries[index];
+
+			return point_equal (&entry->point, point) ? map_entry_element (map, entry) : NULL;
+		}
+
+		node = &map->nodes[index];
+
+		if (!prefix_equal (point, &node->point, node->postfix_length))
+		{
+			return NULL;
+		}
 	}
 }
 
@@ -970,14 +6345,25 @@ void ph2_point_box_set (ph2_t* tree, ph2_point_t* point, void* a)
 {
 	point->values[0] = tree->convert_to_key (a);
 
-	// this could be cleaner
-	// 	but we're doing it this way to work with the current template generation system
+	// phtree_generate.py rewrites this function for the other dimensions
 	point->values[DIMENSIONS / 2] = point->values[0];
 }
 
 #undef child_index
 #undef child_active
+#undef child_flag
+#undef CHILD_MASK_ALL
+#undef CONCURRENT_SPINS
+#undef PARALLEL_SPLIT_LEVELS
+#undef PARALLEL_TASKS_PER_THREAD
+#undef RADIX_LEVELS
+#undef RADIX_BUCKETS
+#undef RADIX_SPREAD
+#undef tree_calloc
+#undef tree_realloc
+#undef tree_free
+#undef tree_aligned_calloc
+#undef tree_aligned_free
 
 #undef DIMENSIONS
 #undef NODE_CHILD_MAX
-#undef CHILD_SHIFT
@@ -2,26 +2,119 @@
 #define _ph2_h_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #include "phtree32_common.h"
 
+// the parallel functions take a pool from phtree_thread_pool.h
+// 	include that where you create pools
+typedef struct phtree_thread_pool_t phtree_thread_pool_t;
+
+// you can safely change this to any number <= PHTREE_BIT_WIDTH and >= 2
+// keys will still be PHTREE_BIT_WIDTH bits in size but the tree will only have a depth of PHTREE_DEPTH
+#ifndef PHTREE_DEPTH
+#define PHTREE_DEPTH PHTREE_BIT_WIDTH
+#endif
+
+// the number of dimensions of a ph2 point
+#define PH2_DIMENSIONS 2
+
 /*
  * an index point in the tree
  */
 typedef struct ph2_point_t
 {
-	phtree_key_t values[2];
+	phtree_key_t values[PH2_DIMENSIONS];
 } ph2_point_t;
 
-typedef union ph2_dual_node_t ph2_dual_node_t;
-typedef struct ph2_node_t
+/*
+ * inner nodes are padded and aligned to PHTREE_NODE_ALIGNMENT bytes
+ * 	so a node never straddles two cache lines
+ * 	must be a power of 2 and at least as large as the natural alignment of ph2_node_t
+ */
+#ifndef PHTREE_NODE_ALIGNMENT
+#define PHTREE_NODE_ALIGNMENT 32
+#endif
+
+/*
+ * set to 1 to keep a count of the entries below every inner node
+ * 	ph2_query_count can then count whole subtrees which are inside of the window
+ * 		without visiting their entries
+ * 	inserts and removes have to update the count of every node on their path
+ * the count makes some nodes bigger (4d nodes go from 32 to 64 bytes)
+ * 	so it is off by default
+ * must be the same everywhere the tree is compiled
+ */
+#ifndef PHTREE_ENTRY_COUNTS
+#define PHTREE_ENTRY_COUNTS 0
+#endif
+
+/*
+ * set to 1 to count what tree operations are doing
+ * 	queries count in to their ph2_query_t, changes to the tree count in to the ph2_t
+ * 	see ph2_stats_t
+ * with it off none of the counting is compiled in
+ * must be the same everywhere the tree is compiled
+ */
+#ifndef PHTREE_STATS
+#define PHTREE_STATS 0
+#endif
+
+/*
+ * a set of child hypercube addresses
+ * 	one bit for each of the 2^PH2_DIMENSIONS children a node can have
+ */
+#if PH2_DIMENSIONS <= 3
+typedef uint8_t ph2_child_set_t;
+#elif PH2_DIMENSIONS == 4
+typedef uint16_t ph2_child_set_t;
+#elif PH2_DIMENSIONS == 5
+typedef uint32_t ph2_child_set_t;
+#elif PH2_DIMENSIONS == 6
+typedef uint64_t ph2_child_set_t;
+#else
+#error "the child sets only support up to 6 dimensions"
+#endif
+
+typedef struct ph2_entry_t
 {
+	ph2_point_t point;
+	void* element;
+} ph2_entry_t;
+
+typedef struct ph2_node_t ph2_node_t;
+struct ph2_node_t
+{
+	/*
+	 * the fields looked at during every step of a traversal come first
+	 * 	so they share a cache line with each other
+	 * 		even in layouts where the whole node does not fit in one
+	 */
+	// bit flags for which children are active
+	// 	bit n is set when the child at hypercube address n is active
+	_Alignas (PHTREE_NODE_ALIGNMENT) ph2_child_set_t active_children;
+	// counts how many nodes/layers are below this node
+	// 	nodes with a postfix_length of 0 are leaves
+	int8_t postfix_length;
 	/*
-	 * this node layout combined with memory alignment will be less than 64 bytes in size
-	 * 	for all combinations of supported dimensions and bit widths EXCEPT 64 bit, 6 dimensions
-	 * 		64 bit, 6 dimensions will be 72 bytes
+	 * the distance between a node and its parent, not inclusive
+	 * example: 
+	 * 	if parent->postfix_length == 5
+	 * 	and child->postfix_length == 1
+	 * 	then  child->infix_length == 3  // not 4
 	 */
+	int8_t infix_length;
+	// how many active (not NULL) children a node has
+	int8_t child_count;
+	// curent capacity of the children array
+	int8_t child_capacity;
+#if PHTREE_ENTRY_COUNTS
+	// how many entries are anywhere below this node
+	// 	only inner nodes use this, the entry count of a leaf is its child_count
+	uint32_t entry_count;
+#endif
+
 	/*
 	 * only the bits of this point _before_ postfix_length + 1 are relevant
 	 * 	the bits at postfix_length are the children of this node
@@ -34,48 +127,85 @@ typedef struct ph2_node_t
 	 */
 	ph2_point_t point;
 	/*
-	 * a child can be either a node or an element
 	 * children is an ordered dynamic array
+	 * 	the children of inner nodes are nodes
+	 * 	the children of leaves are entries
+	 * 		entries are smaller than nodes, so leaves are packed tighter
 	 */
-	ph2_dual_node_t* children;
-	// bit flags for which children are active
-	uint8_t active_children;
-	// curent capacity of the children array
-	int8_t child_capacity;
-	// how many active (not NULL) children a node has
-	int8_t child_count;
+	union
+	{
+		ph2_node_t* nodes;
+		ph2_entry_t* entries;
+		// for code which handles both kinds of children the same way
+		void* memory;
+	} children;
+};
 
+/*
+ * counters kept with PHTREE_STATS
+ * 	counters which do not apply to an operation stay 0
+ */
+typedef struct ph2_stats_t
+{
 	/*
-	 * the distance between a node and its parent, not inclusive
-	 * example: 
-	 * 	if parent->postfix_length == 5
-	 * 	and child->postfix_length == 1
-	 * 	then  child->infix_length == 3  // not 4
+	 * queries
 	 */
-	int8_t infix_length;
-	// counts how many nodes/layers are below this node
-	int8_t postfix_length;
-} ph2_node_t;
+	// nodes walked in to, leaves included
+	size_t nodes_visited;
+	// entries which passed the child address mask and were compared against the window
+	size_t entries_tested;
+	// entries inside of the window
+	// 	entries_tested - hits is the number which passed the mask but were outside of the window
+	size_t hits;
+	/*
+	 * changes to the tree
+	 */
+	// new nodes inserted between a node and its child
+	size_t splits;
+	// children arrays moved to a bigger or smaller allocation
+	size_t reallocs;
+	// bytes moved to open or close a gap in a children array
+	size_t memmove_bytes;
+	/*
+	 * both
+	 * 	the deepest node reached, the root's children are at depth 1
+	 * 	parallel queries count depth from the nodes their tasks start at
+	 */
+	int max_depth;
+} ph2_stats_t;
+
+/*
+ * where a tree gets its memory from
+ * 	see phtree_allocator_t in phtree32_common.h
+ */
+typedef phtree_allocator_t ph2_allocator_t;
 
-typedef struct
+/*
+ * how children arrays are resized as children are added and removed
+ * 	see ph2_options_t.growth
+ */
+typedef enum
 {
-	ph2_point_t point;
-	void* element;
-} ph2_entry_t;
+	// grow by 4 slots when full, never shrink
+	PH2_GROWTH_FIXED,
+	// always exactly as many slots as children
+	PH2_GROWTH_EXACT,
+	// double when full, halve once a quarter or less of the slots are used
+	PH2_GROWTH_DOUBLE,
+	// whatever ph2_options_t.growth_function returns
+	PH2_GROWTH_CUSTOM,
+} ph2_growth_t;
 
 /*
- * children of a node can be either nodes or elements
- * we use this union so that we're always allocating enough space for the larger
- * 	(nodes should always be larger but lets be safe for the future)
+ * returns the capacity a children array of capacity slots should have for count children
+ * 	run with count == capacity + 1 when a child is added to a full node
+ * 	and after a child is removed, with the count left in the node
+ * 		return capacity to leave the array as it is
  *
- * we trade the ugliness of managing casts for the ugliness of specifying node or entry
- * hopefully this keeps it clear that we are dealing with ambiguous node objects
+ * the result is raised to count and lowered to the most children a node can have
+ * 	pooled arrays are also rounded up to a multiple of 4
  */
-typedef union ph2_dual_node_t
-{
-	ph2_node_t node;
-	ph2_entry_t entry;
-} ph2_dual_node_t;
+typedef int (*ph2_growth_function_t) (int count, int capacity, void* data);
 
 /*
  * the tree type
@@ -83,7 +213,7 @@ typedef union ph2_dual_node_t
 typedef struct ph2_t ph2_t;
 typedef struct ph2_t
 {
-	ph2_dual_node_t root;
+	ph2_node_t root;
 
 	/*
 	 * user defined functions for handling user defined elements
@@ -119,8 +249,129 @@ typedef struct ph2_t
 	 * see ph2_query_box_set in the header file for more information
 	 */
 	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* point_out, void* input);
+
+	/*
+	 * children arrays are allocated from these pools when ph2_options_t.pool_children is set
+	 * 	node_pool holds the children of inner nodes, entry_pool holds the children of leaves
+	 * 	block_size is 0 when the pools are not being used
+	 */
+	phtree_pool_t node_pool;
+	phtree_pool_t entry_pool;
+
+	/*
+	 * elements live in element_pool when ph2_options_t.element_size is set
+	 * 	element_initialize then takes the place of element_create
+	 * 	block_size is 0 when elements come from element_create
+	 */
+	phtree_pool_t element_pool;
+	void (*element_initialize) (void* element, void* input);
+
+	/*
+	 * state for concurrent readers when ph2_options_t.concurrent is set
+	 * 	NULL when the tree is not in concurrent mode
+	 * in concurrent mode the root readers use lives in here instead of in root
+	 */
+	struct ph2_concurrent_t* concurrent;
+
+	/*
+	 * every node, children array, query, and scratch buffer of the tree comes from allocator
+	 * 	elements are still up to element_create and element_destroy
+	 */
+	ph2_allocator_t allocator;
+
+	// from ph2_options_t.growth, growth_function, and growth_data
+	ph2_growth_t growth;
+	ph2_growth_function_t growth_function;
+	void* growth_data;
+
+	// changes every time the tree is changed
+	// 	so cursors know when their path is out of date
+	uint64_t version;
+
+#if PHTREE_STATS
+	// counted by inserts and removes
+	ph2_stats_t stats;
+#endif
 } ph2_t;
 
+/*
+ * optional settings for a tree
+ * 	use ph2_options_default to fill in the defaults
+ * 	then change whatever you need
+ * passing NULL as the options to ph2_create/ph2_initialize uses the defaults
+ */
+typedef struct ph2_options_t
+{
+	/*
+	 * allocate node children arrays from tree owned memory pools
+	 * 	instead of going to the allocator for every node
+	 * the pools have size classes for 4, 8, 12, and 16 child arrays
+	 * 	bigger arrays still go to the allocator
+	 *
+	 * default: true
+	 */
+	bool pool_children;
+	/*
+	 * size in bytes of each slab the pool allocates
+	 * 	0 uses PHTREE_POOL_SLAB_SIZE
+	 *
+	 * default: 0
+	 */
+	size_t pool_slab_size;
+	/*
+	 * let any number of threads read the tree while a single thread writes to it
+	 * 	ph2_query, ph2_find, ph2_for_each, ph2_knn, and ph2_empty are safe to run
+	 * 		while ph2_insert, ph2_remove, ph2_bulk_load, or ph2_clear run on another thread
+	 * 	readers never take a lock and never wait for the writer
+	 * 	only one thread may write at a time
+	 * 	ph2_free and ph2_release must not run while anything else is using the tree
+	 *
+	 * inserts and removes copy the children arrays along the path they change
+	 * 	and memory readers could still be using is freed later
+	 * 		so writes are slower and use more memory than without concurrent mode
+	 * elements are destroyed once no reader can see them anymore
+	 * 	not during ph2_remove
+	 *
+	 * default: false
+	 */
+	bool concurrent;
+	/*
+	 * copied in to the tree
+	 * 	the functions and context have to stay valid until the tree is freed
+	 * NULL uses phtree_calloc/phtree_realloc/phtree_free
+	 *
+	 * default: NULL
+	 */
+	ph2_allocator_t* allocator;
+	/*
+	 * keep elements of element_size bytes in a tree owned pool
+	 * 	instead of one allocation from element_create for every element
+	 * new elements are zeroed and then element_initialize (element, input) is run on them
+	 * 	element_initialize can be NULL to leave them zeroed
+	 * 	element_create is not used and can be NULL
+	 * element_destroy should only free what is inside of the element
+	 * 	the tree gives the memory of the element back to the pool itself
+	 *
+	 * elements keep their address until their point is removed
+	 * 	the same as elements from element_create
+	 *
+	 * default: 0 (elements come from element_create)
+	 */
+	size_t element_size;
+	void (*element_initialize) (void* element, void* input);
+	/*
+	 * how children arrays are resized when children are added and removed
+	 * 	PH2_GROWTH_CUSTOM runs growth_function, with growth_data as its data
+	 * 2d nodes have at most 4 children, which is one pooled array
+	 * 	so with pool_children this only makes a difference with more dimensions
+	 *
+	 * default: PH2_GROWTH_FIXED
+	 */
+	ph2_growth_t growth;
+	ph2_growth_function_t growth_function;
+	void* growth_data;
+} ph2_options_t;
+
 typedef struct ph2_query_t
 {
 	ph2_point_t min;
@@ -132,8 +383,105 @@ typedef struct ph2_query_t
 	 * 		and add the elements to the collection inside of your function
 	 */
 	phtree_iteration_function_t function;
+	/*
+	 * set by ph2_query_box_set when it looks for intersecting boxes
+	 * 	every dimension of the window then has only one bound which matters
+	 * 		so the query is run by a walk which only checks those bounds
+	 */
+	bool box_intersect;
+
+#if PHTREE_STATS
+	// counted by every run of the query until it is set again
+	ph2_stats_t stats;
+#endif
 } ph2_query_t;
 
+/*
+ * distance between two points in the tree
+ * 	used by nearest neighbor queries
+ *
+ * the distance has to grow as the difference in any single dimension grows
+ * 	(euclidean, manhattan, chebyshev, etc. are all fine)
+ * 	because nodes are skipped using the distance to the closest point inside of them
+ */
+typedef double (*ph2_distance_function_t) (ph2_point_t* point_a, ph2_point_t* point_b);
+
+/*
+ * run on pairs of elements found by ph2_box_pairs
+ */
+typedef void (*ph2_pair_function_t) (void* element_a, void* element_b, void* data);
+
+/*
+ * walks the results of a window query one entry at a time
+ * 	instead of running query->function on every result
+ *
+ * the tree can not be changed while an iterator is in use
+ */
+typedef struct ph2_query_iterator_t
+{
+	ph2_query_t* query;
+	// how many frames of the stack are in use
+	int depth;
+	/*
+	 * one frame for every node between the root and the current node
+	 * 	the tree is at most PHTREE_DEPTH nodes deep
+	 */
+	struct ph2_query_iterator_frame_t
+	{
+		ph2_node_t* node;
+		// active children which have not been checked yet
+		// 	in a leaf, the entries in the window which have not been returned yet
+		uint64_t remaining;
+		// children which overlap the query window
+		// 	in a leaf, the same as remaining
+		uint64_t window_children;
+		// the index in node->children of the lowest child in remaining
+		int index;
+	} stack[PHTREE_DEPTH];
+} ph2_query_iterator_t;
+
+/*
+ * remembers the path to the last point it was used on
+ * 	the next find or insert starts from the deepest node on the path which the new point is under
+ * 		so points close to the last one skip most of the walk down from the root
+ * 	any change to the tree, except inserts through the cursor itself, makes it start from the root again
+ *
+ * a cursor is used by one thread at a time
+ * in concurrent mode cursors do the same as ph2_find and ph2_insert
+ */
+typedef struct ph2_cursor_t
+{
+	ph2_t* tree;
+	// tree->version when the path was found
+	uint64_t version;
+	// how many nodes of stack are in use, stack[0] is the root
+	int depth;
+	ph2_node_t* stack[PHTREE_DEPTH];
+} ph2_cursor_t;
+
+/*
+ * one change in a ph2_apply_batch
+ */
+typedef enum
+{
+	PH2_BATCH_INSERT,
+	PH2_BATCH_REMOVE,
+} ph2_batch_type_t;
+
+typedef struct ph2_batch_op_t
+{
+	ph2_batch_type_t type;
+	// the same input ph2_insert and ph2_remove take
+	void* index;
+	/*
+	 * set by ph2_apply_batch
+	 * 	inserts get the element at the point, the same as ph2_insert returns
+	 * 	removes get NULL
+	 * an element is not valid any more if a later op in the batch removed its point
+	 */
+	void* element;
+} ph2_batch_op_t;
+
 
 /*
  * allocate and initialize a new tree
@@ -152,6 +500,9 @@ typedef struct ph2_query_t
  *
  * 	return a pointer to the object you allocated
  *
+ * 	can be NULL when ph2_options_t.element_size is set
+ * 		elements are then made by ph2_options_t.element_initialize instead
+ *
  * void element_destory (void* element)
  * 	deallocates/frees whatever was allocated by element_create
  *
@@ -171,30 +522,53 @@ typedef struct ph2_query_t
  * void convert_to_box_point (ph2_t* tree, ph2_point_t* out, void* input)
  * 	convert input in to special points used for box queries
  * 	!! make sure to use ph2_point_box_set and not the regular ph2_point_set !!
+ *
+ * options can be NULL to use the default options
  */
 ph2_t* ph2_create (
 	void* (*element_create) (void* input),
 	void (*element_destroy) (void* element),
 	phtree_key_t (*convert_to_key) (void* input),
 	void (*convert_to_point) (ph2_t* tree, ph2_point_t* out, void* input),
-	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input));
+	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	ph2_options_t* options);
 
+/*
+ * returns 0 on success
+ */
 int ph2_initialize (
 	ph2_t* tree,
 	void* (*element_create) (void* input),
 	void (*element_destroy) (void*),
 	phtree_key_t (*convert_to_key) (void* input),
 	void (*convert_to_point) (ph2_t* tree, ph2_point_t* out, void* input),
-	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input));
+	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	ph2_options_t* options);
+
+/*
+ * fill options with the default options
+ */
+void ph2_options_default (ph2_options_t* options);
 
 /*
  * clear all entries/elements from the tree
+ * 	the tree can still be used after being cleared
+ *
+ * if the tree uses pools and has no element_destroy function
+ * 	the nodes are dropped all at once without walking the tree
+ *
+ * in concurrent mode nothing is cleared if there is no memory for the root readers see in the meantime
  */
 void ph2_clear (ph2_t* tree);
 /*
- * free a tree
+ * free a tree created by ph2_create
  */
 void ph2_free (ph2_t* tree);
+/*
+ * free everything inside of a tree set up with ph2_initialize
+ * 	but not the tree itself
+ */
+void ph2_release (ph2_t* tree);
 
 /*
  * run function on every element in the tree
@@ -209,8 +583,29 @@ void ph2_for_each (ph2_t* tree, phtree_iteration_function_t function, void* data
  * 	the existing element will be returned
  *
  * index is whatever you are using to determine the spatial index of what you are inserting
+ *
+ * returns NULL if there was no memory for the new entry, the tree is not changed
  */
 void* ph2_insert (ph2_t* tree, void* index);
+/*
+ * insert many elements at once
+ * 	inputs is an array of count indexes, the same as you would pass to ph2_insert
+ *
+ * when the tree is empty
+ * 	the inputs are sorted by their z-order and the tree is built bottom up
+ * 		every children array is allocated once at its final size
+ * when the tree is not empty
+ * 	the inputs are inserted one at a time
+ *
+ * if multiple inputs are at the same point
+ * 	the first one creates the element, same as ph2_insert
+ *
+ * returns 0 on success
+ * 	1 if memory ran out
+ * 		when the tree was being built bottom up it is left empty
+ * 		otherwise every input which could be inserted is in the tree
+ */
+int ph2_bulk_load (ph2_t* tree, void** inputs, size_t count);
 /*
  * find an element in the tree at index
  *
@@ -220,14 +615,58 @@ void* ph2_insert (ph2_t* tree, void* index);
 void* ph2_find (ph2_t* tree, void* index);
 /*
  * remove an element from the tree
+ * 	in concurrent mode nothing is removed if there is no memory to copy the path to it
  */
 void ph2_remove (ph2_t* tree, void* index);
+/*
+ * move the element at old_index to new_index
+ * 	only the part of the tree below where the two paths meet is changed
+ * 	the element itself is kept, element_create and element_destroy are not called
+ * 		so pointers to the element stay valid
+ *
+ * returns 0 on success
+ * 	1 if there is no element at old_index or there already is one at new_index, nothing is changed
+ * 	1 if there was no memory for the new path, the element is put back at old_index
+ * 		if that fails too the element is destroyed
+ */
+int ph2_relocate (ph2_t* tree, void* old_index, void* new_index);
 /*
  * check if the tree is empty
  *
  * returns true if the tree is empty
  */
 bool ph2_empty (ph2_t* tree);
+/*
+ * shrink every children array to the fewest slots its children fit in
+ * 	whatever the growth policy of the tree is
+ * in concurrent mode every children array is copied
+ * 	the old ones are freed once readers are done with them
+ *
+ * returns 0 on success
+ * 	1 if memory ran out, the arrays compacted before that stay compacted
+ */
+int ph2_compact (ph2_t* tree);
+
+/*
+ * mark the start and end of a read section in concurrent mode
+ * 	nothing seen inside a read section is freed until the read section ends
+ * 	ph2_read_begin returns a token to pass to ph2_read_end
+ *
+ * ph2_query, ph2_find, ph2_for_each, ph2_knn, and ph2_empty already do this internally
+ * 	but anything they hand back (entries, elements) is only safe to use inside a read section
+ * query iterators dont, so iterate inside a read section
+ * 	example:
+ * 		int token = ph2_read_begin (tree);
+ * 		ph2_query_iterator_initialize (tree, &query, &iterator);
+ * 		// ...
+ * 		ph2_read_end (tree, token);
+ *
+ * these do nothing outside of concurrent mode
+ * read sections can be nested
+ * the writer never needs one, and must not hold one while calling ph2_clear
+ */
+int ph2_read_begin (ph2_t* tree);
+void ph2_read_end (ph2_t* tree, int token);
 
 /*
  * run a query on the tree
@@ -240,12 +679,175 @@ bool ph2_empty (ph2_t* tree);
  * 			and store the elements in the collection inside your iteration function
  */
 void ph2_query (ph2_t* tree, ph2_query_t* query, void* data);
+/*
+ * count the elements inside of the query window
+ * 	query->function is not used and can be NULL
+ *
+ * nodes which are entirely inside of the window are counted without visiting their entries
+ * 	with PHTREE_ENTRY_COUNTS this works for whole subtrees
+ * 		so counting a large window only visits the nodes along its boundary
+ * 	without it only leaves are counted this way
+ */
+size_t ph2_query_count (ph2_t* tree, ph2_query_t* query);
+/*
+ * report what changed between two query windows
+ * 	on_enter runs on every element inside of new_query but not old_query
+ * 	on_exit runs on every element inside of old_query but not new_query
+ * 	either can be NULL, the queries' own functions are not used
+ *
+ * only the parts of the tree along the edges of the windows are walked
+ * 	so moving a window a little costs a fraction of a full query
+ * elements inside of both windows are not visited
+ * 	old_query should describe the previous window of the same tree
+ * 		changes to the tree in between are only reported if they are inside the difference
+ */
+void ph2_query_delta (ph2_t* tree, ph2_query_t* old_query, ph2_query_t* new_query, phtree_iteration_function_t on_enter, phtree_iteration_function_t on_exit, void* data);
+/*
+ * run count queries on the tree in a single walk
+ * 	queries is an array of count queries
+ * 	data is an array of count pointers, data[n] is passed to queries[n].function
+ * 		data can be NULL to pass NULL to every query function
+ *
+ * the queries are sorted by the z-order of their centers
+ * 	then every node is visited once with all of the queries which overlap it
+ * 		so the upper levels of the tree are only walked once for the whole batch
+ * 	queries with no function are skipped
+ * elements are not visited in the same order as ph2_query would visit them
+ *
+ * returns 0 on success
+ * returns 1 if memory ran out part way through the walk
+ * 	in which case some elements in some windows were not visited
+ */
+int ph2_query_batch (ph2_t* tree, ph2_query_t* queries, size_t count, void** data);
+/*
+ * run a query on the tree using the workers in pool
+ *
+ * the top few levels of the tree are split into tasks
+ * 	which the workers share by work stealing
+ * per_thread_data needs one pointer for every worker in pool (pool->thread_count)
+ * 	the query's iteration function gets per_thread_data[worker] as its data
+ * 		where worker is the worker running it
+ * 	so each worker can collect results without atomics or locks
+ * elements are visited in no particular order
+ *
+ * this waits for every task in pool to finish before returning
+ * 	so it should not be called from inside a pool task
+ */
+void ph2_query_parallel (ph2_t* tree, ph2_query_t* query, phtree_thread_pool_t* pool, void** per_thread_data);
+
+/*
+ * set up iterator to walk the results of query
+ * 	query->function is not used by iterators and can be NULL
+ * 	query must stay valid while the iterator is in use
+ *
+ * example:
+ * 	ph2_query_iterator_t iterator;
+ * 	ph2_query_iterator_initialize (tree, &query, &iterator);
+ *
+ * 	for (ph2_entry_t* entry = ph2_query_iterator_next (&iterator); entry; entry = ph2_query_iterator_next (&iterator))
+ * 	{
+ * 		// do something with entry->element
+ * 	}
+ */
+void ph2_query_iterator_initialize (ph2_t* tree, ph2_query_t* query, ph2_query_iterator_t* iterator);
+/*
+ * returns the next entry inside of the query window
+ * returns NULL when there are no more entries
+ */
+ph2_entry_t* ph2_query_iterator_next (ph2_query_iterator_t* iterator);
+/*
+ * write the next results of iterator in to out
+ * 	without running a function on every result or growing a collection
+ * 	out has room for capacity entries, count is set to the number written
+ *
+ * returns 0 when every result has been written
+ * returns 1 when out filled up first
+ * 	call again with the same iterator to continue where it stopped
+ * 	there may turn out to be no more results
+ */
+int ph2_query_iterator_collect (ph2_query_iterator_t* iterator, ph2_entry_t** out, size_t capacity, size_t* count);
+/*
+ * start query and collect its first results in to out
+ * 	the same as ph2_query_iterator_initialize followed by ph2_query_iterator_collect
+ * 	iterator can be NULL when the results are known to fit
+ * 		otherwise pass it to ph2_query_iterator_collect to get the rest
+ *
+ * returns the same as ph2_query_iterator_collect
+ *
+ * in concurrent mode the entries are only safe to use inside of a read section
+ * 	and continuing with iterator also needs a read section around the whole query
+ *
+ * example:
+ * 	ph2_entry_t* entries[256];
+ * 	ph2_query_iterator_t iterator;
+ * 	size_t count;
+ * 	int more = ph2_query_collect (tree, &query, entries, 256, &count, &iterator);
+ *
+ * 	while (true)
+ * 	{
+ * 		// do something with entries[0] through entries[count - 1]
+ *
+ * 		if (!more)
+ * 		{
+ * 			break;
+ * 		}
+ *
+ * 		more = ph2_query_iterator_collect (&iterator, entries, 256, &count);
+ * 	}
+ */
+int ph2_query_collect (ph2_t* tree, ph2_query_t* query, ph2_entry_t** out, size_t capacity, size_t* count, ph2_query_iterator_t* iterator);
+
+/*
+ * set up cursor to find points in tree
+ * 	a cursor does not need to be freed
+ */
+void ph2_cursor_initialize (ph2_t* tree, ph2_cursor_t* cursor);
+/*
+ * the same as ph2_find and ph2_insert
+ * 	but starting from the cursor's path instead of the root
+ */
+void* ph2_cursor_find (ph2_cursor_t* cursor, void* index);
+void* ph2_cursor_insert (ph2_cursor_t* cursor, void* index);
+/*
+ * apply count inserts and removes to tree
+ * 	ops are applied in the z-order of their points
+ * 		ops on the same point are applied in the order they are in ops
+ * 	the ops are applied in a single walk down the tree
+ * 		every node is visited once for all of the ops below it
+ * 		and its children array is resized once for all of them, not once per op
+ * 	the ops have to be sorted first
+ * 		so ops spread out over the whole tree cost about the same as one at a time
+ * 		the closer together the ops are, the more of the walk they share
+ *
+ * in concurrent mode the ops are applied one at a time in input order
+ * 	readers see every op as it is applied
+ *
+ * returns 0 on success
+ * 	1 if any of the inserts failed, their ops get a NULL element
+ */
+int ph2_apply_batch (ph2_t* tree, ph2_batch_op_t* ops, size_t count);
+
+/*
+ * find the k entries closest to center
+ *
+ * center is whatever you use for the spatial index of elements, same as ph2_find
+ * distance is measured between tree points (keys, not your original values)
+ * 	pass NULL as the distance function to use ph2_distance_euclidean
+ * out needs room for k entries
+ * 	entries are written to out from closest to farthest
+ *
+ * returns how many entries were written to out
+ * 	which is less than k when the tree has less than k entries
+ */
+size_t ph2_knn (ph2_t* tree, void* center, size_t k, ph2_distance_function_t distance, ph2_entry_t** out);
+double ph2_distance_euclidean (ph2_point_t* point_a, ph2_point_t* point_b);
 
 /*
- * allocate a query
+ * allocate a query with the allocator of tree
+ * 	free it with the same tree
  */
-ph2_query_t* ph2_query_create ();
-void ph2_query_free (ph2_query_t* query);
+ph2_query_t* ph2_query_create (ph2_t* tree);
+void ph2_query_free (ph2_t* tree, ph2_query_t* query);
 void ph2_query_set (ph2_t* tree, ph2_query_t* query, void* min, void* max, phtree_iteration_function_t function);
 /*
  * box queries are only relevant in trees with an even number of dimensions
@@ -283,6 +885,11 @@ void ph2_query_set (ph2_t* tree, ph2_query_t* query, void* min, void* max, phtre
  *
  * set intersect to 'true' to include intersecting boxes
  * set intersect to 'false' to only include boxes entirely contained in the query box
+ *
+ * intersect queries only check the bound of each dimension which can fail
+ * 	the max of the stored min corners and the min of the stored max corners
+ * 	nodes which are entirely inside of a bound stop checking it
+ * 		and nodes entirely inside of the window have every entry taken without a check
  */
 void ph2_query_box_set (ph2_t* tree, ph2_query_t* query, bool intersect, void* min, void* max, phtree_iteration_function_t function);
 
@@ -292,7 +899,215 @@ void ph2_query_box_set (ph2_t* tree, ph2_query_t* query, bool intersect, void* m
  * you can do the same with regular ph2_query_box_set
  */
 void ph2_query_box_point_set (ph2_t* tree, ph2_query_t* query, void* point, phtree_iteration_function_t function);
+/*
+ * run function once on every pair of boxes in the tree which intersect
+ * 	boxes are stored as points the same way ph2_query_box_set expects
+ * 	boxes which only touch at an edge intersect, the same as in box queries
+ * 	a box is not paired with itself, and which box of a pair is element_a is not defined
+ *
+ * the tree is walked once, comparing nodes against nodes
+ * 	pairs of nodes which can not hold intersecting boxes are skipped whole
+ * 		instead of running a ph2_query_box_set query for every box
+ *
+ * the tree must not be changed by function
+ */
+void ph2_box_pairs (ph2_t* tree, ph2_pair_function_t function, void* data);
 void ph2_query_clear (ph2_query_t* query);
+
+// at most 1 << PH2_SHARD_BITS_MAX shards
+#define PH2_SHARD_BITS_MAX 12
+
+/*
+ * the key space split in to 1 << shard_bits independent trees
+ * 	a point goes to the shard picked by the top shard_bits bits of its z-order
+ * 		the bits the root uses to pick a child, then the bits below the root, and so on
+ * 	key_bits is how many of the low bits of each key the points use
+ * 		the z-order starts at bit key_bits - 1 instead of at the top bit of the key
+ * 		so points which only use the low bits of their keys still spread over every shard
+ * 		higher bits are ignored when picking a shard
+ *
+ * every shard is a regular ph2_t
+ * 	so each can be written by a different thread at the same time
+ * 	one thread at a time per shard, the same as a single tree
+ * 		use ph2_sharded_shard to send each point to the thread which owns its shard
+ * queries only go to the shards whose part of the key space overlaps the window
+ */
+typedef struct ph2_sharded_t
+{
+	ph2_t** shards;
+	int shard_count;
+	int shard_bits;
+	int key_bits;
+	// from the options the shards were created with
+	ph2_allocator_t allocator;
+} ph2_sharded_t;
+
+/*
+ * every shard is created with ph2_create and the same arguments
+ * 	options are copied in to every shard, NULL uses the defaults
+ * 	every shard has its own pools, each with at least one slab
+ * 		so a few shards for every thread is plenty
+ * 		options->pool_slab_size makes lots of small shards cheaper
+ * 0 <= shard_bits <= PH2_SHARD_BITS_MAX
+ * 	every dimension gets shard_bits / DIMENSIONS of the bits, the first dimensions get the rest
+ * 		each dimension needs at most key_bits of them
+ * 1 <= key_bits <= PHTREE_BIT_WIDTH
+ *
+ * returns NULL on failure
+ */
+ph2_sharded_t* ph2_sharded_create (
+	int shard_bits,
+	int key_bits,
+	void* (*element_create) (void* input),
+	void (*element_destroy) (void* element),
+	phtree_key_t (*convert_to_key) (void* input),
+	void (*convert_to_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	void (*convert_to_box_point) (ph2_t* tree, ph2_point_t* out, void* input),
+	ph2_options_t* options);
+void ph2_sharded_free (ph2_sharded_t* sharded);
+/*
+ * the shard index belongs to
+ * 	0 <= shard < sharded->shard_count
+ */
+int ph2_sharded_shard (ph2_sharded_t* sharded, void* index);
+ph2_t* ph2_sharded_tree (ph2_sharded_t* sharded, int shard);
+/*
+ * the same as ph2_insert, ph2_find, and ph2_remove on the shard index belongs to
+ */
+void* ph2_sharded_insert (ph2_sharded_t* sharded, void* index);
+void* ph2_sharded_find (ph2_sharded_t* sharded, void* index);
+void ph2_sharded_remove (ph2_sharded_t* sharded, void* index);
+/*
+ * split inputs by shard, then ph2_bulk_load every shard as its own task on pool
+ * 	pool can be NULL to load the shards one after another on this thread
+ * 	nothing else may write to the shards until this returns
+ *
+ * this waits for every task in pool to finish before returning
+ * 	so it should not be called from inside a pool task
+ *
+ * returns 0 on success
+ * 	1 if any shard failed, the other shards are still loaded
+ */
+int ph2_sharded_bulk_load (ph2_sharded_t* sharded, void** inputs, size_t count, phtree_thread_pool_t* pool);
+/*
+ * run query on every shard which overlaps its window
+ * 	set query up with any of the shards, they all convert inputs the same way
+ */
+void ph2_sharded_query (ph2_sharded_t* sharded, ph2_query_t* query, void* data);
+/*
+ * the same as ph2_sharded_query, but every overlapping shard is a task on pool
+ * 	when only one shard overlaps, it is split up with ph2_query_parallel instead
+ * per_thread_data works the same as in ph2_query_parallel
+ */
+void ph2_sharded_query_parallel (ph2_sharded_t* sharded, ph2_query_t* query, phtree_thread_pool_t* pool, void** per_thread_data);
+/*
+ * save a tree to a file which can be mapped back in and queried without loading it
+ *
+ * element_serializer writes an element in to buffer as flat bytes and returns the number of bytes
+ * 	it is first called with a NULL buffer to get the size, then again to write the element
+ * 	the bytes are saved as is, so they can not contain pointers
+ * 	element_serializer can be NULL to only save the points
+ *
+ * files can only be mapped by trees with the same dimensions, key width, and PHTREE_DEPTH
+ * 	on a machine with the same byte order
+ *
+ * returns 0 on success
+ */
+typedef size_t (*ph2_element_serializer_t) (void* element, void* buffer);
+int ph2_save (ph2_t* tree, const char* path, ph2_element_serializer_t element_serializer);
+
+/*
+ * a saved tree, mapped read only
+ * 	queries run directly on the file, nothing is converted or copied on loading
+ * 		so mapping is O(1) and the operating system only loads the parts of the file queries touch
+ * 	every process which maps the same file shares the memory through the page cache
+ * 	elements are pointers to the bytes element_serializer wrote, aligned to 16 bytes
+ * 		or NULL if the element was not saved
+ *
+ * the file is trusted
+ * 	only its header is checked, a corrupted file can make queries read out of bounds
+ */
+typedef struct ph2_map_t ph2_map_t;
+
+/*
+ * returns NULL on failure
+ */
+ph2_map_t* ph2_map (const char* path);
+void ph2_unmap (ph2_map_t* map);
+/*
+ * how many entries are in the map
+ */
+size_t ph2_map_count (ph2_map_t* map);
+/*
+ * the same as ph2_query
+ * 	build query with ph2_query_set on a tree which converts inputs the same way as the saved tree
+ */
+void ph2_map_query (ph2_map_t* map, ph2_query_t* query, void* data);
+/*
+ * returns the element at point
+ * 	NULL if there is no entry at point or its element was not saved
+ * use ph2_point_set or convert_to_point on a tree which converts inputs the same way as the saved tree
+ */
+void* ph2_map_find (ph2_map_t* map, ph2_point_t* point);
+
+/*
+ * the shape and memory use of a tree
+ * 	see ph2_analyze
+ */
+typedef struct ph2_tree_info_t
+{
+	// inner nodes, the root included
+	size_t node_count;
+	size_t leaf_count;
+	size_t entry_count;
+	// the deepest leaf, the root's children are at depth 1
+	int max_depth;
+
+	/*
+	 * how full the children arrays are
+	 * 	slots is the sum of child_capacity and used is the sum of child_count
+	 * 	node slots are in inner nodes, entry slots are in leaves
+	 */
+	size_t node_slots;
+	size_t node_slots_used;
+	size_t entry_slots;
+	size_t entry_slots_used;
+	// used / slots over every children array, 0 for an empty tree
+	double fill_ratio;
+
+	// how many nodes, the root and leaves included, have each postfix_length and infix_length
+	size_t postfix_lengths[PHTREE_DEPTH];
+	size_t infix_lengths[PHTREE_DEPTH];
+
+	/*
+	 * bytes allocated by the tree, elements not included
+	 * 	children_bytes is the size of every children array, where ever it was allocated from
+	 * 	pool_bytes is everything the pools have allocated, including blocks which are not in use
+	 * 		the element pool is counted here too when there is one
+	 * 	total_bytes is the tree itself, the pools, and the children arrays which are not in a pool
+	 */
+	size_t children_bytes;
+	size_t pool_bytes;
+	size_t total_bytes;
+} ph2_tree_info_t;
+
+/*
+ * fill out with the shape of tree in a single walk
+ * 	in concurrent mode this is the tree as it was when the walk started
+ */
+void ph2_analyze (ph2_t* tree, ph2_tree_info_t* out);
+
+/*
+ * get the counters kept with PHTREE_STATS
+ * 	ph2_stats gets the counters of changes to tree since it was created or last reset
+ * 	ph2_query_stats gets the counters of every run of query since it was last set
+ * 		ph2_query, ph2_query_count, ph2_query_parallel, ph2_query_delta (counted in new_query), and query iterators count
+ * without PHTREE_STATS every counter is 0
+ */
+void ph2_stats (ph2_t* tree, ph2_stats_t* out);
+void ph2_stats_reset (ph2_t* tree);
+void ph2_query_stats (ph2_query_t* query, ph2_stats_t* out);
+
 /*
  * if you need the center point of a window query
  */
@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "phtree32_common.h"
@@ -21,6 +22,7 @@
 // 				 0 = 1000
 // 				-1 = 0111
 // 				-2 = 0110
+#if PHTREE_BIT_WIDTH == 32
 phtree_key_t phtree_int32_to_key (void* input)
 {
 	int32_t* a = (int32_t*) input;
@@ -31,6 +33,26 @@ phtree_key_t phtree_int32_to_key (void* input)
 
 	return b;
 }
+#else
+phtree_key_t phtree_int64_to_key (void* input)
+{
+	int64_t* a = (int64_t*) input;
+	phtree_key_t b = 0;
+
+	memcpy (&b, a, sizeof (uint64_t));
+	b ^= (PHTREE_KEY_ONE << (PHTREE_BIT_WIDTH - 1));  // flip sign bit
+
+	return b;
+}
+
+// sign extending to 64 bits keeps the order of the values
+phtree_key_t phtree_int32_to_key (void* input)
+{
+	int64_t a = *(int32_t*) input;
+
+	return phtree_int64_to_key (&a);
+}
+#endif
 
 // in a hypercube we expect bits set to 0 to be less than bits set to 1
 // the sign bit in floating point does not work that way
@@ -52,13 +74,12 @@ phtree_key_t phtree_int32_to_key (void* input)
 // +nan will be greater than +infinity
 // -nan will be less than -infinity
 // -0 is converted to +0
+//
+// the same works for doubles
+// 	as long as the key is as wide as the floating point type
 #define PHTREE_SIGN_BIT (PHTREE_KEY_ONE << (PHTREE_BIT_WIDTH - 1))
-phtree_key_t phtree_float_to_key (void* input)
+static phtree_key_t float_bits_to_key (phtree_key_t bits)
 {
-	phtree_key_t bits;
-
-	memcpy (&bits, input, sizeof (phtree_key_t));
-
 	// if the float is negative
 	// 	convert to two's complement (~bits + 1)
 	// 	then & with (PHTREE_KEY_MAX >> 1)
@@ -77,6 +98,266 @@ phtree_key_t phtree_float_to_key (void* input)
 	return bits;
 }
 
+#if PHTREE_BIT_WIDTH == 32
+phtree_key_t phtree_float_to_key (void* input)
+{
+	phtree_key_t bits;
+
+	memcpy (&bits, input, sizeof (phtree_key_t));
+
+	return float_bits_to_key (bits);
+}
+#else
+phtree_key_t phtree_double_to_key (void* input)
+{
+	phtree_key_t bits;
+
+	memcpy (&bits, input, sizeof (phtree_key_t));
+
+	return float_bits_to_key (bits);
+}
+
+// every float is exactly representable as a double
+phtree_key_t phtree_float_to_key (void* input)
+{
+	double a = *(float*) input;
+
+	return phtree_double_to_key (&a);
+}
+#endif
+
+/*
+ * allocators
+ */
+void* phtree_allocator_calloc (phtree_allocator_t* allocator, size_t count, size_t size)
+{
+	if (!allocator || !allocator->allocate)
+	{
+		return phtree_calloc (count, size);
+	}
+
+	if (size && count > SIZE_MAX / size)
+	{
+		return NULL;
+	}
+
+	void* memory = allocator->allocate (allocator->context, count * size);
+
+	if (memory)
+	{
+		memset (memory, 0, count * size);
+	}
+
+	return memory;
+}
+
+void* phtree_allocator_realloc (phtree_allocator_t* allocator, void* memory, size_t size)
+{
+	if (!allocator || !allocator->allocate)
+	{
+		return phtree_realloc (memory, size);
+	}
+
+	return allocator->reallocate (allocator->context, memory, size);
+}
+
+void phtree_allocator_free (phtree_allocator_t* allocator, void* memory)
+{
+	if (!allocator || !allocator->allocate)
+	{
+		phtree_free (memory);
+		return;
+	}
+
+	allocator->free (allocator->context, memory);
+}
+
+/*
+ * aligned allocations
+ *
+ * we allocate enough extra memory to move the start up to the alignment
+ * 	and keep the pointer the allocator returned right before the aligned memory
+ */
+void* phtree_allocator_aligned_calloc (phtree_allocator_t* allocator, size_t count, size_t size, size_t alignment)
+{
+	if (alignment < sizeof (void*))
+	{
+		alignment = sizeof (void*);
+	}
+
+	if (size && count > (SIZE_MAX - alignment - sizeof (void*)) / size)
+	{
+		return NULL;
+	}
+
+	char* memory = phtree_allocator_calloc (allocator, 1, (count * size) + alignment + sizeof (void*));
+
+	if (!memory)
+	{
+		return NULL;
+	}
+
+	uintptr_t aligned = ((uintptr_t) memory + sizeof (void*) + alignment - 1) & ~((uintptr_t) alignment - 1);
+
+	memcpy ((char*) aligned - sizeof (void*), &memory, sizeof (void*));
+
+	return (void*) aligned;
+}
+
+void phtree_allocator_aligned_free (phtree_allocator_t* allocator, void* memory)
+{
+	if (!memory)
+	{
+		return;
+	}
+
+	void* original;
+
+	memcpy (&original, (char*) memory - sizeof (void*), sizeof (void*));
+	phtree_allocator_free (allocator, original);
+}
+
+void* phtree_aligned_calloc (size_t count, size_t size, size_t alignment)
+{
+	return phtree_allocator_aligned_calloc (NULL, count, size, alignment);
+}
+
+void phtree_aligned_free (void* memory)
+{
+	phtree_allocator_aligned_free (NULL, memory);
+}
+
+/*
+ * memory pool
+ */
+
+struct phtree_pool_slab_t
+{
+	phtree_pool_slab_t* next;
+};
+
+// the space before the first block of a slab
+// 	rounded up so blocks stay aligned
+#define phtree_pool_slab_header(pool) ((sizeof (phtree_pool_slab_t) + (pool)->alignment - 1) & ~((pool)->alignment - 1))
+
+void phtree_pool_initialize (phtree_pool_t* pool, size_t block_size, size_t alignment, int class_count, size_t slab_size, phtree_allocator_t* allocator)
+{
+	memset (pool, 0, sizeof (*pool));
+
+	if (allocator)
+	{
+		pool->allocator = *allocator;
+	}
+
+	if (alignment < _Alignof (max_align_t))
+	{
+		alignment = _Alignof (max_align_t);
+	}
+
+	pool->alignment = alignment;
+
+	if (class_count > PHTREE_POOL_CLASS_MAX)
+	{
+		class_count = PHTREE_POOL_CLASS_MAX;
+	}
+
+	if (slab_size == 0)
+	{
+		slab_size = PHTREE_POOL_SLAB_SIZE;
+	}
+
+	// a slab always has to be able to hold at least one of the largest blocks
+	if (slab_size < phtree_pool_slab_header (pool) + (block_size * class_count))
+	{
+		slab_size = phtree_pool_slab_header (pool) + (block_size * class_count);
+	}
+
+	pool->block_size = block_size;
+	pool->class_count = class_count;
+	pool->slab_size = slab_size;
+}
+
+void* phtree_pool_allocate (phtree_pool_t* pool, int size_class)
+{
+	void* block = pool->free_lists[size_class];
+
+	// reuse a freed block if we have one
+	if (block)
+	{
+		memcpy (&pool->free_lists[size_class], block, sizeof (void*));
+		return block;
+	}
+
+	size_t size = pool->block_size * (size_class + 1);
+
+	// not enough room left in the current slab
+	// 	the leftover space at the end of the slab is just wasted
+	if ((size_t) (pool->slab_end - pool->slab_cursor) < size)
+	{
+		phtree_pool_slab_t* slab = phtree_allocator_aligned_calloc (&pool->allocator, 1, pool->slab_size, pool->alignment);
+
+		if (!slab)
+		{
+			return NULL;
+		}
+
+		slab->next = pool->slabs;
+		pool->slabs = slab;
+		pool->slab_cursor = (char*) slab + phtree_pool_slab_header (pool);
+		pool->slab_end = (char*) slab + pool->slab_size;
+	}
+
+	block = pool->slab_cursor;
+	pool->slab_cursor += size;
+
+	return block;
+}
+
+void phtree_pool_free (phtree_pool_t* pool, void* block, int size_class)
+{
+	if (!block)
+	{
+		return;
+	}
+
+	// the free list link is stored in the freed block itself
+	memcpy (block, &pool->free_lists[size_class], sizeof (void*));
+	pool->free_lists[size_class] = block;
+}
+
+void phtree_pool_clear (phtree_pool_t* pool)
+{
+	phtree_pool_slab_t* slab = pool->slabs;
+
+	while (slab)
+	{
+		phtree_pool_slab_t* next = slab->next;
+		phtree_allocator_aligned_free (&pool->allocator, slab);
+		slab = next;
+	}
+
+	pool->slabs = NULL;
+	pool->slab_cursor = NULL;
+	pool->slab_end = NULL;
+
+	for (int iter = 0; iter < PHTREE_POOL_CLASS_MAX; iter++)
+	{
+		pool->free_lists[iter] = NULL;
+	}
+}
+
+size_t phtree_pool_reserved (phtree_pool_t* pool)
+{
+	size_t reserved = 0;
+
+	for (phtree_pool_slab_t* slab = pool->slabs; slab; slab = slab->next)
+	{
+		reserved += pool->slab_size;
+	}
+
+	return reserved;
+}
+
 /*
  * count leading and trailing zeroes
  */
@@ -6,23 +6,44 @@
  */
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
-typedef uint32_t phtree_key_t;
-
+/*
+ * keys are 32 bits unless PHTREE_BIT_WIDTH is defined as 64 before here
+ * 	phtree64_common.h does this for you
+ */
+#ifndef PHTREE_BIT_WIDTH
 // use this for converting input into keys
 // 	this should be the same as the bit width of your key type
 #define PHTREE_BIT_WIDTH 32
+#endif
+
+#if PHTREE_BIT_WIDTH == 32
+typedef uint32_t phtree_key_t;
 
 // KEY_ONE is an unsigned value of 1
 #define PHTREE_KEY_ONE UINT32_C(1)
 #define PHTREE_KEY_MAX UINT32_MAX
+#elif PHTREE_BIT_WIDTH == 64
+typedef uint64_t phtree_key_t;
+
+#define PHTREE_KEY_ONE UINT64_C(1)
+#define PHTREE_KEY_MAX UINT64_MAX
+#else
+#error "PHTREE_BIT_WIDTH must be 32 or 64"
+#endif
 
 /*
  * generic key converters
+ * 	in 64 bit trees int32 and float inputs are widened without losing anything
  */
 phtree_key_t phtree_int32_to_key (void* input);
 phtree_key_t phtree_float_to_key (void* input);
+#if PHTREE_BIT_WIDTH == 64
+phtree_key_t phtree_int64_to_key (void* input);
+phtree_key_t phtree_double_to_key (void* input);
+#endif
 
 /*
  * functions to be run on elements when iterating the tree
@@ -44,6 +65,108 @@ typedef void (*phtree_iteration_function_t) (void* element, void* data);
 #define phtree_realloc realloc
 #endif
 
+/*
+ * allocators which carry their own state
+ * 	so every tree (and its pools) can use a different one
+ * 		arenas, numa local heaps, per tenant accounting, etc.
+ * context is passed to every function
+ *
+ * allocate returns size bytes aligned for any type, or NULL when out of memory
+ * 	the memory does not need to be zeroed
+ * reallocate and free work like realloc and free
+ * 	memory can be NULL
+ *
+ * either set all 3 functions or none of them
+ * 	an allocator with no allocate function, or a NULL allocator, uses phtree_calloc/phtree_realloc/phtree_free
+ */
+typedef struct phtree_allocator_t
+{
+	void* context;
+	void* (*allocate) (void* context, size_t size);
+	void* (*reallocate) (void* context, void* memory, size_t size);
+	void (*free) (void* context, void* memory);
+} phtree_allocator_t;
+
+/*
+ * zeroed memory for count things of size from allocator
+ * 	returns NULL when out of memory or when count * size overflows
+ */
+void* phtree_allocator_calloc (phtree_allocator_t* allocator, size_t count, size_t size);
+void* phtree_allocator_realloc (phtree_allocator_t* allocator, void* memory, size_t size);
+void phtree_allocator_free (phtree_allocator_t* allocator, void* memory);
+
+/*
+ * allocations aligned to more than phtree_calloc guarantees
+ * 	built on top of phtree_allocator_calloc/phtree_allocator_free
+ * 		phtree_aligned_calloc/phtree_aligned_free use the default allocator
+ * alignment must be a power of 2
+ * memory from the aligned callocs must be freed with the matching aligned free
+ */
+void* phtree_allocator_aligned_calloc (phtree_allocator_t* allocator, size_t count, size_t size, size_t alignment);
+void phtree_allocator_aligned_free (phtree_allocator_t* allocator, void* memory);
+void* phtree_aligned_calloc (size_t count, size_t size, size_t alignment);
+void phtree_aligned_free (void* memory);
+
+/*
+ * memory pool for blocks of a few fixed sizes
+ *
+ * the pool hands out blocks which are multiples of block_size
+ * 	size class 0 is block_size bytes, size class 1 is (2 * block_size) bytes, etc.
+ * blocks are carved out of large slabs
+ * 	freed blocks go on a free list for their size class and are reused
+ * 	slabs are only ever given back by phtree_pool_clear
+ *
+ * because the pool only frees slabs all at once
+ * 	dropping everything allocated from a pool is O(slabs) instead of O(blocks)
+ */
+#define PHTREE_POOL_CLASS_MAX 4
+// default size of a single slab in bytes
+#define PHTREE_POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct phtree_pool_slab_t phtree_pool_slab_t;
+typedef struct phtree_pool_t
+{
+	// size of the smallest block in bytes
+	size_t block_size;
+	// every block starts on a multiple of alignment
+	size_t alignment;
+	// how many size classes the pool hands out
+	int class_count;
+	size_t slab_size;
+
+	// every slab the pool has allocated
+	phtree_pool_slab_t* slabs;
+	// the unused space at the end of the newest slab
+	char* slab_cursor;
+	char* slab_end;
+
+	// singly linked lists of freed blocks, one for each size class
+	void* free_lists[PHTREE_POOL_CLASS_MAX];
+
+	// where slabs come from
+	phtree_allocator_t allocator;
+} phtree_pool_t;
+
+/*
+ * slab_size of 0 uses PHTREE_POOL_SLAB_SIZE
+ * alignment of 0 aligns blocks for any type
+ * block_size must be at least sizeof (void*) and a multiple of alignment
+ * allocator is copied in to the pool, NULL uses the default allocator
+ */
+void phtree_pool_initialize (phtree_pool_t* pool, size_t block_size, size_t alignment, int class_count, size_t slab_size, phtree_allocator_t* allocator);
+void* phtree_pool_allocate (phtree_pool_t* pool, int size_class);
+void phtree_pool_free (phtree_pool_t* pool, void* block, int size_class);
+/*
+ * free every slab in the pool
+ * 	every block allocated from the pool is invalid after this
+ */
+void phtree_pool_clear (phtree_pool_t* pool);
+/*
+ * bytes of every slab the pool has allocated
+ * 	blocks in use, freed blocks, and the unused end of the newest slab
+ */
+size_t phtree_pool_reserved (phtree_pool_t* pool);
+
 #if defined (_MSC_VER)
 #include <intrin.h>
 uint64_t msvc_count_leading_zeoes (uint64_t bit_string);
@@ -55,8 +178,8 @@ uint64_t phtree_count_trailing_zeroes (uint64_t bit_string);
 uint64_t phtree_popcount (uint64_t x);
 
 #if defined (__clang__) || defined (__GNUC__)
-#define count_leading_zeroes(bit_string) (0 ? 64U : __builtin_clzll (bit_string))
-#define count_trailing_zeroes(bit_string) (0 ? 64U : __builtin_ctzll (bit_string))
+#define count_leading_zeroes(bit_string) ((bit_string) == 0 ? 64U : (uint64_t) __builtin_clzll (bit_string))
+#define count_trailing_zeroes(bit_string) ((bit_string) == 0 ? 64U : (uint64_t) __builtin_ctzll (bit_string))
 #define popcount __builtin_popcountll
 #elif defined (_MSC_VER)
 #define count_leading_zeroes(bit_string) count_leading_zeoes_msvc (bit_string)
@@ -68,4 +191,31 @@ uint64_t phtree_popcount (uint64_t x);
 #define popcount phtree_popcount
 #endif
 
+/*
+ * hint that memory at address will be read soon
+ * 	prefetching never faults, so address can be anything including NULL
+ */
+#if defined (__clang__) || defined (__GNUC__)
+#define phtree_prefetch(address) __builtin_prefetch ((address), 0, 3)
+#elif defined (_MSC_VER)
+#define phtree_prefetch(address) _mm_prefetch ((const char*) (address), _MM_HINT_T0)
+#else
+#define phtree_prefetch(address) ((void) (address))
+#endif
+
+/*
+ * hint that this thread is spinning while it waits on another thread
+ */
+#if (defined (__clang__) || defined (__GNUC__)) && (defined (__x86_64__) || defined (__i386__))
+#define phtree_cpu_relax() __builtin_ia32_pause ()
+#elif (defined (__clang__) || defined (__GNUC__)) && defined (__aarch64__)
+#define phtree_cpu_relax() __asm__ __volatile__ ("yield")
+#elif defined (_MSC_VER) && (defined (_M_X64) || defined (_M_IX86))
+#define phtree_cpu_relax() _mm_pause ()
+#elif defined (_MSC_VER) && defined (_M_ARM64)
+#define phtree_cpu_relax() __yield ()
+#else
+#define phtree_cpu_relax() ((void) 0)
+#endif
+
 #endif  // end _phtree32_common_h_
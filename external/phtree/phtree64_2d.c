@@ -0,0 +1,5 @@
+/*
+ * phtree32_2d.c built with 64 bit keys
+ */
+#include "phtree64_2d.h"
+#include "phtree32_2d.c"
@@ -0,0 +1,15 @@
+#ifndef _phtree64_2d_h_
+#define _phtree64_2d_h_
+/*
+ * the ph2 tree with 64 bit keys
+ * 	the api is the same as phtree32_2d.h
+ * 	use phtree_double_to_key or phtree_int64_to_key for full precision inputs
+ *
+ * a program can use the 32 bit or the 64 bit tree, not both
+ * 	they share names
+ */
+
+#include "phtree64_common.h"
+#include "phtree32_2d.h"
+
+#endif  // end _phtree64_2d_h_
@@ -0,0 +1,5 @@
+/*
+ * phtree32_common.c built with 64 bit keys
+ */
+#include "phtree64_common.h"
+#include "phtree32_common.c"
@@ -0,0 +1,16 @@
+#ifndef _phtree64_common_h_
+#define _phtree64_common_h_
+/*
+ * the common phtree functionality with 64 bit keys
+ * 	include this instead of phtree32_common.h
+ */
+
+#if defined (_phtree32_common_h_) && PHTREE_BIT_WIDTH != 64
+#error "phtree32_common.h was already included with 32 bit keys"
+#endif
+
+#define PHTREE_BIT_WIDTH 64
+
+#include "phtree32_common.h"
+
+#endif  // end _phtree64_common_h_
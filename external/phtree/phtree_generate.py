@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""
+generate phN variants of the ph2 tree
+
+phtree32_2d.h and phtree32_2d.c are the template
+	every ph2_ name becomes phN_
+	PH2_DIMENSIONS becomes N
+		so the dimension loops have a constant trip count the compiler unrolls
+		and ph2_child_set_t picks the smallest integer with 2^N bits
+	ph2_point_set and ph2_point_box_set are rewritten to take N and N / 2 inputs
+
+usage:
+	phtree_generate.py dimensions template.h template.c output.h output.c
+"""
+
+import re
+import sys
+
+DIMENSIONS_MIN = 1
+DIMENSIONS_MAX = 6
+
+# names for the point_set inputs
+# 	the 2d template uses a and b
+INPUT_NAMES = "abcdef"
+
+
+def replace_once (text, old, new):
+	"""
+	replace exactly one occurrence of old
+		so a change to the template which breaks the generator fails loudly
+		instead of quietly generating a broken tree
+	"""
+
+	count = text.count (old)
+
+	if count != 1:
+		sys.exit ("phtree_generate: expected 1 occurrence of {!r} in the template, found {}".format (old, count))
+
+	return text.replace (old, new)
+
+
+def point_set_parameters (count):
+	return ", ".join ("void* " + INPUT_NAMES[iter] for iter in range (count))
+
+
+def point_set_declaration (dimensions):
+	return "void ph2_point_set (ph2_t* tree, ph2_point_t* point, {})".format (point_set_parameters (dimensions))
+
+
+def point_box_set_declaration (dimensions):
+	return "void ph2_point_box_set (ph2_t* tree, ph2_point_t* point, {})".format (point_set_parameters (dimensions // 2))
+
+
+def point_set_body (dimensions):
+	lines = ["\tpoint->values[{}] = tree->convert_to_key ({});".format (iter, INPUT_NAMES[iter]) for iter in range (dimensions)]
+
+	return "\n{\n" + "\n".join (lines) + "\n}\n"
+
+
+def point_box_set_body (dimensions):
+	half = dimensions // 2
+	lines = ["\tpoint->values[{}] = tree->convert_to_key ({});".format (iter, INPUT_NAMES[iter]) for iter in range (half)]
+	lines.append ("")
+	lines += ["\tpoint->values[{}] = point->values[{}];".format (half + iter, iter) for iter in range (half)]
+
+	return "\n{\n" + "\n".join (lines) + "\n}\n"
+
+
+def rename (text, dimensions):
+	text = text.replace ("phtree32_2d", "phtree32_{}d".format (dimensions))
+	text = re.sub (r"\bph2_", "ph{}_".format (dimensions), text)
+	text = re.sub (r"\b_ph2_", "_ph{}_".format (dimensions), text)
+	text = re.sub (r"\bPH2_", "PH{}_".format (dimensions), text)
+
+	return text
+
+
+def generate_header (template, dimensions):
+	text = replace_once (template, "#define PH2_DIMENSIONS 2\n", "#define PH2_DIMENSIONS {}\n".format (dimensions))
+	text = replace_once (text, point_set_declaration (2) + ";", point_set_declaration (dimensions) + ";")
+	text = replace_once (text, point_box_set_declaration (2) + ";", point_box_set_declaration (dimensions) + ";")
+
+	return rename (text, dimensions)
+
+
+def generate_source (template, dimensions):
+	# the template bodies run from the declaration to the first closing brace at the start of a line
+	for declaration, body in ((point_set_declaration, point_set_body), (point_box_set_declaration, point_box_set_body)):
+		match = re.search (re.escape (declaration (2)) + r"\n\{\n.*?\n\}\n", template, re.DOTALL)
+
+		if not match:
+			sys.exit ("phtree_generate: could not find {!r} in the template".format (declaration (2)))
+
+		template = template[:match.start ()] + declaration (dimensions) + body (dimensions) + template[match.end ():]
+
+	return rename (template, dimensions)
+
+
+def main (arguments):
+	if len (arguments) != 6:
+		sys.exit (__doc__)
+
+	dimensions = int (arguments[1])
+
+	if dimensions < DIMENSIONS_MIN or dimensions > DIMENSIONS_MAX:
+		sys.exit ("phtree_generate: dimensions must be between {} and {}".format (DIMENSIONS_MIN, DIMENSIONS_MAX))
+
+	with open (arguments[2]) as header_file:
+		header = generate_header (header_file.read (), dimensions)
+
+	with open (arguments[3]) as source_file:
+		source = generate_source (source_file.read (), dimensions)
+
+	banner = "// generated from the ph2 template by phtree_generate.py, do not edit\n"
+
+	with open (arguments[4], "w") as header_file:
+		header_file.write (banner + header)
+
+	with open (arguments[5], "w") as source_file:
+		source_file.write (banner + source)
+
+
+if __name__ == "__main__":
+	main (sys.argv)
@@ -0,0 +1,289 @@
+#include <stdlib.h>
+
+#include "phtree_thread_pool.h"
+
+// the worker running on this thread
+// 	NULL on threads which are not pool workers
+static _Thread_local phtree_worker_t* current_worker = NULL;
+
+/*
+ * the deque functions expect deque->lock to be held
+ */
+static int deque_push (phtree_task_deque_t* deque, phtree_task_t task)
+{
+	if (deque->count >= deque->capacity)
+	{
+		size_t new_capacity = deque->capacity ? deque->capacity * 2 : 64;
+		phtree_task_t* tasks = phtree_calloc (new_capacity, sizeof (*tasks));
+
+		if (!tasks)
+		{
+			return 1;
+		}
+
+		// unwrap the ring buffer into the new array
+		for (size_t iter = 0; iter < deque->count; iter++)
+		{
+			tasks[iter] = deque->tasks[(deque->top + iter) % deque->capacity];
+		}
+
+		phtree_free (deque->tasks);
+		deque->tasks = tasks;
+		deque->top = 0;
+		deque->capacity = new_capacity;
+	}
+
+	deque->tasks[(deque->top + deque->count) % deque->capacity] = task;
+	deque->count++;
+
+	return 0;
+}
+
+// take the newest task
+static bool deque_pop_bottom (phtree_task_deque_t* deque, phtree_task_t* task_out)
+{
+	if (deque->count == 0)
+	{
+		return false;
+	}
+
+	deque->count--;
+	*task_out = deque->tasks[(deque->top + deque->count) % deque->capacity];
+
+	return true;
+}
+
+// take the oldest task
+static bool deque_pop_top (phtree_task_deque_t* deque, phtree_task_t* task_out)
+{
+	if (deque->count == 0)
+	{
+		return false;
+	}
+
+	*task_out = deque->tasks[deque->top];
+	deque->top = (deque->top + 1) % deque->capacity;
+	deque->count--;
+
+	return true;
+}
+
+/*
+ * find a task for worker
+ * 	first from its own deque, then by stealing from the other workers
+ */
+static bool worker_take (phtree_worker_t* worker, phtree_task_t* task_out)
+{
+	phtree_thread_pool_t* pool = worker->pool;
+	bool found;
+
+	pthread_mutex_lock (&worker->deque.lock);
+	found = deque_pop_bottom (&worker->deque, task_out);
+	pthread_mutex_unlock (&worker->deque.lock);
+
+	// start stealing from our neighbor
+	// 	so all of the workers dont pile on to worker 0
+	for (int iter = 1; !found && iter < pool->thread_count; iter++)
+	{
+		phtree_worker_t* victim = &pool->workers[(worker->index + iter) % pool->thread_count];
+
+		pthread_mutex_lock (&victim->deque.lock);
+		found = deque_pop_top (&victim->deque, task_out);
+		pthread_mutex_unlock (&victim->deque.lock);
+	}
+
+	if (found)
+	{
+		atomic_fetch_sub (&pool->queued, 1);
+	}
+
+	return found;
+}
+
+static void* worker_run (void* argument)
+{
+	phtree_worker_t* worker = argument;
+	phtree_thread_pool_t* pool = worker->pool;
+	phtree_task_t task;
+
+	current_worker = worker;
+
+	while (true)
+	{
+		if (worker_take (worker, &task))
+		{
+			task.function (task.argument, worker->index);
+
+			if (atomic_fetch_sub (&pool->pending, 1) == 1)
+			{
+				pthread_mutex_lock (&pool->lock);
+				pthread_cond_broadcast (&pool->work_done);
+				pthread_mutex_unlock (&pool->lock);
+			}
+
+			continue;
+		}
+
+		pthread_mutex_lock (&pool->lock);
+
+		while (atomic_load (&pool->queued) == 0 && !atomic_load (&pool->shutdown))
+		{
+			pthread_cond_wait (&pool->work_available, &pool->lock);
+		}
+
+		pthread_mutex_unlock (&pool->lock);
+
+		if (atomic_load (&pool->shutdown) && atomic_load (&pool->queued) == 0)
+		{
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+phtree_thread_pool_t* phtree_thread_pool_create (int thread_count)
+{
+	if (thread_count <= 0)
+	{
+		thread_count = 1;
+	}
+
+	phtree_thread_pool_t* pool = phtree_calloc (1, sizeof (*pool));
+
+	if (!pool)
+	{
+		return NULL;
+	}
+
+	pool->workers = phtree_calloc (thread_count, sizeof (*pool->workers));
+
+	if (!pool->workers)
+	{
+		phtree_free (pool);
+		return NULL;
+	}
+
+	pool->thread_count = thread_count;
+	atomic_init (&pool->queued, 0);
+	atomic_init (&pool->pending, 0);
+	atomic_init (&pool->next_worker, 0);
+	atomic_init (&pool->shutdown, false);
+	pthread_mutex_init (&pool->lock, NULL);
+	pthread_cond_init (&pool->work_available, NULL);
+	pthread_cond_init (&pool->work_done, NULL);
+
+	for (int iter = 0; iter < thread_count; iter++)
+	{
+		phtree_worker_t* worker = &pool->workers[iter];
+
+		worker->pool = pool;
+		worker->index = iter;
+		pthread_mutex_init (&worker->deque.lock, NULL);
+	}
+
+	for (int iter = 0; iter < thread_count; iter++)
+	{
+		if (pthread_create (&pool->workers[iter].thread, NULL, worker_run, &pool->workers[iter]))
+		{
+			// only the workers which started need to be stopped
+			pool->thread_count = iter;
+			phtree_thread_pool_free (pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void phtree_thread_pool_free (phtree_thread_pool_t* pool)
+{
+	if (!pool)
+	{
+		return;
+	}
+
+	phtree_thread_pool_wait (pool);
+
+	pthread_mutex_lock (&pool->lock);
+	atomic_store (&pool->shutdown, true);
+	pthread_cond_broadcast (&pool->work_available);
+	pthread_mutex_unlock (&pool->lock);
+
+	for (int iter = 0; iter < pool->thread_count; iter++)
+	{
+		pthread_join (pool->workers[iter].thread, NULL);
+	}
+
+	// when phtree_thread_pool_create failed to start every worker
+	// 	thread_count only covers the workers which started
+	// 		the others never had tasks to free
+	for (int iter = 0; iter < pool->thread_count; iter++)
+	{
+		phtree_free (pool->workers[iter].deque.tasks);
+		pthread_mutex_destroy (&pool->workers[iter].deque.lock);
+	}
+
+	pthread_cond_destroy (&pool->work_done);
+	pthread_cond_destroy (&pool->work_available);
+	pthread_mutex_destroy (&pool->lock);
+	phtree_free (pool->workers);
+	phtree_free (pool);
+}
+
+int phtree_thread_pool_submit (phtree_thread_pool_t* pool, phtree_task_function_t function, void* argument)
+{
+	if (!pool || !function)
+	{
+		return 1;
+	}
+
+	phtree_worker_t* worker = current_worker;
+
+	// tasks from other threads are handed out round robin
+	if (!worker || worker->pool != pool)
+	{
+		worker = &pool->workers[atomic_fetch_add (&pool->next_worker, 1) % pool->thread_count];
+	}
+
+	// count the task before it can be taken
+	// 	so the counts never drop below the number of tasks actually in the deques
+	atomic_fetch_add (&pool->pending, 1);
+	atomic_fetch_add (&pool->queued, 1);
+
+	pthread_mutex_lock (&worker->deque.lock);
+	int result = deque_push (&worker->deque, (phtree_task_t) {function, argument});
+	pthread_mutex_unlock (&worker->deque.lock);
+
+	if (result)
+	{
+		atomic_fetch_sub (&pool->queued, 1);
+		atomic_fetch_sub (&pool->pending, 1);
+		return 1;
+	}
+
+	// signaling under the lock means a worker can not miss the new task
+	// 	between checking queued and going to sleep
+	pthread_mutex_lock (&pool->lock);
+	pthread_cond_signal (&pool->work_available);
+	pthread_mutex_unlock (&pool->lock);
+
+	return 0;
+}
+
+void phtree_thread_pool_wait (phtree_thread_pool_t* pool)
+{
+	if (!pool)
+	{
+		return;
+	}
+
+	pthread_mutex_lock (&pool->lock);
+
+	while (atomic_load (&pool->pending) != 0)
+	{
+		pthread_cond_wait (&pool->work_done, &pool->lock);
+	}
+
+	pthread_mutex_unlock (&pool->lock);
+}
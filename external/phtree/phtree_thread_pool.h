@@ -0,0 +1,99 @@
+#ifndef _phtree_thread_pool_h_
+#define _phtree_thread_pool_h_
+/*
+ * a work stealing thread pool for running tree traversals in parallel
+ *
+ * every worker has its own deque of tasks
+ * 	a worker takes tasks from the bottom of its own deque (newest first)
+ * 	when its own deque is empty it steals from the top of other workers' deques (oldest first)
+ * tasks submitted from a worker go on that worker's deque
+ * 	tasks submitted from any other thread are spread across the workers
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// the pool allocates with phtree_calloc/phtree_realloc/phtree_free
+// 	include phtree64_common.h before here for 64 bit keys
+#include "phtree32_common.h"
+
+/*
+ * worker is the index of the worker running the task
+ * 	0 <= worker < thread_count
+ * 	use it to pick per thread data without needing atomics
+ */
+typedef void (*phtree_task_function_t) (void* argument, int worker);
+
+typedef struct phtree_task_t
+{
+	phtree_task_function_t function;
+	void* argument;
+} phtree_task_t;
+
+typedef struct phtree_task_deque_t
+{
+	pthread_mutex_t lock;
+	// ring buffer of tasks
+	// 	top is the oldest task, top + count - 1 is the newest
+	phtree_task_t* tasks;
+	size_t top;
+	size_t count;
+	size_t capacity;
+} phtree_task_deque_t;
+
+typedef struct phtree_thread_pool_t phtree_thread_pool_t;
+
+typedef struct phtree_worker_t
+{
+	phtree_thread_pool_t* pool;
+	pthread_t thread;
+	int index;
+	phtree_task_deque_t deque;
+} phtree_worker_t;
+
+struct phtree_thread_pool_t
+{
+	phtree_worker_t* workers;
+	int thread_count;
+
+	// tasks which have been submitted but not taken by a worker yet
+	atomic_size_t queued;
+	// tasks which have been submitted but not finished yet
+	atomic_size_t pending;
+	// where the next task from outside the pool goes
+	atomic_uint next_worker;
+	atomic_bool shutdown;
+
+	// idle workers sleep on work_available
+	// 	threads in phtree_thread_pool_wait sleep on work_done
+	pthread_mutex_t lock;
+	pthread_cond_t work_available;
+	pthread_cond_t work_done;
+};
+
+/*
+ * start a pool with thread_count workers
+ * 	thread_count <= 0 uses one worker
+ *
+ * returns NULL on failure
+ */
+phtree_thread_pool_t* phtree_thread_pool_create (int thread_count);
+/*
+ * wait for every task to finish, then stop the workers and free the pool
+ */
+void phtree_thread_pool_free (phtree_thread_pool_t* pool);
+/*
+ * queue function to be run on a worker with argument
+ *
+ * returns 0 on success
+ */
+int phtree_thread_pool_submit (phtree_thread_pool_t* pool, phtree_task_function_t function, void* argument);
+/*
+ * wait until every submitted task, including tasks submitted by other tasks, has finished
+ * 	must not be called from inside a task
+ */
+void phtree_thread_pool_wait (phtree_thread_pool_t* pool);
+
+#endif  // end _phtree_thread_pool_h_
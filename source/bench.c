@@ -0,0 +1,510 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "pcg.h"
+#include "phtree32_2d.h"
+
+/*
+ * microbenchmarks for ph2 operations
+ *
+ * every distribution gets a fresh tree
+ * 	the same points are inserted, found, queried, iterated, and removed
+ * 	times are wall clock nanoseconds per operation
+ *
+ * usage: phtree_bench [point count] [seed]
+ */
+
+#define BENCH_POINTS_DEFAULT 1000000
+// points are generated inside of [0, BENCH_RANGE) in both dimensions
+#define BENCH_RANGE (1 << 20)
+#define BENCH_QUERIES 10000
+#define BENCH_CLUSTERS 32
+// entries written per ph2_query_collect call
+#define BENCH_COLLECT_CAPACITY 256
+// delta windows move this far in both dimensions every step
+#define BENCH_DELTA_STEP 8
+#define BENCH_DELTA_STEPS 100
+// ops per ph2_apply_batch
+#define BENCH_BATCH_SIZE 4096
+// the box rows turn every point in to the segment [x, x + y % BENCH_SEGMENT_LENGTH]
+#define BENCH_SEGMENT_LENGTH 16
+
+typedef struct
+{
+	int32_t x;
+	int32_t y;
+} bench_point_t;
+
+typedef enum
+{
+	DISTRIBUTION_UNIFORM,
+	DISTRIBUTION_CLUSTERED,
+	DISTRIBUTION_SEQUENTIAL,
+	DISTRIBUTION_COUNT,
+} distribution_t;
+
+static const char* distribution_names[DISTRIBUTION_COUNT] =
+{
+	"uniform",
+	"clustered",
+	"sequential",
+};
+
+// query windows are squares with sides this long
+static const int32_t window_sizes[] = {64, 1024, 16384};
+
+/*
+ * elements are the points themselves
+ * 	so the benchmark measures the tree and not malloc
+ */
+static void* element_create (void* input)
+{
+	return input;
+}
+
+static void point_convert (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	bench_point_t* point = input;
+
+	ph2_point_set (tree, out, &point->x, &point->y);
+}
+
+/*
+ * the 2d tree holds 1d boxes
+ * 	a segment is its min and max as one point
+ */
+static void segment_convert (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	bench_point_t* point = input;
+	int32_t max = point->x + point->y % BENCH_SEGMENT_LENGTH;
+
+	ph2_point_set (tree, out, &point->x, &max);
+}
+
+static void segment_box_convert (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	ph2_point_box_set (tree, out, input);
+}
+
+static void pair_count (void* element_a, void* element_b, void* data)
+{
+	(void) element_a;
+	(void) element_b;
+
+	(*(size_t*) data)++;
+}
+
+static void element_count (void* element, void* data)
+{
+	(void) element;
+
+	(*(size_t*) data)++;
+}
+
+static uint64_t time_now ()
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t) now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+/*
+ * peak resident memory of the process in KB
+ */
+static long peak_rss ()
+{
+	struct rusage usage;
+
+	getrusage (RUSAGE_SELF, &usage);
+
+	return usage.ru_maxrss;
+}
+
+/*
+ * a point close to a cluster center
+ * 	the sum of 4 uniform offsets is roughly normally distributed
+ */
+static int32_t clustered_value (int32_t center)
+{
+	int32_t offset = 0;
+
+	for (int iter = 0; iter < 4; iter++)
+	{
+		offset += (int32_t) pcg32_boundedrand (4096) - 2048;
+	}
+
+	int32_t value = center + offset;
+
+	if (value < 0)
+	{
+		return 0;
+	}
+
+	if (value >= BENCH_RANGE)
+	{
+		return BENCH_RANGE - 1;
+	}
+
+	return value;
+}
+
+static void points_generate (bench_point_t* points, size_t count, distribution_t distribution)
+{
+	bench_point_t centers[BENCH_CLUSTERS];
+
+	for (int iter = 0; iter < BENCH_CLUSTERS; iter++)
+	{
+		centers[iter].x = pcg32_boundedrand (BENCH_RANGE);
+		centers[iter].y = pcg32_boundedrand (BENCH_RANGE);
+	}
+
+	// sequential points fill a square grid row by row
+	size_t side = 1;
+
+	while (side * side < count)
+	{
+		side++;
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		switch (distribution)
+		{
+			case DISTRIBUTION_UNIFORM:
+				points[iter].x = pcg32_boundedrand (BENCH_RANGE);
+				points[iter].y = pcg32_boundedrand (BENCH_RANGE);
+				break;
+			case DISTRIBUTION_CLUSTERED:
+			{
+				bench_point_t* center = &centers[pcg32_boundedrand (BENCH_CLUSTERS)];
+
+				points[iter].x = clustered_value (center->x);
+				points[iter].y = clustered_value (center->y);
+				break;
+			}
+			case DISTRIBUTION_SEQUENTIAL:
+				points[iter].x = iter % side;
+				points[iter].y = iter / side;
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+static void report (distribution_t distribution, const char* operation, size_t count, uint64_t nanoseconds, const char* note)
+{
+	double per_operation = count ? (double) nanoseconds / count : 0.0;
+	double per_second = nanoseconds ? (double) count * 1e9 / nanoseconds : 0.0;
+
+	printf ("%-11s %-20s %10zu %12.1f %14.0f %12ld  %s\n",
+		distribution_names[distribution],
+		operation,
+		count,
+		per_operation,
+		per_second,
+		peak_rss (),
+		note ? note : "");
+}
+
+/*
+ * intersect queries and the self join on a tree of segments
+ */
+static int benchmark_boxes (distribution_t distribution, bench_point_t* points, bench_point_t* windows, size_t count)
+{
+	ph2_t* tree = ph2_create (element_create, NULL, phtree_int32_to_key, segment_convert, segment_box_convert, NULL);
+
+	if (!tree)
+	{
+		return 1;
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		ph2_insert (tree, &points[iter]);
+	}
+
+	char note[64];
+	size_t results = 0;
+	uint64_t start = time_now ();
+
+	for (size_t iter = 0; iter < BENCH_QUERIES; iter++)
+	{
+		int32_t min = windows[iter].x;
+		int32_t max = min + window_sizes[0];
+		ph2_query_t query;
+
+		ph2_query_box_set (tree, &query, true, &min, &max, element_count);
+		ph2_query (tree, &query, &results);
+	}
+
+	uint64_t elapsed = time_now () - start;
+
+	snprintf (note, sizeof (note), "%.1f results/query", (double) results / BENCH_QUERIES);
+	report (distribution, "box intersect", BENCH_QUERIES, elapsed, note);
+
+	size_t pairs = 0;
+	start = time_now ();
+	ph2_box_pairs (tree, pair_count, &pairs);
+	elapsed = time_now () - start;
+
+	// reported per segment in the tree
+	snprintf (note, sizeof (note), "%zu pairs", pairs);
+	report (distribution, "box pairs", count, elapsed, note);
+
+	ph2_free (tree);
+
+	return 0;
+}
+
+static int benchmark (distribution_t distribution, size_t count)
+{
+	bench_point_t* points = calloc (count, sizeof (*points));
+	bench_point_t* windows = calloc (BENCH_QUERIES, sizeof (*windows));
+
+	if (!points || !windows)
+	{
+		free (points);
+		free (windows);
+		return 1;
+	}
+
+	points_generate (points, count, distribution);
+
+	// query windows start at points which are in the tree
+	// 	so queries on the clustered and sequential distributions are not mostly empty
+	for (size_t iter = 0; iter < BENCH_QUERIES; iter++)
+	{
+		windows[iter] = points[pcg32_boundedrand (count)];
+	}
+
+	ph2_t* tree = ph2_create (element_create, NULL, phtree_int32_to_key, point_convert, NULL, NULL);
+
+	if (!tree)
+	{
+		free (points);
+		free (windows);
+		return 1;
+	}
+
+	uint64_t start = time_now ();
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		ph2_insert (tree, &points[iter]);
+	}
+
+	uint64_t elapsed = time_now () - start;
+	ph2_tree_info_t info;
+	char note[64];
+
+	ph2_analyze (tree, &info);
+	snprintf (note, sizeof (note), "%.2f fill, %zu KB children", info.fill_ratio, info.children_bytes / 1024);
+	report (distribution, "insert", count, elapsed, note);
+
+	size_t found = 0;
+	start = time_now ();
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		found += ph2_find (tree, &points[iter]) != NULL;
+	}
+
+	report (distribution, "find", count, time_now () - start, NULL);
+
+	// the same finds starting from the path of the last one
+	ph2_cursor_t cursor;
+
+	ph2_cursor_initialize (tree, &cursor);
+	start = time_now ();
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		found += ph2_cursor_find (&cursor, &points[iter]) != NULL;
+	}
+
+	report (distribution, "cursor find", count, time_now () - start, NULL);
+
+	for (size_t size = 0; size < sizeof (window_sizes) / sizeof (window_sizes[0]); size++)
+	{
+		char operation[32];
+		size_t results = 0;
+
+		snprintf (operation, sizeof (operation), "query %d", window_sizes[size]);
+		start = time_now ();
+
+		for (size_t iter = 0; iter < BENCH_QUERIES; iter++)
+		{
+			bench_point_t min = windows[iter];
+			bench_point_t max = {min.x + window_sizes[size], min.y + window_sizes[size]};
+			ph2_query_t query;
+
+			ph2_query_set (tree, &query, &min, &max, element_count);
+			ph2_query (tree, &query, &results);
+		}
+
+		elapsed = time_now () - start;
+
+		snprintf (note, sizeof (note), "%.1f results/query", (double) results / BENCH_QUERIES);
+		report (distribution, operation, BENCH_QUERIES, elapsed, note);
+
+		// the same windows written in to a buffer instead of through the callback
+		ph2_entry_t* entries[BENCH_COLLECT_CAPACITY];
+		ph2_query_iterator_t iterator;
+		size_t collected = 0;
+
+		snprintf (operation, sizeof (operation), "collect %d", window_sizes[size]);
+		start = time_now ();
+
+		for (size_t iter = 0; iter < BENCH_QUERIES; iter++)
+		{
+			bench_point_t min = windows[iter];
+			bench_point_t max = {min.x + window_sizes[size], min.y + window_sizes[size]};
+			ph2_query_t query;
+			size_t written;
+
+			ph2_query_set (tree, &query, &min, &max, NULL);
+			int more = ph2_query_collect (tree, &query, entries, BENCH_COLLECT_CAPACITY, &written, &iterator);
+			collected += written;
+
+			while (more)
+			{
+				more = ph2_query_iterator_collect (&iterator, entries, BENCH_COLLECT_CAPACITY, &written);
+				collected += written;
+			}
+		}
+
+		elapsed = time_now () - start;
+
+		snprintf (note, sizeof (note), "%.1f results/query", (double) collected / BENCH_QUERIES);
+		report (distribution, operation, BENCH_QUERIES, elapsed, note);
+
+		// windows which slide a little every step, jumping to a new start every BENCH_DELTA_STEPS
+		ph2_query_t previous;
+		size_t changes = 0;
+
+		snprintf (operation, sizeof (operation), "delta %d", window_sizes[size]);
+		start = time_now ();
+
+		for (size_t iter = 0; iter < BENCH_QUERIES; iter++)
+		{
+			bench_point_t min = windows[iter / BENCH_DELTA_STEPS];
+			int32_t offset = (iter % BENCH_DELTA_STEPS) * BENCH_DELTA_STEP;
+
+			min.x += offset;
+			min.y += offset;
+
+			bench_point_t max = {min.x + window_sizes[size], min.y + window_sizes[size]};
+			ph2_query_t query;
+
+			ph2_query_set (tree, &query, &min, &max, NULL);
+
+			if (iter % BENCH_DELTA_STEPS)
+			{
+				ph2_query_delta (tree, &previous, &query, element_count, element_count, &changes);
+			}
+
+			previous = query;
+		}
+
+		elapsed = time_now () - start;
+
+		snprintf (note, sizeof (note), "%.1f changes/query", (double) changes / BENCH_QUERIES);
+		report (distribution, operation, BENCH_QUERIES, elapsed, note);
+	}
+
+	size_t visited = 0;
+	start = time_now ();
+	ph2_for_each (tree, element_count, &visited);
+	// for_each is reported per element visited
+	report (distribution, "for_each", visited, time_now () - start, NULL);
+
+	start = time_now ();
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		ph2_remove (tree, &points[iter]);
+	}
+
+	report (distribution, "remove", count, time_now () - start, ph2_empty (tree) ? NULL : "tree not empty after remove");
+
+	// the same inserts and removes again, BENCH_BATCH_SIZE at a time
+	ph2_batch_op_t* ops = calloc (BENCH_BATCH_SIZE, sizeof (*ops));
+
+	if (ops)
+	{
+		for (int type = PH2_BATCH_INSERT; type <= PH2_BATCH_REMOVE; type++)
+		{
+			start = time_now ();
+
+			for (size_t batch = 0; batch < count; batch += BENCH_BATCH_SIZE)
+			{
+				size_t batch_count = (count - batch < BENCH_BATCH_SIZE) ? count - batch : BENCH_BATCH_SIZE;
+
+				for (size_t iter = 0; iter < batch_count; iter++)
+				{
+					ops[iter] = (ph2_batch_op_t) {type, &points[batch + iter], NULL};
+				}
+
+				ph2_apply_batch (tree, ops, batch_count);
+			}
+
+			report (distribution, (type == PH2_BATCH_INSERT) ? "batch insert" : "batch remove", count, time_now () - start, NULL);
+		}
+
+		free (ops);
+	}
+
+	ph2_free (tree);
+
+	int result = benchmark_boxes (distribution, points, windows, count);
+
+	free (points);
+	free (windows);
+
+	return result;
+}
+
+int main (int argc, char** argv)
+{
+	size_t count = BENCH_POINTS_DEFAULT;
+	uint64_t seed = 42;
+
+	if (argc > 1)
+	{
+		count = strtoull (argv[1], NULL, 10);
+	}
+
+	if (argc > 2)
+	{
+		seed = strtoull (argv[2], NULL, 10);
+	}
+
+	if (count == 0)
+	{
+		fprintf (stderr, "usage: %s [point count] [seed]\n", argv[0]);
+		return 1;
+	}
+
+	pcg32_srandom (seed, 54);
+
+	printf ("%-11s %-20s %10s %12s %14s %12s\n", "points", "operation", "count", "ns/op", "ops/s", "peak rss KB");
+
+	for (int distribution = 0; distribution < DISTRIBUTION_COUNT; distribution++)
+	{
+		if (benchmark (distribution, count))
+		{
+			fprintf (stderr, "out of memory\n");
+			return 1;
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cell.h"
+
+float cell_size = 64.0f;
+
+/*
+ * convert a raylib Vector2 to a phtree point
+ *
+ * we divide the input point by cell_size
+ * 	and floor the fractional part
+ * 	the divided, floored, input point is the address of the cell the point will be put in
+ */
+
+/*
+ * cell initialization function for the phtree
+ * 	cells live in the tree's element pool
+ * 		so this only fills in a zeroed cell instead of allocating one
+ */
+void cell_initialize (void* cell_in, void* input)
+{
+	cell_t* cell = cell_in;
+	Vector2* vector = input;
+
+	cvector_init (cell->points, 2, NULL);
+
+	cell->x = floorf (vector->x / cell_size);
+	cell->y = floorf (vector->y / cell_size);
+}
+
+/*
+ * cell destruction function for the phtree
+ * 	the tree frees the cell itself
+ */
+void cell_destroy (void* cell_in)
+{
+	cell_t* cell = cell_in;
+
+	cvector_free (cell->points);
+}
+
+/*
+ * convert a float to a cell key in the phtree
+ *
+ * we divide the input point by cell_size
+ * 	and floor the fractional part
+ * 	the divided, truncated, input value is part of the address
+ * 		of the cell the point will be put in
+ */
+phtree_key_t float_to_key (void* input)
+{
+	// floor so that negative numbers end up in the correct cell
+	int value = floorf (*(float*) input / cell_size);
+	phtree_key_t out = 0;
+
+	memcpy (&out, &value, sizeof (phtree_key_t));
+	// TODO
+	// 	PHTREE_SIGN_BIT
+	out ^= (PHTREE_KEY_ONE << (PHTREE_BIT_WIDTH - 1));  // flip sign bit
+
+	return out;
+}
+
+/*
+ * convert a Vector2 to a point in the phtree
+ */
+void vector2_to_tree (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	Vector2* vector = input;
+	// float_to_key will be called on vector->x/y inside of ph2_point_set
+	// 	because we set tree->convert_to_key to float_to_key
+	ph2_point_set (tree, out, &vector->x, &vector->y);
+}
+
+ph2_t* cell_tree_create ()
+{
+	ph2_options_t options;
+
+	ph2_options_default (&options);
+	options.element_size = sizeof (cell_t);
+	options.element_initialize = cell_initialize;
+
+	return ph2_create (NULL, cell_destroy, float_to_key, vector2_to_tree, NULL, &options);
+}
+
+int tree_insert_point (ph2_t* tree, point_t* point)
+{
+	// the tree only cares about a point's position
+	cell_t* cell = ph2_insert (tree, &point->position);
+
+	if (!cell)
+	{
+		return 1;
+	}
+
+	cvector_push_back (cell->points, point->id);
+
+	return 0;
+}
+
+void tree_remove_point (ph2_t* tree, point_t* point)
+{
+	cell_t* cell = ph2_find (tree, &point->position);
+
+	if (!cell)
+	{
+		return;
+	}
+
+	for (size_t iter = 0; iter < cvector_size (cell->points); iter++)
+	{
+		if (cell->points[iter] == point->id)
+		{
+			// the order of points inside of a cell does not matter
+			cell->points[iter] = cell->points[cvector_size (cell->points) - 1];
+			cvector_pop_back (cell->points);
+			break;
+		}
+	}
+
+	if (cvector_empty (cell->points))
+	{
+		ph2_remove (tree, &point->position);
+	}
+}
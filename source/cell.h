@@ -0,0 +1,56 @@
+#ifndef _cell_h_
+#define _cell_h_
+/*
+ * the way the demo uses the phtree
+ * 	shared by the demo and the stress test
+ *
+ * phtree entries are cells which represent cell_size x cell_size squares
+ * 	every point is kept in the cell it is inside of, by id
+ * 		a spatial hash
+ *
+ * only the Vector2 type is taken from raylib
+ * 	so this does not need raylib to be linked in
+ */
+
+#include "raylib.h"
+#include "cvector.h"
+#include "phtree32_2d.h"
+
+typedef struct
+{
+	int id;
+	Vector2 position;
+} point_t;
+
+typedef struct
+{
+	int x;
+	int y;
+	cvector (int) points;
+} cell_t;
+
+// width and height of every cell in the tree
+// 	convert_to_key has no way to carry this, so it is shared by every cell tree
+extern float cell_size;
+
+void cell_initialize (void* cell_in, void* input);
+void cell_destroy (void* cell_in);
+phtree_key_t float_to_key (void* input);
+void vector2_to_tree (ph2_t* tree, ph2_point_t* out, void* input);
+
+/*
+ * a tree of cells which keeps its cells in its element pool
+ */
+ph2_t* cell_tree_create ();
+/*
+ * returns 1 if the point's cell could not be inserted
+ * 	the point is then not in the tree
+ */
+int tree_insert_point (ph2_t* tree, point_t* point);
+/*
+ * point needs to be where it was inserted
+ * 	cells are removed from the tree once they have no points left
+ */
+void tree_remove_point (ph2_t* tree, point_t* point);
+
+#endif  // end _cell_h_
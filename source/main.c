@@ -10,6 +10,8 @@
 #include "pcg.h"
 #include "phtree32_2d.h"
 
+#include "cell.h"
+
 
 /*
  * this demo hides (ish) direct interaction with the phtree
@@ -20,19 +22,6 @@
  * 	but, whatever, we're all learning here :)
  */
 
-typedef struct
-{
-	int id;
-	Vector2 position;
-} point_t;
-
-typedef struct
-{
-	int x;
-	int y;
-	cvector (int) points;
-} cell_t;
-
 typedef struct
 {
 	Vector2 min;
@@ -46,93 +35,6 @@ typedef struct
 int screen_width = 1024;
 int screen_height = 1024;
 
-/*
- * convert a raylib Vector2 to a phtree point
- *
- * phtree entries are cells which represent 64x64 pixel squares
- * 	we divide the input point by 64
- * 	and floor the fractional part
- * 	the divided, floored, input point is the address of the cell the point will be put in
- * 		a spatial hash
- */
-
-/*
- * cell creation function for the phtree
- */
-void* cell_create (void* input)
-{
-	cell_t* new_cell = calloc (1, sizeof (*new_cell));
-
-	if (!new_cell)
-	{
-		return NULL;
-	}
-
-	cvector_init (new_cell->points, 2, NULL);
-
-	Vector2* vector = input;
-
-	new_cell->x = floorf (vector->x / 64.0f);
-	new_cell->y = floorf (vector->y / 64.0f);
-
-	return new_cell;
-}
-
-/*
- * cell destruction function for the phtree
- */
-void cell_destroy (void* cell_in)
-{
-	cell_t* cell = cell_in;
-
-	cvector_free (cell->points);
-	free (cell);
-}
-
-/*
- * convert a float to a cell key in the phtree
- *
- * phtree entries are cells which represent 64x64 pixel squares
- * 	we divide the input point by 64
- * 	and floor the fractional part
- * 	the divided, truncated, input value is part of the address
- * 		of the cell the point will be put in
- */
-phtree_key_t float_to_key (void* input)
-{
-	// cells are 64 pixels wide/tall
-	// 	so we divide by 64
-	// 	and floor so that negative numbers end up in the correct cell
-	int value = floorf (*(float*) input / 64.0f);
-	phtree_key_t out = 0;
-
-	memcpy (&out, &value, sizeof (phtree_key_t));
-	// TODO
-	// 	PHTREE_SIGN_BIT
-	out ^= (PHTREE_KEY_ONE << (PHTREE_BIT_WIDTH - 1));  // flip sign bit
-
-	return out;
-}
-
-/*
- * convert a Vector2 to a point in the phtree
- */
-void vector2_to_tree (ph2_t* tree, ph2_point_t* out, void* input)
-{
-	Vector2* vector = input;
-	// float_to_key will be called on vector->x/y inside of ph2_point_set
-	// 	because we set tree->convert_to_key to float_to_key
-	ph2_point_set (tree, out, &vector->x, &vector->y);
-}
-
-void tree_insert_point (ph2_t* tree, point_t* point)
-{
-	// the tree only cares about a point's position
-	cell_t* cell = ph2_insert (tree, &point->position);
-
-	cvector_push_back (cell->points, point->id);
-}
-
 void query_initialize (demo_query_t* query, ph2_t* tree, Vector2* min, Vector2* max, phtree_iteration_function_t function)
 {
 	query->min = *min;
@@ -198,7 +100,7 @@ int main ()
 
 	Font font = LoadFontEx ("resources/fonts/dejavu-mono-2.37/ttf/DejaVuSansMono.ttf", 32, NULL, 0);
 
-	ph2_t* tree = ph2_create (cell_create, cell_destroy, float_to_key, vector2_to_tree, NULL);
+	ph2_t* tree = cell_tree_create ();
 
 	cvector (point_t) points = NULL;
 	cvector_init (points, 500, NULL);
@@ -305,12 +207,12 @@ int main ()
 					int x = box_query.cells[iter]->x;
 					int y = box_query.cells[iter]->y;
 
-					DrawRectangle (x * 64, y * 64, 64, 64, selection_color);
+					DrawRectangle (x * cell_size, y * cell_size, cell_size, cell_size, selection_color);
 
 					char entry_id[16] = {0};
 
 					sprintf (entry_id, "{%i,%i}", x, y);
-					DrawTextEx (font, entry_id, (Vector2) {x * 64, y * 64}, 16, 1.0f, BLACK);
+					DrawTextEx (font, entry_id, (Vector2) {x * cell_size, y * cell_size}, 16, 1.0f, BLACK);
 
 					for (int jter = 0; jter < cvector_size (box_query.cells[iter]->points); jter++)
 					{
@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "cvector.h"
+#include "pcg.h"
+#include "phtree32_2d.h"
+
+#include "cell.h"
+
+/*
+ * headless load test of the demo's cell tree
+ *
+ * every tick
+ * 	moving points take a small random step, changing cells when they cross a cell edge
+ * 	churned points are removed and inserted again somewhere random
+ * 	queries look up the cells in a random window
+ * 		and check every point of those cells against the window, like the demo does
+ *
+ * every report interval prints tick and query latency percentiles for the interval
+ * 	and how much memory the process and the tree are using
+ * 		memory which keeps growing while the point count stays the same is fragmentation or a leak
+ *
+ * usage: phtree_stress [-n points] [-w world size] [-c cell size] [-t ticks]
+ * 	[-m moving points per tick] [-v step size] [-r churned points per tick]
+ * 	[-q queries per tick] [-s query size] [-i report interval] [-S seed]
+ */
+
+#define STRESS_POINTS_DEFAULT 1000000
+#define STRESS_WORLD_DEFAULT 65536.0f
+#define STRESS_TICKS_DEFAULT 1000
+#define STRESS_QUERIES_DEFAULT 1000
+#define STRESS_QUERY_SIZE_DEFAULT 1024.0f
+#define STRESS_INTERVAL_DEFAULT 100
+
+typedef struct
+{
+	size_t points;
+	float world;
+	size_t ticks;
+	// per tick
+	size_t moving;
+	float step;
+	size_t churn;
+	size_t queries;
+	float query_size;
+	size_t interval;
+	uint64_t seed;
+} stress_config_t;
+
+typedef struct
+{
+	point_t* points;
+	Vector2 min;
+	Vector2 max;
+	size_t hits;
+} stress_query_t;
+
+static uint64_t time_now ()
+{
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return ((uint64_t) now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+/*
+ * resident memory of the process right now in KB
+ * 	0 where /proc is not available
+ */
+static long current_rss ()
+{
+	FILE* file = fopen ("/proc/self/statm", "r");
+	// statm starts with the total size, then the resident size, both in pages
+	long size = 0;
+	long pages = 0;
+
+	if (!file)
+	{
+		return 0;
+	}
+
+	if (fscanf (file, "%ld %ld", &size, &pages) != 2)
+	{
+		pages = 0;
+	}
+
+	fclose (file);
+
+	return pages * (sysconf (_SC_PAGESIZE) / 1024);
+}
+
+static long peak_rss ()
+{
+	struct rusage usage;
+
+	getrusage (RUSAGE_SELF, &usage);
+
+	return usage.ru_maxrss;
+}
+
+static float random_float (float range)
+{
+	float value = (float) ((double) pcg32_random () / 4294967296.0 * range);
+
+	// rounding can land right on range
+	return (value < range) ? value : 0.0f;
+}
+
+static float clamp (float value, float min, float max)
+{
+	return (value < min) ? min : ((value > max) ? max : value);
+}
+
+static bool same_cell (Vector2* a, Vector2* b)
+{
+	return floorf (a->x / cell_size) == floorf (b->x / cell_size) && floorf (a->y / cell_size) == floorf (b->y / cell_size);
+}
+
+static int compare_u64 (const void* a_in, const void* b_in)
+{
+	uint64_t a = *(const uint64_t*) a_in;
+	uint64_t b = *(const uint64_t*) b_in;
+
+	return (a > b) - (a < b);
+}
+
+/*
+ * percentile of sorted values, fraction is 0 to 1
+ */
+static double percentile (uint64_t* sorted, size_t count, double fraction)
+{
+	if (count == 0)
+	{
+		return 0.0;
+	}
+
+	size_t index = (size_t) ceil (fraction * count);
+
+	return (double) sorted[(index ? index : 1) - 1];
+}
+
+static void report_latencies (const char* name, uint64_t* values, size_t count)
+{
+	qsort (values, count, sizeof (*values), compare_u64);
+
+	printf ("  %-6s p50 %10.1f  p99 %10.1f  p999 %10.1f  max %10.1f us\n",
+		name,
+		percentile (values, count, 0.5) / 1000.0,
+		percentile (values, count, 0.99) / 1000.0,
+		percentile (values, count, 0.999) / 1000.0,
+		count ? values[count - 1] / 1000.0 : 0.0);
+}
+
+/*
+ * check every point of a cell against the window
+ * 	the same as the demo's CheckCollisionPointRec loop
+ */
+static void query_cell (void* element, void* data)
+{
+	cell_t* cell = element;
+	stress_query_t* query = data;
+
+	for (size_t iter = 0; iter < cvector_size (cell->points); iter++)
+	{
+		Vector2* position = &query->points[cell->points[iter]].position;
+
+		if (position->x >= query->min.x && position->x <= query->max.x && position->y >= query->min.y && position->y <= query->max.y)
+		{
+			query->hits++;
+		}
+	}
+}
+
+static int tick_move (ph2_t* tree, point_t* points, stress_config_t* config)
+{
+	for (size_t iter = 0; iter < config->moving; iter++)
+	{
+		point_t* point = &points[pcg32_boundedrand (config->points)];
+		Vector2 position =
+		{
+			clamp (point->position.x + random_float (2.0f * config->step) - config->step, 0.0f, config->world),
+			clamp (point->position.y + random_float (2.0f * config->step) - config->step, 0.0f, config->world),
+		};
+
+		// most steps stay inside of the cell, which the tree does not care about
+		if (same_cell (&position, &point->position))
+		{
+			point->position = position;
+			continue;
+		}
+
+		tree_remove_point (tree, point);
+		point->position = position;
+
+		if (tree_insert_point (tree, point))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int tick_churn (ph2_t* tree, point_t* points, stress_config_t* config)
+{
+	for (size_t iter = 0; iter < config->churn; iter++)
+	{
+		point_t* point = &points[pcg32_boundedrand (config->points)];
+
+		tree_remove_point (tree, point);
+		point->position = (Vector2) {random_float (config->world), random_float (config->world)};
+
+		if (tree_insert_point (tree, point))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static size_t tick_query (ph2_t* tree, point_t* points, stress_config_t* config, uint64_t* latencies)
+{
+	size_t hits = 0;
+
+	for (size_t iter = 0; iter < config->queries; iter++)
+	{
+		stress_query_t stress_query = {points, {0.0f, 0.0f}, {0.0f, 0.0f}, 0};
+		ph2_query_t query;
+
+		stress_query.min = (Vector2) {random_float (config->world), random_float (config->world)};
+		stress_query.max = (Vector2) {stress_query.min.x + config->query_size, stress_query.min.y + config->query_size};
+
+		uint64_t start = time_now ();
+
+		ph2_query_set (tree, &query, &stress_query.min, &stress_query.max, query_cell);
+		ph2_query (tree, &query, &stress_query);
+
+		latencies[iter] = time_now () - start;
+		hits += stress_query.hits;
+	}
+
+	return hits;
+}
+
+static void report_memory (ph2_t* tree, size_t points)
+{
+	ph2_tree_info_t info;
+
+	ph2_analyze (tree, &info);
+
+	printf ("  memory rss %ld KB, peak %ld KB, tree %zu KB, %zu cells, %.1f points/cell\n",
+		current_rss (),
+		peak_rss (),
+		info.total_bytes / 1024,
+		info.entry_count,
+		info.entry_count ? (double) points / info.entry_count : 0.0);
+}
+
+static int stress (stress_config_t* config)
+{
+	point_t* points = calloc (config->points, sizeof (*points));
+	uint64_t* tick_latencies = calloc (config->ticks, sizeof (*tick_latencies));
+	uint64_t* interval_ticks = calloc (config->interval, sizeof (*interval_ticks));
+	uint64_t* query_latencies = calloc (config->interval * (config->queries ? config->queries : 1), sizeof (*query_latencies));
+	ph2_t* tree = cell_tree_create ();
+
+	int result = 1;
+
+	if (!points || !tick_latencies || !interval_ticks || !query_latencies || !tree)
+	{
+		goto done;
+	}
+
+	uint64_t start = time_now ();
+
+	for (size_t iter = 0; iter < config->points; iter++)
+	{
+		points[iter].id = (int) iter;
+		points[iter].position = (Vector2) {random_float (config->world), random_float (config->world)};
+
+		if (tree_insert_point (tree, &points[iter]))
+		{
+			goto done;
+		}
+	}
+
+	printf ("insert %zu points: %.1f ns/point\n", config->points, (double) (time_now () - start) / config->points);
+	report_memory (tree, config->points);
+
+	size_t interval_start = 0;
+	size_t hits = 0;
+
+	for (size_t tick = 0; tick < config->ticks; tick++)
+	{
+		start = time_now ();
+
+		if (tick_move (tree, points, config) || tick_churn (tree, points, config))
+		{
+			goto done;
+		}
+
+		hits += tick_query (tree, points, config, &query_latencies[(tick - interval_start) * config->queries]);
+
+		tick_latencies[tick] = time_now () - start;
+
+		if (tick + 1 - interval_start == config->interval || tick + 1 == config->ticks)
+		{
+			size_t ticks = tick + 1 - interval_start;
+
+			printf ("ticks %zu to %zu: %.1f hits/query\n", interval_start + 1, tick + 1, config->queries ? (double) hits / (ticks * config->queries) : 0.0);
+			memcpy (interval_ticks, &tick_latencies[interval_start], ticks * sizeof (*interval_ticks));
+			report_latencies ("tick", interval_ticks, ticks);
+			report_latencies ("query", query_latencies, ticks * config->queries);
+			report_memory (tree, config->points);
+
+			interval_start = tick + 1;
+			hits = 0;
+		}
+	}
+
+	printf ("all %zu ticks:\n", config->ticks);
+	report_latencies ("tick", tick_latencies, config->ticks);
+	result = 0;
+
+done:
+	ph2_free (tree);
+	free (points);
+	free (tick_latencies);
+	free (interval_ticks);
+	free (query_latencies);
+
+	return result;
+}
+
+static void usage (const char* name)
+{
+	fprintf (stderr,
+		"usage: %s [-n points] [-w world size] [-c cell size] [-t ticks]\n"
+		"\t[-m moving points per tick] [-v step size] [-r churned points per tick]\n"
+		"\t[-q queries per tick] [-s query size] [-i report interval] [-S seed]\n",
+		name);
+}
+
+int main (int argc, char** argv)
+{
+	stress_config_t config =
+	{
+		.points = STRESS_POINTS_DEFAULT,
+		.world = STRESS_WORLD_DEFAULT,
+		.ticks = STRESS_TICKS_DEFAULT,
+		// moving and churn default to 1% and 0.1% of the points
+		.moving = SIZE_MAX,
+		.step = -1.0f,
+		.churn = SIZE_MAX,
+		.queries = STRESS_QUERIES_DEFAULT,
+		.query_size = STRESS_QUERY_SIZE_DEFAULT,
+		.interval = STRESS_INTERVAL_DEFAULT,
+		.seed = 42,
+	};
+	int option;
+
+	while ((option = getopt (argc, argv, "n:w:c:t:m:v:r:q:s:i:S:")) != -1)
+	{
+		switch (option)
+		{
+			case 'n': config.points = strtoull (optarg, NULL, 10); break;
+			case 'w': config.world = strtof (optarg, NULL); break;
+			case 'c': cell_size = strtof (optarg, NULL); break;
+			case 't': config.ticks = strtoull (optarg, NULL, 10); break;
+			case 'm': config.moving = strtoull (optarg, NULL, 10); break;
+			case 'v': config.step = strtof (optarg, NULL); break;
+			case 'r': config.churn = strtoull (optarg, NULL, 10); break;
+			case 'q': config.queries = strtoull (optarg, NULL, 10); break;
+			case 's': config.query_size = strtof (optarg, NULL); break;
+			case 'i': config.interval = strtoull (optarg, NULL, 10); break;
+			case 'S': config.seed = strtoull (optarg, NULL, 10); break;
+			default:
+				usage (argv[0]);
+				return 1;
+		}
+	}
+
+	// ids are ints in the demo's cells and points are picked with pcg32_boundedrand
+	if (config.points == 0 || config.points > INT32_MAX || !(config.world > 0.0f) || !(cell_size > 0.0f) || config.ticks == 0 || config.interval == 0)
+	{
+		usage (argv[0]);
+		return 1;
+	}
+
+	if (config.moving == SIZE_MAX)
+	{
+		config.moving = config.points / 100;
+	}
+
+	if (config.churn == SIZE_MAX)
+	{
+		config.churn = config.points / 1000;
+	}
+
+	// by default points cross a cell edge every few ticks
+	if (!(config.step >= 0.0f))
+	{
+		config.step = cell_size / 8.0f;
+	}
+
+	if (config.interval > config.ticks)
+	{
+		config.interval = config.ticks;
+	}
+
+	pcg32_srandom (config.seed, 54);
+
+	printf ("%zu points, world %.0f, cell %.1f, %zu ticks of %zu moving, %zu churned, %zu queries of %.0f\n",
+		config.points, config.world, cell_size, config.ticks, config.moving, config.churn, config.queries, config.query_size);
+
+	if (stress (&config))
+	{
+		fprintf (stderr, "out of memory\n");
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,329 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#include "pcg.h"
+#include "phtree32_2d.h"
+
+/*
+ * one writer and several readers on a tree in concurrent mode
+ * 	build it with -fsanitize=thread to have every race reported
+ *
+ * the writer makes random changes
+ * 	inserts, removes, relocates, compacts, and clears
+ * the readers find, query, collect, and run knn inside of read sections
+ * 	and check everything they are handed is a live element inside of what they asked for
+ * elements are poisoned when they are destroyed
+ * 	so a reader which sees one after it was freed usually fails even without a sanitizer
+ *
+ * usage: phtree_test_concurrent [writes] [seed]
+ * 	exits with 1 if any reader saw something wrong
+ */
+
+#define CONCURRENT_READERS 4
+#define CONCURRENT_WRITES_DEFAULT 100000
+// points are inside of [0, CONCURRENT_RANGE) in both dimensions
+#define CONCURRENT_RANGE 256
+#define CONCURRENT_KNN 8
+#define CONCURRENT_COLLECT 16
+// out of every CONCURRENT_CHANGE_KINDS writes
+#define CONCURRENT_CHANGE_KINDS 4096
+#define CONCURRENT_COMPACTS 4
+#define CONCURRENT_CLEARS 1
+
+#define ELEMENT_ALIVE 0x5eed
+#define ELEMENT_DEAD 0xdead
+
+typedef struct
+{
+	int32_t x;
+	int32_t y;
+} concurrent_point_t;
+
+/*
+ * readers only look at alive
+ * 	relocated elements keep their first point, so the point is never checked
+ */
+typedef struct
+{
+	atomic_int alive;
+} concurrent_element_t;
+
+typedef struct
+{
+	ph2_t* tree;
+	pcg32_random_t random;
+	long reads;
+	bool wrong;
+} concurrent_reader_t;
+
+static atomic_bool stop;
+
+static void* element_create (void* input)
+{
+	(void) input;
+
+	concurrent_element_t* element = malloc (sizeof (*element));
+
+	if (element)
+	{
+		atomic_init (&element->alive, ELEMENT_ALIVE);
+	}
+
+	return element;
+}
+
+static void element_destroy (void* element)
+{
+	atomic_store (&((concurrent_element_t*) element)->alive, ELEMENT_DEAD);
+	free (element);
+}
+
+static void point_convert (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	concurrent_point_t* point = input;
+
+	ph2_point_set (tree, out, &point->x, &point->y);
+}
+
+static bool element_alive (void* element)
+{
+	return element && atomic_load (&((concurrent_element_t*) element)->alive) == ELEMENT_ALIVE;
+}
+
+static concurrent_point_t random_point (pcg32_random_t* random)
+{
+	return (concurrent_point_t) {pcg32_boundedrand_r (random, CONCURRENT_RANGE), pcg32_boundedrand_r (random, CONCURRENT_RANGE)};
+}
+
+static bool entry_in_query (ph2_entry_t* entry, ph2_query_t* query)
+{
+	for (int dimension = 0; dimension < PH2_DIMENSIONS; dimension++)
+	{
+		if (entry->point.values[dimension] < query->min.values[dimension] || entry->point.values[dimension] > query->max.values[dimension])
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void query_element (void* element, void* data)
+{
+	*(bool*) data |= !element_alive (element);
+}
+
+/*
+ * one random read
+ * 	everything handed back is checked before the read section ends
+ */
+static void reader_read (concurrent_reader_t* reader)
+{
+	ph2_t* tree = reader->tree;
+	concurrent_point_t point = random_point (&reader->random);
+	int token = ph2_read_begin (tree);
+
+	switch (pcg32_boundedrand_r (&reader->random, 4))
+	{
+		case 0:
+		{
+			void* element = ph2_find (tree, &point);
+
+			reader->wrong |= element && !element_alive (element);
+			break;
+		}
+		case 1:
+		{
+			concurrent_point_t max = {point.x + 32, point.y + 32};
+			ph2_query_t query;
+
+			ph2_query_set (tree, &query, &point, &max, query_element);
+			ph2_query (tree, &query, &reader->wrong);
+			break;
+		}
+		case 2:
+		{
+			concurrent_point_t max = {point.x + 64, point.y + 64};
+			ph2_entry_t* entries[CONCURRENT_COLLECT];
+			ph2_query_iterator_t iterator;
+			ph2_query_t query;
+			size_t count;
+
+			ph2_query_set (tree, &query, &point, &max, NULL);
+
+			int more = ph2_query_collect (tree, &query, entries, CONCURRENT_COLLECT, &count, &iterator);
+
+			while (true)
+			{
+				for (size_t iter = 0; iter < count; iter++)
+				{
+					reader->wrong |= !element_alive (entries[iter]->element) || !entry_in_query (entries[iter], &query);
+				}
+
+				if (!more)
+				{
+					break;
+				}
+
+				more = ph2_query_iterator_collect (&iterator, entries, CONCURRENT_COLLECT, &count);
+			}
+
+			break;
+		}
+		case 3:
+		{
+			ph2_entry_t* entries[CONCURRENT_KNN];
+			ph2_point_t center;
+			size_t count = ph2_knn (tree, &point, CONCURRENT_KNN, NULL, entries);
+			double previous = 0.0;
+
+			point_convert (tree, &center, &point);
+
+			// closest first
+			for (size_t iter = 0; iter < count; iter++)
+			{
+				double distance = ph2_distance_euclidean (&entries[iter]->point, &center);
+
+				reader->wrong |= !element_alive (entries[iter]->element) || distance < previous;
+				previous = distance;
+			}
+
+			break;
+		}
+	}
+
+	ph2_read_end (tree, token);
+	reader->reads++;
+}
+
+static void* reader_run (void* argument)
+{
+	concurrent_reader_t* reader = argument;
+
+	while (!atomic_load (&stop) && !reader->wrong)
+	{
+		reader_read (reader);
+	}
+
+	return NULL;
+}
+
+static void writer_write (ph2_t* tree, pcg32_random_t* random)
+{
+	concurrent_point_t point = random_point (random);
+	uint32_t kind = pcg32_boundedrand_r (random, CONCURRENT_CHANGE_KINDS);
+
+	if (kind < CONCURRENT_CLEARS)
+	{
+		ph2_clear (tree);
+	}
+	else if (kind < CONCURRENT_CLEARS + CONCURRENT_COMPACTS)
+	{
+		ph2_compact (tree);
+	}
+	else if (kind % 4 == 0)
+	{
+		// a short move most of the time, so the two paths share most of their nodes
+		concurrent_point_t to = point;
+
+		to.x = (to.x + (int32_t) pcg32_boundedrand_r (random, 8)) % CONCURRENT_RANGE;
+
+		if (pcg32_boundedrand_r (random, 4) == 0)
+		{
+			to = random_point (random);
+		}
+
+		ph2_relocate (tree, &point, &to);
+	}
+	else if (kind % 4 == 1)
+	{
+		ph2_remove (tree, &point);
+	}
+	else
+	{
+		ph2_insert (tree, &point);
+	}
+}
+
+int main (int argc, char** argv)
+{
+	long writes = CONCURRENT_WRITES_DEFAULT;
+	uint64_t seed = 1;
+
+	if (argc > 1)
+	{
+		writes = strtol (argv[1], NULL, 10);
+	}
+
+	if (argc > 2)
+	{
+		seed = strtoull (argv[2], NULL, 10);
+	}
+
+	ph2_options_t options;
+
+	ph2_options_default (&options);
+	options.concurrent = true;
+
+	ph2_t* tree = ph2_create (element_create, element_destroy, phtree_int32_to_key, point_convert, NULL, &options);
+
+	if (!tree)
+	{
+		printf ("could not create the tree\n");
+		return 1;
+	}
+
+	concurrent_reader_t readers[CONCURRENT_READERS];
+	pthread_t threads[CONCURRENT_READERS];
+	int started = 0;
+
+	for (; started < CONCURRENT_READERS; started++)
+	{
+		readers[started] = (concurrent_reader_t) {tree, {0}, 0, false};
+		pcg32_srandom_r (&readers[started].random, seed, started + 1);
+
+		if (pthread_create (&threads[started], NULL, reader_run, &readers[started]))
+		{
+			break;
+		}
+	}
+
+	pcg32_random_t random;
+
+	pcg32_srandom_r (&random, seed, 0);
+
+	for (long iter = 0; iter < writes; iter++)
+	{
+		writer_write (tree, &random);
+	}
+
+	atomic_store (&stop, true);
+
+	long reads = 0;
+	bool wrong = false;
+
+	for (int iter = 0; iter < started; iter++)
+	{
+		pthread_join (threads[iter], NULL);
+		reads += readers[iter].reads;
+		wrong |= readers[iter].wrong;
+	}
+
+	ph2_free (tree);
+
+	printf ("%ld writes, %ld reads by %d readers\n", writes, reads, started);
+
+	if (wrong)
+	{
+		printf ("a reader saw a dead element or an entry outside of its window\n");
+		return 1;
+	}
+
+	printf ("ok\n");
+
+	return 0;
+}
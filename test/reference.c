@@ -0,0 +1,802 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pcg.h"
+#include "phtree32_2d.h"
+
+/*
+ * checks ph2 against a brute force copy of the same points
+ *
+ * every round makes random changes to the tree and to the copy
+ * 	single inserts, removes, and relocates, batches, compacts, clears, and bulk loads
+ * then compares what the tree returns with what the copy says it should
+ * 	window queries, counts, iterators, collects, finds, knn, and query deltas
+ * 	a saved and mapped copy of the tree every few rounds
+ * 	box pairs on a separate tree of segments
+ *
+ * every round is run on a default tree and again on a tree in concurrent mode
+ *
+ * usage: phtree_test_reference [seed]
+ * 	exits with 1 if anything did not match
+ */
+
+// points are inside of [0, REFERENCE_RANGE) in both dimensions
+#define REFERENCE_RANGE 512
+#define REFERENCE_ROUNDS 200
+#define REFERENCE_CHANGES 256
+#define REFERENCE_BATCH_MAX 64
+#define REFERENCE_WINDOWS 16
+#define REFERENCE_KNN_MAX 16
+#define REFERENCE_COLLECT_MAX 7
+// every this many rounds
+#define REFERENCE_COMPACT_ROUNDS 10
+#define REFERENCE_CLEAR_ROUNDS 50
+#define REFERENCE_MAP_ROUNDS 25
+#define REFERENCE_SEGMENTS 400
+#define REFERENCE_MAP_PATH "phtree_test_reference.map"
+
+typedef struct
+{
+	int32_t x;
+	int32_t y;
+} reference_point_t;
+
+typedef struct
+{
+	int32_t min;
+	int32_t max;
+} reference_segment_t;
+
+/*
+ * the points in the tree, in no order
+ * 	slots has the index + 1 of every point in points, 0 for points which are not in the tree
+ */
+static reference_point_t points[REFERENCE_RANGE * REFERENCE_RANGE];
+static size_t point_count;
+static uint32_t slots[REFERENCE_RANGE * REFERENCE_RANGE];
+
+static int failures;
+static int round_number;
+
+static void fail (const char* what)
+{
+	if (failures < 20)
+	{
+		printf ("round %d: %s\n", round_number, what);
+	}
+
+	failures++;
+}
+
+static uint32_t* point_slot (reference_point_t* point)
+{
+	return &slots[point->y * REFERENCE_RANGE + point->x];
+}
+
+static bool reference_has (reference_point_t* point)
+{
+	return *point_slot (point) != 0;
+}
+
+static void reference_insert (reference_point_t* point)
+{
+	if (reference_has (point))
+	{
+		return;
+	}
+
+	points[point_count] = *point;
+	point_count++;
+	*point_slot (point) = point_count;
+}
+
+static void reference_remove (reference_point_t* point)
+{
+	uint32_t* slot = point_slot (point);
+
+	if (*slot == 0)
+	{
+		return;
+	}
+
+	// the last point takes the place of the removed one
+	reference_point_t* last = &points[point_count - 1];
+
+	points[*slot - 1] = *last;
+	*point_slot (last) = *slot;
+	*slot = 0;
+	point_count--;
+}
+
+static void reference_clear ()
+{
+	for (size_t iter = 0; iter < point_count; iter++)
+	{
+		*point_slot (&points[iter]) = 0;
+	}
+
+	point_count = 0;
+}
+
+/*
+ * elements are copies of their point
+ * 	so query results can be checked without converting keys back
+ */
+static void* element_create (void* input)
+{
+	reference_point_t* element = malloc (sizeof (*element));
+
+	if (element)
+	{
+		*element = *(reference_point_t*) input;
+	}
+
+	return element;
+}
+
+static void point_convert (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	reference_point_t* point = input;
+
+	ph2_point_set (tree, out, &point->x, &point->y);
+}
+
+static size_t element_serialize (void* element, void* buffer)
+{
+	if (buffer)
+	{
+		memcpy (buffer, element, sizeof (reference_point_t));
+	}
+
+	return sizeof (reference_point_t);
+}
+
+static reference_point_t random_point ()
+{
+	return (reference_point_t) {pcg32_boundedrand (REFERENCE_RANGE), pcg32_boundedrand (REFERENCE_RANGE)};
+}
+
+/*
+ * a point near around, so batches have ops which share paths
+ */
+static reference_point_t random_point_near (reference_point_t* around)
+{
+	reference_point_t point = {around->x + (int32_t) pcg32_boundedrand (16) - 8, around->y + (int32_t) pcg32_boundedrand (16) - 8};
+
+	point.x = (point.x < 0) ? 0 : (point.x >= REFERENCE_RANGE) ? REFERENCE_RANGE - 1 : point.x;
+	point.y = (point.y < 0) ? 0 : (point.y >= REFERENCE_RANGE) ? REFERENCE_RANGE - 1 : point.y;
+
+	return point;
+}
+
+/*
+ * windows reach a little outside of the points on every side
+ * 	and are sometimes a single point
+ */
+static void random_window (reference_point_t* min, reference_point_t* max)
+{
+	int32_t size = pcg32_boundedrand (4) ? (int32_t) pcg32_boundedrand (REFERENCE_RANGE / 4) : 0;
+
+	min->x = (int32_t) pcg32_boundedrand (REFERENCE_RANGE + 32) - 16;
+	min->y = (int32_t) pcg32_boundedrand (REFERENCE_RANGE + 32) - 16;
+	max->x = min->x + size;
+	max->y = min->y + (pcg32_boundedrand (2) ? size : size / 2);
+}
+
+static bool point_in_window (reference_point_t* point, reference_point_t* min, reference_point_t* max)
+{
+	return point->x >= min->x && point->x <= max->x && point->y >= min->y && point->y <= max->y;
+}
+
+static size_t reference_count (reference_point_t* min, reference_point_t* max)
+{
+	size_t count = 0;
+
+	for (size_t iter = 0; iter < point_count; iter++)
+	{
+		count += point_in_window (&points[iter], min, max);
+	}
+
+	return count;
+}
+
+typedef struct
+{
+	reference_point_t min;
+	reference_point_t max;
+	// elements have to be outside of this window, when it is set
+	reference_point_t* outside_min;
+	reference_point_t* outside_max;
+	size_t count;
+	bool wrong;
+} window_check_t;
+
+static void window_element (void* element, void* data)
+{
+	window_check_t* check = data;
+	reference_point_t* point = element;
+
+	check->count++;
+	check->wrong |= !point_in_window (point, &check->min, &check->max) || !reference_has (point);
+
+	if (check->outside_min)
+	{
+		check->wrong |= point_in_window (point, check->outside_min, check->outside_max);
+	}
+}
+
+static void check_windows (ph2_t* tree)
+{
+	for (int window = 0; window < REFERENCE_WINDOWS; window++)
+	{
+		window_check_t check = {0};
+		ph2_query_t query;
+
+		random_window (&check.min, &check.max);
+
+		size_t expected = reference_count (&check.min, &check.max);
+
+		ph2_query_set (tree, &query, &check.min, &check.max, window_element);
+		ph2_query (tree, &query, &check);
+
+		if (check.wrong || check.count != expected)
+		{
+			fail ("query");
+		}
+
+		if (ph2_query_count (tree, &query) != expected)
+		{
+			fail ("query count");
+		}
+
+		// iterators need a read section in concurrent mode
+		int token = ph2_read_begin (tree);
+		ph2_query_iterator_t iterator;
+		window_check_t iterated = check;
+
+		iterated.count = 0;
+		ph2_query_iterator_initialize (tree, &query, &iterator);
+
+		for (ph2_entry_t* entry = ph2_query_iterator_next (&iterator); entry; entry = ph2_query_iterator_next (&iterator))
+		{
+			window_element (entry->element, &iterated);
+		}
+
+		if (iterated.wrong || iterated.count != expected)
+		{
+			fail ("query iterator");
+		}
+
+		// collect in to a buffer too small for most windows
+		ph2_entry_t* entries[REFERENCE_COLLECT_MAX];
+		size_t capacity = 1 + pcg32_boundedrand (REFERENCE_COLLECT_MAX);
+		window_check_t collected = check;
+		size_t written;
+
+		collected.count = 0;
+
+		int more = ph2_query_collect (tree, &query, entries, capacity, &written, &iterator);
+
+		while (true)
+		{
+			for (size_t iter = 0; iter < written; iter++)
+			{
+				window_element (entries[iter]->element, &collected);
+			}
+
+			if (!more)
+			{
+				break;
+			}
+
+			more = ph2_query_iterator_collect (&iterator, entries, capacity, &written);
+		}
+
+		ph2_read_end (tree, token);
+
+		if (collected.wrong || collected.count != expected)
+		{
+			fail ("query collect");
+		}
+
+		// the window moved a little
+		reference_point_t moved_min = {check.min.x + (int32_t) pcg32_boundedrand (64) - 32, check.min.y + (int32_t) pcg32_boundedrand (64) - 32};
+		reference_point_t moved_max = {moved_min.x + (check.max.x - check.min.x), moved_min.y + (check.max.y - check.min.y)};
+		window_check_t entered = {moved_min, moved_max, &check.min, &check.max, 0, false};
+		window_check_t exited = {check.min, check.max, &moved_min, &moved_max, 0, false};
+		size_t expected_entered = 0;
+		size_t expected_exited = 0;
+		ph2_query_t moved;
+
+		for (size_t iter = 0; iter < point_count; iter++)
+		{
+			bool in_old = point_in_window (&points[iter], &check.min, &check.max);
+			bool in_new = point_in_window (&points[iter], &moved_min, &moved_max);
+
+			expected_entered += in_new && !in_old;
+			expected_exited += in_old && !in_new;
+		}
+
+		ph2_query_set (tree, &moved, &moved_min, &moved_max, NULL);
+
+		// on_enter and on_exit get the same data, so they are counted in two passes
+		ph2_query_delta (tree, &query, &moved, window_element, NULL, &entered);
+		ph2_query_delta (tree, &query, &moved, NULL, window_element, &exited);
+
+		if (entered.wrong || exited.wrong || entered.count != expected_entered || exited.count != expected_exited)
+		{
+			fail ("query delta");
+		}
+	}
+}
+
+static int compare_doubles (const void* a, const void* b)
+{
+	double difference = *(const double*) a - *(const double*) b;
+
+	return (difference > 0) - (difference < 0);
+}
+
+static double point_distance (reference_point_t* a, reference_point_t* b)
+{
+	double x = (double) a->x - b->x;
+	double y = (double) a->y - b->y;
+
+	return x * x + y * y;
+}
+
+/*
+ * knn results are compared by distance
+ * 	points at the same distance can come back in any order
+ */
+static void check_knn (ph2_t* tree)
+{
+	static double distances[REFERENCE_RANGE * REFERENCE_RANGE];
+
+	for (int window = 0; window < REFERENCE_WINDOWS; window++)
+	{
+		reference_point_t center = random_point ();
+		size_t k = 1 + pcg32_boundedrand (REFERENCE_KNN_MAX);
+		ph2_entry_t* out[REFERENCE_KNN_MAX];
+		size_t found = ph2_knn (tree, &center, k, NULL, out);
+
+		for (size_t iter = 0; iter < point_count; iter++)
+		{
+			distances[iter] = point_distance (&points[iter], &center);
+		}
+
+		qsort (distances, point_count, sizeof (distances[0]), compare_doubles);
+
+		if (found != ((k < point_count) ? k : point_count))
+		{
+			fail ("knn count");
+			continue;
+		}
+
+		for (size_t iter = 0; iter < found; iter++)
+		{
+			if (point_distance (out[iter]->element, &center) != distances[iter])
+			{
+				fail ("knn distance");
+				break;
+			}
+		}
+	}
+}
+
+static void check_points (ph2_t* tree)
+{
+	window_check_t all = {{INT32_MIN, INT32_MIN}, {INT32_MAX, INT32_MAX}, NULL, NULL, 0, false};
+
+	ph2_for_each (tree, window_element, &all);
+
+	if (all.wrong || all.count != point_count)
+	{
+		fail ("for_each");
+	}
+
+	if (ph2_empty (tree) != (point_count == 0))
+	{
+		fail ("empty");
+	}
+
+	for (int iter = 0; iter < REFERENCE_WINDOWS; iter++)
+	{
+		reference_point_t point = random_point ();
+		reference_point_t* element = ph2_find (tree, &point);
+
+		if ((element != NULL) != reference_has (&point) || (element && (element->x != point.x || element->y != point.y)))
+		{
+			fail ("find");
+		}
+	}
+}
+
+/*
+ * inserts, removes, and relocates one at a time
+ */
+static void change_single (ph2_t* tree)
+{
+	reference_point_t point = random_point ();
+	uint32_t kind = pcg32_boundedrand (8);
+
+	if (kind < 4)
+	{
+		reference_point_t* element = ph2_insert (tree, &point);
+
+		if (!element || element->x != point.x || element->y != point.y)
+		{
+			fail ("insert");
+		}
+
+		reference_insert (&point);
+	}
+	else if (kind < 7)
+	{
+		// remove a point which is in the tree most of the time
+		if (point_count && pcg32_boundedrand (4))
+		{
+			point = points[pcg32_boundedrand (point_count)];
+		}
+
+		ph2_remove (tree, &point);
+		reference_remove (&point);
+	}
+	else
+	{
+		if (point_count && pcg32_boundedrand (4))
+		{
+			point = points[pcg32_boundedrand (point_count)];
+		}
+
+		reference_point_t to = pcg32_boundedrand (2) ? random_point_near (&point) : random_point ();
+		bool same = point.x == to.x && point.y == to.y;
+		// moving a point on to itself works when it is in the tree
+		bool expected = reference_has (&point) && (same || !reference_has (&to));
+
+		if ((ph2_relocate (tree, &point, &to) == 0) != expected)
+		{
+			fail ("relocate");
+		}
+
+		if (expected && !same)
+		{
+			// the element is kept, it still has the old point in it
+			reference_point_t* element = ph2_find (tree, &to);
+
+			if (!element || element->x != point.x || element->y != point.y)
+			{
+				fail ("relocate element");
+			}
+			else
+			{
+				*element = to;
+			}
+
+			reference_remove (&point);
+			reference_insert (&to);
+		}
+	}
+}
+
+/*
+ * a batch of ops around a few centers
+ * 	the same point can be in a batch more than once
+ */
+static void change_batch (ph2_t* tree)
+{
+	ph2_batch_op_t ops[REFERENCE_BATCH_MAX];
+	reference_point_t inputs[REFERENCE_BATCH_MAX];
+	reference_point_t centers[4];
+	size_t count = 1 + pcg32_boundedrand (REFERENCE_BATCH_MAX);
+
+	for (int iter = 0; iter < 4; iter++)
+	{
+		centers[iter] = random_point ();
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		inputs[iter] = random_point_near (&centers[pcg32_boundedrand (4)]);
+		ops[iter] = (ph2_batch_op_t) {pcg32_boundedrand (3) ? PH2_BATCH_INSERT : PH2_BATCH_REMOVE, &inputs[iter], NULL};
+	}
+
+	if (ph2_apply_batch (tree, ops, count))
+	{
+		fail ("apply batch");
+	}
+
+	// the ops happen in input order
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		if (ops[iter].type == PH2_BATCH_INSERT)
+		{
+			reference_insert (&inputs[iter]);
+
+			if (!ops[iter].element)
+			{
+				fail ("batch insert element");
+			}
+		}
+		else
+		{
+			reference_remove (&inputs[iter]);
+		}
+	}
+}
+
+static void change_bulk_load (ph2_t* tree)
+{
+	static reference_point_t inputs[REFERENCE_CHANGES * 8];
+	static void* pointers[REFERENCE_CHANGES * 8];
+	size_t count = pcg32_boundedrand (REFERENCE_CHANGES * 8);
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		inputs[iter] = random_point ();
+		pointers[iter] = &inputs[iter];
+	}
+
+	if (ph2_bulk_load (tree, pointers, count))
+	{
+		fail ("bulk load");
+	}
+
+	for (size_t iter = 0; iter < count; iter++)
+	{
+		reference_insert (&inputs[iter]);
+	}
+}
+
+static void map_element (void* element, void* data)
+{
+	window_element (element, data);
+}
+
+/*
+ * the mapped copy of the tree has to answer the same as the tree
+ */
+static void check_map (ph2_t* tree)
+{
+	if (ph2_save (tree, REFERENCE_MAP_PATH, element_serialize))
+	{
+		fail ("save");
+		return;
+	}
+
+	ph2_map_t* map = ph2_map (REFERENCE_MAP_PATH);
+
+	if (!map)
+	{
+		fail ("map");
+		remove (REFERENCE_MAP_PATH);
+		return;
+	}
+
+	if (ph2_map_count (map) != point_count)
+	{
+		fail ("map count");
+	}
+
+	for (int window = 0; window < REFERENCE_WINDOWS; window++)
+	{
+		window_check_t check = {0};
+		ph2_query_t query;
+
+		random_window (&check.min, &check.max);
+		ph2_query_set (tree, &query, &check.min, &check.max, map_element);
+		ph2_map_query (map, &query, &check);
+
+		if (check.wrong || check.count != reference_count (&check.min, &check.max))
+		{
+			fail ("map query");
+		}
+
+		reference_point_t point = random_point ();
+		ph2_point_t key;
+
+		point_convert (tree, &key, &point);
+
+		reference_point_t* element = ph2_map_find (map, &key);
+
+		if ((element != NULL) != reference_has (&point) || (element && (element->x != point.x || element->y != point.y)))
+		{
+			fail ("map find");
+		}
+	}
+
+	ph2_unmap (map);
+	remove (REFERENCE_MAP_PATH);
+}
+
+/*
+ * segments are stored as the point (min, max)
+ */
+static void segment_convert (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	reference_segment_t* segment = input;
+
+	ph2_point_set (tree, out, &segment->min, &segment->max);
+}
+
+static void segment_box_convert (ph2_t* tree, ph2_point_t* out, void* input)
+{
+	ph2_point_box_set (tree, out, input);
+}
+
+static void* segment_create (void* input)
+{
+	reference_segment_t* element = malloc (sizeof (*element));
+
+	if (element)
+	{
+		*element = *(reference_segment_t*) input;
+	}
+
+	return element;
+}
+
+static bool segments_intersect (reference_segment_t* a, reference_segment_t* b)
+{
+	return a->min <= b->max && b->min <= a->max;
+}
+
+typedef struct
+{
+	size_t count;
+	bool wrong;
+} pair_check_t;
+
+static void pair_element (void* element_a, void* element_b, void* data)
+{
+	pair_check_t* check = data;
+
+	check->count++;
+	check->wrong |= element_a == element_b || !segments_intersect (element_a, element_b);
+}
+
+static void check_box_pairs (ph2_options_t* options)
+{
+	ph2_t* tree = ph2_create (segment_create, free, phtree_int32_to_key, segment_convert, segment_box_convert, options);
+	reference_segment_t segments[REFERENCE_SEGMENTS];
+	size_t count = 0;
+
+	if (!tree)
+	{
+		fail ("create segment tree");
+		return;
+	}
+
+	for (int iter = 0; iter < REFERENCE_SEGMENTS; iter++)
+	{
+		reference_segment_t segment;
+
+		segment.min = pcg32_boundedrand (REFERENCE_RANGE * 4);
+		segment.max = segment.min + pcg32_boundedrand (pcg32_boundedrand (4) ? 16 : REFERENCE_RANGE);
+
+		if (!ph2_insert (tree, &segment))
+		{
+			fail ("segment insert");
+		}
+
+		// the same segment twice is one entry
+		bool repeated = false;
+
+		for (size_t other = 0; other < count; other++)
+		{
+			repeated |= segments[other].min == segment.min && segments[other].max == segment.max;
+		}
+
+		if (!repeated)
+		{
+			segments[count] = segment;
+			count++;
+		}
+	}
+
+	size_t expected = 0;
+
+	for (size_t a = 0; a < count; a++)
+	{
+		for (size_t b = a + 1; b < count; b++)
+		{
+			expected += segments_intersect (&segments[a], &segments[b]);
+		}
+	}
+
+	pair_check_t check = {0};
+
+	ph2_box_pairs (tree, pair_element, &check);
+
+	if (check.wrong || check.count != expected)
+	{
+		fail ("box pairs");
+	}
+
+	ph2_free (tree);
+}
+
+static void run (ph2_options_t* options)
+{
+	ph2_t* tree = ph2_create (element_create, free, phtree_int32_to_key, point_convert, NULL, options);
+
+	if (!tree)
+	{
+		fail ("create");
+		return;
+	}
+
+	reference_clear ();
+
+	for (round_number = 0; round_number < REFERENCE_ROUNDS; round_number++)
+	{
+		if (round_number % REFERENCE_CLEAR_ROUNDS == REFERENCE_CLEAR_ROUNDS - 1)
+		{
+			ph2_clear (tree);
+			reference_clear ();
+			change_bulk_load (tree);
+		}
+
+		for (int change = 0; change < REFERENCE_CHANGES; change++)
+		{
+			if (pcg32_boundedrand (16))
+			{
+				change_single (tree);
+			}
+			else
+			{
+				change_batch (tree);
+			}
+		}
+
+		if (round_number % REFERENCE_COMPACT_ROUNDS == REFERENCE_COMPACT_ROUNDS - 1 && ph2_compact (tree))
+		{
+			fail ("compact");
+		}
+
+		check_points (tree);
+		check_windows (tree);
+		check_knn (tree);
+
+		if (round_number % REFERENCE_MAP_ROUNDS == REFERENCE_MAP_ROUNDS - 1)
+		{
+			check_map (tree);
+			check_box_pairs (options);
+		}
+	}
+
+	ph2_free (tree);
+}
+
+int main (int argc, char** argv)
+{
+	uint64_t seed = 1;
+
+	if (argc > 1)
+	{
+		seed = strtoull (argv[1], NULL, 10);
+	}
+
+	pcg32_srandom (seed, 1);
+
+	ph2_options_t options;
+
+	ph2_options_default (&options);
+	run (&options);
+
+	options.concurrent = true;
+	run (&options);
+
+	if (failures)
+	{
+		printf ("%d checks failed\n", failures);
+		return 1;
+	}
+
+	printf ("ok\n");
+
+	return 0;
+}